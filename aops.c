@@ -0,0 +1,250 @@
+/*
+ * Chunkfs address space operations
+ *
+ * Chunkfs inodes have their own page cache.  Each page is mapped to
+ * the continuation(s) holding that part of the file and read from or
+ * written to the client file at the matching client offset, so page
+ * cache hits never go near the continuation chain or a client file.
+ *
+ * (C) 2007-2008 Valerie Henson <val@nmt.edu>
+ */
+
+#include <linux/fs.h>
+#include <linux/pagemap.h>
+#include <linux/writeback.h>
+#include <linux/highmem.h>
+#include <linux/file.h>
+
+#include "chunkfs.h"
+#include "chunkfs_pool.h"
+#include "chunkfs_dev.h"
+#include "chunkfs_chunk.h"
+#include "chunkfs_i.h"
+
+/*
+ * Read or write the first len bytes of a page through the client
+ * files.  A page may straddle a continuation boundary, so do it a
+ * continuation at a time.  Parts of the page no continuation covers
+ * (holes, past EOF) read as zeroes.  The page must be locked.
+ */
+
+static int
+chunkfs_page_io(struct inode *inode, struct page *page, unsigned int len,
+		int rw)
+{
+	loff_t page_pos = page_offset(page);
+	struct chunkfs_chunk_info *ci;
+	struct chunkfs_cont_data cd;
+	struct file *client_file;
+	unsigned int offset = 0;
+	unsigned int seg;
+	char *kaddr;
+	ssize_t ret;
+	int err = 0;
+
+	if (rw == READ)
+		chunkfs_count(inode->i_sb, reads);
+	kaddr = kmap(page);
+	while (offset < len) {
+		/* Page straddles a continuation boundary */
+		if (offset && rw == READ)
+			chunkfs_count(inode->i_sb, read_hops);
+		err = chunkfs_map_cont(inode, page_pos + offset, rw,
+				       &client_file, &cd, &ci);
+		if (err == -ENOENT && rw == READ) {
+			memset(kaddr + offset, 0, len - offset);
+			err = 0;
+			break;
+		}
+		if (err)
+			break;
+
+		seg = min_t(u64, len - offset,
+			    cd.cd_start + cd.cd_len - (page_pos + offset));
+		if (rw == WRITE) {
+			ret = chunkfs_start_chunk_write(ci);
+			if (!ret) {
+				ret = kernel_write(client_file, kaddr + offset,
+						   seg, page_pos + offset -
+						   cd.cd_start);
+				chunkfs_end_chunk_write(ci);
+			}
+		} else
+			ret = kernel_read(client_file,
+					  page_pos + offset - cd.cd_start,
+					  kaddr + offset, seg);
+		fput(client_file);
+
+		if (ret < 0) {
+			err = ret;
+			break;
+		}
+		if (ret < seg) {
+			if (rw == WRITE) {
+				err = -EIO;
+				break;
+			}
+			/* Short client file, the rest is a hole */
+			memset(kaddr + offset + ret, 0, seg - ret);
+		}
+		offset += seg;
+	}
+	if (rw == READ && !err && len < PAGE_CACHE_SIZE)
+		memset(kaddr + len, 0, PAGE_CACHE_SIZE - len);
+	kunmap(page);
+	if (rw == READ)
+		flush_dcache_page(page);
+
+	chunkfs_debug("ino %lu index %lu len %u %s err %d\n", inode->i_ino,
+		page->index, len, rw == WRITE ? "write" : "read", err);
+	return err;
+}
+
+static int
+chunkfs_readpage(struct file *file, struct page *page)
+{
+	struct inode *inode = page->mapping->host;
+	int err;
+
+	err = chunkfs_page_io(inode, page, PAGE_CACHE_SIZE, READ);
+	if (err) {
+		ClearPageUptodate(page);
+		SetPageError(page);
+	} else {
+		SetPageUptodate(page);
+		ClearPageError(page);
+	}
+	unlock_page(page);
+	return err;
+}
+
+static int
+chunkfs_readpages(struct file *file, struct address_space *mapping,
+		  struct list_head *pages, unsigned nr_pages)
+{
+	return read_cache_pages(mapping, pages,
+				(filler_t *) chunkfs_readpage, file);
+}
+
+static int
+chunkfs_writepage(struct page *page, struct writeback_control *wbc)
+{
+	struct inode *inode = page->mapping->host;
+	loff_t i_size = i_size_read(inode);
+	pgoff_t end_index = i_size >> PAGE_CACHE_SHIFT;
+	unsigned int len = PAGE_CACHE_SIZE;
+	int err;
+
+	if (page->index >= end_index) {
+		len = i_size & (PAGE_CACHE_SIZE - 1);
+		/* Wholly past EOF, truncate got here first */
+		if (page->index > end_index || len == 0) {
+			unlock_page(page);
+			return 0;
+		}
+	}
+
+	set_page_writeback(page);
+	err = chunkfs_page_io(inode, page, len, WRITE);
+	if (err) {
+		SetPageError(page);
+		mapping_set_error(page->mapping, err);
+	}
+	unlock_page(page);
+	end_page_writeback(page);
+	return err;
+}
+
+/*
+ * Continuations are created here, where we still have a file and can
+ * return an error to write(), rather than in writeback.
+ */
+
+static int
+chunkfs_write_begin(struct file *file, struct address_space *mapping,
+		    loff_t pos, unsigned len, unsigned flags,
+		    struct page **pagep, void **fsdata)
+{
+	struct inode *inode = mapping->host;
+	pgoff_t index = pos >> PAGE_CACHE_SHIFT;
+	unsigned from = pos & (PAGE_CACHE_SIZE - 1);
+	struct page *page;
+	int err;
+
+	err = chunkfs_grow_to(file->f_dentry, pos + len - 1);
+	if (err)
+		return err;
+
+	page = grab_cache_page_write_begin(mapping, index, flags);
+	if (!page)
+		return -ENOMEM;
+	*pagep = page;
+
+	if (PageUptodate(page) || len == PAGE_CACHE_SIZE)
+		return 0;
+	/* Nothing on disk to preserve past EOF */
+	if (page_offset(page) >= i_size_read(inode)) {
+		zero_user_segments(page, 0, from, from + len, PAGE_CACHE_SIZE);
+		return 0;
+	}
+	err = chunkfs_page_io(inode, page, PAGE_CACHE_SIZE, READ);
+	if (err) {
+		unlock_page(page);
+		page_cache_release(page);
+		return err;
+	}
+	SetPageUptodate(page);
+	return 0;
+}
+
+/*
+ * Like simple_write_end(), except that a short copy into a page that
+ * was never read must not be passed off as the whole page: zeroing
+ * the rest would put zeroes over client data at writeback.  Take
+ * nothing and let the caller retry, as generic_write_end() does.
+ */
+
+static int
+chunkfs_write_end(struct file *file, struct address_space *mapping,
+		  loff_t pos, unsigned len, unsigned copied,
+		  struct page *page, void *fsdata)
+{
+	struct inode *inode = mapping->host;
+
+	if (!PageUptodate(page)) {
+		if (copied < len) {
+			copied = 0;
+			goto out;
+		}
+		SetPageUptodate(page);
+	}
+	if (pos + copied > i_size_read(inode))
+		i_size_write(inode, pos + copied);
+	set_page_dirty(page);
+ out:
+	unlock_page(page);
+	page_cache_release(page);
+	return copied;
+}
+
+/*
+ * Direct I/O bypasses the page cache in chunkfs_read_iter() and
+ * chunkfs_write_iter(), this only tells open() O_DIRECT is allowed.
+ */
+
+static ssize_t
+chunkfs_direct_IO(int rw, struct kiocb *iocb, struct iov_iter *iter,
+		  loff_t offset)
+{
+	return -EINVAL;
+}
+
+const struct address_space_operations chunkfs_aops = {
+	.readpage	= chunkfs_readpage,
+	.readpages	= chunkfs_readpages,
+	.writepage	= chunkfs_writepage,
+	.write_begin	= chunkfs_write_begin,
+	.write_end	= chunkfs_write_end,
+	.set_page_dirty	= __set_page_dirty_nobuffers,
+	.direct_IO	= chunkfs_direct_IO,
+};
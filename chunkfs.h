@@ -117,22 +117,58 @@ struct chunkfs_chkmagic {
 	__le32 x_chksum;
 };
 
-/* XXX use e2fsprogs/dev uuid and crc32 lib functions */
-/* XXX using __cpu_to_* so userland can share */
-/* #ifdef KERNEL? How does Jeff do it? */
+/*
+ * Checksums are CRC32C over the whole structure, with the checksum
+ * field itself taken as zero.  The kernel has crc32c() in lib/, and
+ * userland gets the same function from crc32c.c.
+ *
+ * Pools made before that stored the constant CHUNKFS_LEGACY_CHKSUM
+ * everywhere and don't have CHUNKFS_POOL_CRC32C set.  For those we
+ * also accept the constant, and write real checksums from then on.
+ *
+ * XXX use e2fsprogs/dev uuid lib functions
+ */
+
+#ifdef __KERNEL__
+#include <linux/crc32c.h>
+#else
+/* crc32c.c, the variants are there for crc32c_bench */
+__u32 crc32c(__u32 crc, const void *buf, unsigned int len);
+__u32 crc32c_bytewise(__u32 crc, const void *buf, unsigned int len);
+__u32 crc32c_slice8(__u32 crc, const void *buf, unsigned int len);
+__u32 crc32c_sse42(__u32 crc, const void *buf, unsigned int len);
+int crc32c_sse42_ok(void);
+#endif
+
+#define	CHUNKFS_LEGACY_CHKSUM	0x32323232
+
+static inline __u32 chunkfs_chksum(void *buf, unsigned int size)
+{
+	struct chunkfs_chkmagic *x = (struct chunkfs_chkmagic *) buf;
+	static const __le32 zero;
+	__u32 crc;
+
+	crc = crc32c(~0U, &x->x_magic, sizeof(x->x_magic));
+	crc = crc32c(crc, &zero, sizeof(zero));
+	crc = crc32c(crc, x + 1, size - sizeof(*x));
+	return ~crc;
+}
 
 static inline void write_chksum(void *buf, unsigned int size)
 {
 	struct chunkfs_chkmagic *x = (struct chunkfs_chkmagic *) buf;
-/*	x->x_chksum = __cpu_to_le32(crc32(buf, size)); */
-	x->x_chksum = __cpu_to_le32(0x32323232);
+
+	x->x_chksum = __cpu_to_le32(chunkfs_chksum(buf, size));
 }
 
-static inline int check_chksum(void *buf, unsigned int size)
+static inline int check_chksum(void *buf, unsigned int size, int legacy)
 {
 	struct chunkfs_chkmagic *x = (struct chunkfs_chkmagic *) buf;
-/*	return !(x->x_chksum == __cpu_to_le32(crc32(buf, size))); */
-	return (__le32_to_cpu(x->x_chksum) != 0x32323232);
+	__u32 chksum = __le32_to_cpu(x->x_chksum);
+
+	if (legacy && chksum == CHUNKFS_LEGACY_CHKSUM)
+		return 0;
+	return chksum != chunkfs_chksum(buf, size);
 }
 
 static inline int check_magic(void *buf, __u32 expected_magic) {
@@ -142,14 +178,15 @@ static inline int check_magic(void *buf, __u32 expected_magic) {
 /*
  * Generic function to check a piece of metadata just read off disk.
  * Checksum and magic number are -always- in the same location in all
- * metadata.
+ * metadata.  legacy is set for pools without CHUNKFS_POOL_CRC32C.
  */
 
-static inline int check_metadata(void *buf, unsigned int size, __u32 expected_magic)
+static inline int check_metadata(void *buf, unsigned int size,
+				 __u32 expected_magic, int legacy)
 {
 	if (check_magic(buf, expected_magic))
 		return 1;
-	if (check_chksum(buf, size))
+	if (check_chksum(buf, size, legacy))
 		return 2;
 	return 0;
 }
@@ -161,6 +198,9 @@ static inline int CHUNKFS_ROOT_INODE(struct inode *inode)
 	return inode->i_ino == inode->i_sb->s_root->d_inode->i_ino;
 }
 
+/* super.c */
+extern struct workqueue_struct *chunkfs_wq;
+
 /* dir.c */
 extern struct file_operations chunkfs_dir_fops;
 
@@ -168,8 +208,8 @@ extern struct file_operations chunkfs_dir_fops;
 extern struct file_operations chunkfs_file_fops;
 extern struct inode_operations chunkfs_file_iops;
 int chunkfs_new_inode(struct super_block *, struct inode **);
-void chunkfs_start_inode(struct inode *inode, struct inode *client_inode,
-			 u64 chunk_id);
+int chunkfs_start_inode(struct inode *inode, struct inode *client_inode,
+			u64 chunk_id);
 struct inode *chunkfs_iget(struct super_block *sb, unsigned long ino);
 int chunkfs_write_inode(struct inode *inode, struct writeback_control *wbc);
 void chunkfs_copy_up_inode(struct inode *, struct inode *);
@@ -192,36 +232,64 @@ void chunkfs_init_nd(struct inode *dir, struct dentry *dentry,
 void chunkfs_copy_up_nd(struct nameidata *nd, struct nameidata *client_nd);
 void chunkfs_copy_down_nd(struct nameidata *nd, struct nameidata *client_nd);
 
+/* aops.c */
+
+extern const struct address_space_operations chunkfs_aops;
+
 /* file.c */
 
 int chunkfs_setattr(struct dentry *dentry, struct iattr *attr);
 int chunkfs_permission(struct inode *, int);
 int chunkfs_open(struct inode *, struct file *);
+int chunkfs_release(struct inode *, struct file *);
 
 struct chunkfs_continuation;
+struct chunkfs_chunk_info;
 
 int chunkfs_open_cont_file(struct file *file, loff_t *ppos,
 			   struct file **client_file,
 			   struct chunkfs_continuation **ret_cont);
 void chunkfs_close_cont_file(struct file *file, struct file *client_file,
 			     struct chunkfs_continuation *cont);
+void chunkfs_cache_client_file(struct file *file, u64 uino,
+			       struct file *client_file,
+			       struct chunkfs_chunk_info *ci);
 void chunkfs_copy_down_file(struct file *file, loff_t *ppos,
 			    struct file *client_file, u64 client_start);
 
 /* cont.c */
 
-int chunkfs_get_next_inode(struct inode *head_inode,
-			   struct inode *prev_inode, struct inode **ret_inode);
+int chunkfs_get_next_inode(struct inode *head_inode, struct inode *prev_inode,
+			   struct inode **ret_inode,
+			   struct chunkfs_chunk_info **chunk, loff_t *start);
 int chunkfs_get_cont_at_offset(struct dentry *dentry, loff_t offset,
 			       struct chunkfs_continuation **ret_cont);
 int chunkfs_get_next_cont(struct dentry *head_dentry,
 			  struct chunkfs_continuation *prev_cont,
 			  struct chunkfs_continuation **next_cont);
-int chunkfs_create_continuation(struct file *file, loff_t *ppos,
+int chunkfs_create_continuation(struct dentry *head_dentry,
 				struct file **client_file,
 				struct chunkfs_continuation **ret_cont);
 void chunkfs_put_continuation(struct chunkfs_continuation *cont);
-int chunkfs_init_cont_data(struct dentry *client_dentry);
+void chunkfs_invalidate_cont_map(struct inode *inode);
+struct chunkfs_cont_data;
+int chunkfs_map_cont(struct inode *inode, loff_t pos, int rw,
+		     struct file **client_file, struct chunkfs_cont_data *cd,
+		     struct chunkfs_chunk_info **chunk);
+void chunkfs_mark_cont_dirty(struct inode *inode, loff_t pos);
+int chunkfs_sync_conts(struct inode *inode, loff_t start, loff_t end,
+		       int datasync);
+int chunkfs_grow_to(struct dentry *dentry, loff_t pos);
+void chunkfs_free_cont_map(struct inode *inode);
+int chunkfs_init_cont_data(struct super_block *sb, struct dentry *client_dentry);
+int chunkfs_init_root_cont_data(struct super_block *sb,
+				struct chunkfs_chunk_info *ci,
+				struct dentry *client_dentry);
+int chunkfs_truncate_conts(struct dentry *dentry, loff_t size);
+int chunkfs_client_lookup(struct chunkfs_chunk_info *ci, const char *name,
+			  unsigned int flags, struct path *path);
+int chunkfs_client_mkdir(struct chunkfs_chunk_info *ci, const char *name,
+			 umode_t mode);
 
 #endif	/* __KERNEL__ */
 
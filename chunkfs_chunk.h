@@ -37,9 +37,10 @@ struct chunkfs_chunk {
 #define	CHUNKFS_CHUNK_OFFSET	(CHUNKFS_CHUNK_BLK * CHUNKFS_BLK_SIZE)
 #define CHUNKFS_CHUNK_SIZE	(10 * 1024 * 1024) /* XXX should be dynamic */
 
-static inline int check_chunk(struct chunkfs_chunk *chunk)
+static inline int check_chunk(struct chunkfs_chunk *chunk, int legacy)
 {
-	return check_metadata(chunk, sizeof(*chunk), CHUNKFS_CHUNK_MAGIC);
+	return check_metadata(chunk, sizeof(*chunk), CHUNKFS_CHUNK_MAGIC,
+			      legacy);
 }
 
 /*
@@ -62,10 +63,38 @@ struct chunkfs_chunk_info {
 	struct buffer_head *ci_bh;
 	struct super_block *ci_sb;	/* Superblock of client fs in memory */
 	struct vfsmount *ci_mnt;
+	struct chunkfs_part *ci_part;	/* NULL if userland mounted it */
+	/*
+	 * Attach state, see chunkfs_get_chunk().  ci_mnt and ci_sb
+	 * change under ci_attach_lock, and only with ci_attach_mutex
+	 * held.  They are stable while you hold a use count.
+	 */
+	struct mutex ci_attach_mutex;
+	spinlock_t ci_attach_lock;
+	unsigned int ci_users;
+	unsigned long ci_last_used;	/* jiffies */
 	__u64 ci_flags;
 	__u64 ci_chunk_id;
 	char ci_client_fs[CHUNKFS_CLIENT_NAME_LEN];
 	/* The rest of the on-disk data is not normally used. */
+	/*
+	 * Cached client statfs numbers, refreshed at most every
+	 * CHUNKFS_STATS_AGE and adjusted as we place continuations.
+	 * See placement.c.
+	 */
+	spinlock_t ci_stats_lock;
+	unsigned long ci_stats_time;	/* jiffies, 0 if never read */
+	__u64 ci_bytes_total;
+	__u64 ci_bytes_free;
+	__u64 ci_inodes_total;
+	__u64 ci_inodes_free;
+	/* Dirty state, see dirty.c */
+	spinlock_t ci_dirty_lock;
+	unsigned int ci_writers;	/* Metadata changes in progress */
+	unsigned long ci_changes;	/* Metadata changes started */
+	unsigned long ci_clean_changes;	/* ci_changes at the last clean pass */
+	int ci_dirty;			/* Bit set on disk */
+	int ci_needs_check;		/* Was dirty at mount, leave for fsck */
 };
 
 #define CHUNKFS_IS_ROOT(ci)	(ci->ci_flags & CHUNKFS_ROOT)
@@ -81,5 +110,56 @@ static inline struct super_block * CHUNKFS_ROOT_SB(struct chunkfs_pool_info *pi)
 }
 
 struct chunkfs_chunk_info * chunkfs_find_chunk(struct chunkfs_pool_info *, u64);
+struct chunkfs_chunk_info *chunkfs_get_chunk(struct chunkfs_pool_info *, u64);
+int chunkfs_tryget_chunk(struct chunkfs_chunk_info *ci);
+void chunkfs_hold_chunk(struct chunkfs_chunk_info *ci);
+void chunkfs_put_chunk(struct chunkfs_chunk_info *ci);
+
+/* dirty.c */
+
+#define CHUNKFS_CLEAN_PERIOD	(5 * HZ)	/* Quiet time before clearing */
+
+int chunkfs_read_dirty_map(struct super_block *sb, struct chunkfs_dev_info *di);
+void chunkfs_free_dirty_map(struct chunkfs_dev_info *di);
+int chunkfs_start_chunk_write(struct chunkfs_chunk_info *ci);
+void chunkfs_end_chunk_write(struct chunkfs_chunk_info *ci);
+void chunkfs_clean_detaching_chunk(struct chunkfs_chunk_info *ci,
+				   struct super_block *sb);
+void chunkfs_init_clean(struct chunkfs_pool_info *pi);
+void chunkfs_start_clean(struct chunkfs_pool_info *pi);
+void chunkfs_stop_clean(struct chunkfs_pool_info *pi);
+
+/* part.c */
+
+struct chunkfs_part;
+
+int chunkfs_part_create(struct block_device *parent, ci_byte_t begin,
+			ci_byte_t end, struct chunkfs_part **ret_part);
+void chunkfs_part_destroy(struct chunkfs_part *part);
+struct vfsmount *chunkfs_part_mount(struct chunkfs_part *part,
+				    const char *fs_name, int flags,
+				    const char *options);
+int chunkfs_part_init(void);
+void chunkfs_part_exit(void);
+
+/* placement.c */
+
+#define CHUNKFS_STATS_AGE	HZ
+#define CHUNKFS_STATS_PERIOD	(5 * HZ)	/* Background refresh interval */
+#define CHUNKFS_STATS_BATCH	64		/* Chunks refreshed per interval */
+
+void chunkfs_refresh_chunk_stats(struct chunkfs_chunk_info *ci, int force);
+void chunkfs_guess_chunk_stats(struct chunkfs_chunk_info *ci);
+int chunkfs_init_pool_stats(struct chunkfs_pool_info *pi);
+void chunkfs_start_pool_stats(struct chunkfs_pool_info *pi);
+void chunkfs_stop_pool_stats(struct chunkfs_pool_info *pi);
+void chunkfs_destroy_pool_stats(struct chunkfs_pool_info *pi);
+int chunkfs_place_continuation(struct chunkfs_pool_info *pi,
+			       struct chunkfs_chunk_info *from, u64 len,
+			       u64 *to_chunk_id);
+int chunkfs_grow_in_place(struct chunkfs_chunk_info *ci, u64 len);
+const char *chunkfs_placement_name(int policy);
+int chunkfs_placement_policy(const char *name);
+void chunkfs_placement_debugfs(struct super_block *sb);
 
 #endif /* __KERNEL__ */
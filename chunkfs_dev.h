@@ -9,6 +9,8 @@
  *
  * - Information about which part of the device we manage
  * - Pointer to the first chunk header (root chunk is flagged)
+ * - Pointer to the chunk table, if mkfs wrote one
+ * - Pointer to the dirty chunk map, ditto
  *
  * Again, free/used information is known only by chunks, so we do not
  * keep summary info in the dev summary unless we find some
@@ -28,8 +30,111 @@ struct chunkfs_dev {
 	c_byte_t d_innards_end;
 	c_byte_t d_root_chunk;	/* Offset of chunk containing root, if here */
 	struct chunkfs_dev_desc d_next_dev; /* Next device in pool */
+	c_byte_t d_chunk_table;	/* Offset of chunk table, 0 if none */
+	c_byte_t d_chunk_table_len; /* Bytes, including header */
+	c_byte_t d_dirty_map;	/* Offset of dirty chunk map, 0 if none */
+	c_byte_t d_dirty_map_len; /* Bytes, including header */
 };
 
+/*
+ * Chunk table.  Every chunk on the device in one contiguous,
+ * checksummed run of blocks right after the dev summary, so mount can
+ * find all the chunks in a single read instead of chasing
+ * c_next_chunk, and one bad chunk summary doesn't hide the rest.
+ * The chain is still written for older kernels and as a fallback.
+ *
+ * The header is padded to an entry so entries never straddle blocks.
+ */
+
+#define	CHUNKFS_CTAB_MAGIC	0x7ab1e7ab
+
+struct chunkfs_ctab_entry {
+	__le64 e_chunk_id;
+	c_byte_t e_begin;	/* Offset of the chunk summary */
+	c_byte_t e_end;
+	__le64 e_flags;		/* Copy of c_flags */
+	char e_client_fs[32];	/* Copy of c_client_fs */
+};
+
+struct chunkfs_ctab {
+	__le32 t_magic;
+	__le32 t_chksum;
+	__le64 t_nr;		/* Number of entries */
+	__le32 t_entry_size;
+	__le32 t_pad[11];
+	struct chunkfs_ctab_entry t_entries[];
+};
+
+static inline __u64 chunkfs_ctab_bytes(__u64 nr)
+{
+	return sizeof(struct chunkfs_ctab) +
+		nr * sizeof(struct chunkfs_ctab_entry);
+}
+
+static inline int check_ctab(struct chunkfs_ctab *ctab, __u64 len,
+			     int legacy)
+{
+	int err;
+
+	if (len < sizeof(struct chunkfs_ctab))
+		return 3;
+	err = check_metadata(ctab, len, CHUNKFS_CTAB_MAGIC, legacy);
+	if (err)
+		return err;
+	/* Divide rather than multiply, t_nr is whatever was on disk */
+	if (__le32_to_cpu(ctab->t_entry_size) !=
+	    sizeof(struct chunkfs_ctab_entry) ||
+	    __le64_to_cpu(ctab->t_nr) > (len - sizeof(struct chunkfs_ctab)) /
+	    sizeof(struct chunkfs_ctab_entry))
+		return 3;
+	return 0;
+}
+
+/*
+ * Dirty chunk map.  One bit per chunk id, set before the first
+ * metadata change to a chunk reaches the disk and cleared once the
+ * chunk's client file system has been synced and left alone for a
+ * while.  After a crash only the chunks with their bit set need
+ * checking.  A map that fails its checksum means every chunk is
+ * dirty.
+ */
+
+#define	CHUNKFS_DIRTY_MAGIC	0xd1e7d1e7
+
+struct chunkfs_dirty_map {
+	__le32 m_magic;
+	__le32 m_chksum;
+	__le64 m_nr;		/* Number of bits */
+	__le64 m_pad[6];
+	__u8 m_bits[];		/* Bit n of byte n / 8 is chunk id n */
+};
+
+static inline __u64 chunkfs_dirty_map_bytes(__u64 nr)
+{
+	return sizeof(struct chunkfs_dirty_map) + (nr + 7) / 8;
+}
+
+static inline int check_dirty_map(struct chunkfs_dirty_map *map, __u64 len,
+				  int legacy)
+{
+	int err;
+
+	err = check_metadata(map, len, CHUNKFS_DIRTY_MAGIC, legacy);
+	if (err)
+		return err;
+	if (chunkfs_dirty_map_bytes(__le64_to_cpu(map->m_nr)) > len)
+		return 3;
+	return 0;
+}
+
+static inline int chunkfs_dirty_map_test(struct chunkfs_dirty_map *map,
+					 __u64 chunk_id)
+{
+	if (chunk_id >= __le64_to_cpu(map->m_nr))
+		return 0;
+	return (map->m_bits[chunk_id / 8] >> (chunk_id % 8)) & 1;
+}
+
 /*
  * Dev flags
  */
@@ -41,9 +146,9 @@ struct chunkfs_dev {
 #define	CHUNKFS_DEV_BLK		(CHUNKFS_POOL_BLK + 1)
 #define	CHUNKFS_DEV_OFFSET	(CHUNKFS_DEV_BLK * CHUNKFS_BLK_SIZE)
 
-static inline int check_dev(struct chunkfs_dev *dev)
+static inline int check_dev(struct chunkfs_dev *dev, int legacy)
 {
-	return check_metadata(dev, sizeof(*dev), CHUNKFS_DEV_MAGIC);
+	return check_metadata(dev, sizeof(*dev), CHUNKFS_DEV_MAGIC, legacy);
 }
 
 #ifdef __KERNEL__
@@ -55,6 +160,14 @@ struct chunkfs_dev_info {
 	struct chunkfs_chunk_info *di_root_chunk;
 	struct buffer_head *di_bh;
 	__u64 di_flags;
+	/* Dirty chunk map, see dirty.c */
+	struct chunkfs_dirty_map *di_dirty;	/* NULL if the dev has none */
+	struct chunkfs_dirty_map *di_dirty_buf;	/* Copy being written out */
+	__u64 di_dirty_len;
+	spinlock_t di_dirty_lock;		/* Protects di_dirty, seq */
+	struct mutex di_dirty_mutex;		/* Serializes writing it out */
+	__u64 di_dirty_seq;			/* Bumped on every change */
+	__u64 di_dirty_flushed;			/* Last seq on disk */
 	/* The rest of the on-disk data is not normally used. */
 };
 
@@ -12,25 +12,102 @@
 #define	CHUNKFS_INODE_MAGIC	0x10de10de
 
 /*
- * The on-disk version of the chunkfs continuation data is stored as
- * strings inname/value pairs.  They are:
- *
- * "next" "<inode num>" - next inode in the file
- * "prev" - ditto
- * "start" "<byte offset>" - byte offset of file data in this inode
- * "len" "<number bytes>" - length of file data stored in this inode
+ * Inode/chunk number and back again.  A unified inode number (uino)
+ * is the chunk id in the top bits and the client inode number in the
+ * low "ino bits".  The split is chosen at mkfs time and recorded in
+ * the pool summary (p_chunk_bits).  Pools made before that was
+ * recorded use the original 32 bit layout: 4 bits of chunk id, 28
+ * bits of client inode.
  */
 
+#define	CHUNKFS_UINO_BITS		64
+#define	CHUNKFS_DEFAULT_CHUNK_BITS	24
+/* Leave at least 32 bits for client inode numbers */
+#define	CHUNKFS_MAX_CHUNK_BITS		(CHUNKFS_UINO_BITS - 32)
+#define	CHUNKFS_LEGACY_CHUNK_BITS	4
+#define	CHUNKFS_LEGACY_INO_BITS		28
+
+#define __UINO_TO_CHUNK_ID(ino_bits, uino)	((__u64)(uino) >> (ino_bits))
+#define __UINO_TO_INO(ino_bits, uino)	\
+	((__u64)(uino) & ((1ULL << (ino_bits)) - 1))
+#define __MAKE_UINO(ino_bits, chunk_id, ino)	\
+	(((__u64)(chunk_id) << (ino_bits)) | (__u64)(ino))
+
 /*
- * Inode/chunk number and back again
+ * The on-disk version of the chunkfs continuation data is a single
+ * fixed-size little-endian record stored in the CHUNKFS_CONT_XATTR
+ * xattr of each client inode:
+ *
+ * cr_next_chunk, cr_next_ino - chunk and client inode of the next
+ *	inode in the file
+ * cr_prev_chunk, cr_prev_ino - ditto
+ * cr_start - byte offset of file data in this inode
+ * cr_len - length of file data stored in this inode
+ *
+ * Chunk and inode are stored separately so the record doesn't depend
+ * on the pool's uino layout.  Version 1 records stored legacy 32 bit
+ * uinos (struct chunkfs_cont_v1); earlier still, the data was decimal
+ * strings in the "user.next", "user.prev", "user.start" and
+ * "user.len" xattrs.  Both are converted to the current record the
+ * first time the inode is read.
  */
 
-#define UINO_TO_CHUNK_ID(ino)	((ino & 0xF0000000ULL) >> 28)
-#define UINO_TO_INO(ino)	(ino & 0x0FFFFFFFULL)
-#define MAKE_UINO(chunk_id, ino)	((chunk_id << 28) | ino)
+#define	CHUNKFS_CONT_XATTR	"user.chunkfs.cont"
+#define	CHUNKFS_CONT_VERSION	2
+
+struct chunkfs_cont {
+	__le32 cr_magic;
+	__le32 cr_chksum;
+	__le32 cr_version;
+	__le32 cr_flags;
+	__le64 cr_next_chunk;
+	c_inode_num_t cr_next_ino;
+	__le64 cr_prev_chunk;
+	c_inode_num_t cr_prev_ino;
+	c_byte_t cr_start;
+	c_byte_t cr_len;
+};
+
+struct chunkfs_cont_v1 {
+	__le32 cr_magic;
+	__le32 cr_chksum;
+	__le32 cr_version;
+	__le32 cr_flags;
+	c_inode_num_t cr_next;
+	c_inode_num_t cr_prev;
+	c_byte_t cr_start;
+	c_byte_t cr_len;
+};
+
+static inline int check_cont(struct chunkfs_cont *rec, int legacy)
+{
+	return check_metadata(rec, sizeof(*rec), CHUNKFS_INODE_MAGIC, legacy);
+}
+
+/* Only ever written by kernels with the constant checksum */
+static inline int check_cont_v1(struct chunkfs_cont_v1 *rec)
+{
+	return check_metadata(rec, sizeof(*rec), CHUNKFS_INODE_MAGIC, 1);
+}
+
+/*
+ * Bytes of file a continuation covers.  New ones start at twice the
+ * length of the one before, and the tail grows in place while its
+ * chunk has room, so a file that keeps growing ends up in a few big
+ * continuations instead of thousands of small ones.  See cont.c.
+ */
+#define CHUNKFS_CONT_LEN	(10 * 4096)		/* Smallest */
+#define CHUNKFS_CONT_MAX_LEN	(256 * 1024 * 1024)	/* Largest we grow to */
 
 #ifdef __KERNEL__
 
+/* Needs chunkfs_pool.h; sb is the chunkfs superblock */
+#define UINO_TO_CHUNK_ID(sb, uino)	\
+	__UINO_TO_CHUNK_ID(CHUNKFS_PI(sb)->pi_ino_bits, uino)
+#define UINO_TO_INO(sb, uino)	__UINO_TO_INO(CHUNKFS_PI(sb)->pi_ino_bits, uino)
+#define MAKE_UINO(sb, chunk_id, ino)	\
+	__MAKE_UINO(CHUNKFS_PI(sb)->pi_ino_bits, chunk_id, ino)
+
 struct chunkfs_cont_data {
 	ci_inode_num_t cd_next;
 	ci_inode_num_t cd_prev;
@@ -38,6 +115,22 @@ struct chunkfs_cont_data {
 	ci_byte_t cd_len;
 };
 
+/*
+ * In-memory copy of the continuation chain of a file, sorted by
+ * cd_start so that a file offset can be found with a binary search
+ * instead of a walk from the head.  Built from disk the first time
+ * it is needed and thrown away whenever the chain changes shape in a
+ * way we don't track incrementally (e.g. truncate).
+ */
+
+struct chunkfs_cont_map {
+	struct chunkfs_continuation *cm_conts;
+	unsigned int cm_nr;
+	unsigned int cm_alloc;
+	int cm_valid;
+	int cm_lost_dirty;	/* Freed with dirty conts, fsync them all */
+};
+
 /*
  * This is the information that must be maintained in memory in
  * addition to the client fs's in-memory inode and the VFS's inode.
@@ -48,25 +141,64 @@ struct chunkfs_inode_info {
 	struct inode ii_vnode;
 	/* Head client inode - keeps our inode state */
 	struct inode *ii_client_inode;
-	/* Protects on-disk continuation list */
+	/* Chunk of the head client inode, we hold a use count on it */
+	struct chunkfs_chunk_info *ii_chunk;
+	/* Protects on-disk continuation list and ii_cont_map */
 	struct mutex ii_continuations_lock;
+	/* Cached continuation map, see above */
+	struct chunkfs_cont_map ii_cont_map;
 };
 
 /*
- * Info for each continuation in the file.  Loaded as needed and not
- * cached because that's hard, mkay.
+ * Info for each continuation in the file.  The copies in
+ * ii_cont_map own a reference to co_dentry; callers of
+ * chunkfs_get_cont_at_offset() get their own copy which must be
+ * released with chunkfs_put_continuation().
  */
 
 struct chunkfs_continuation {
 	struct inode *co_inode;
 	struct dentry *co_dentry;
 	struct vfsmount *co_mnt;
+	struct chunkfs_chunk_info *co_chunk;	/* Use count held */
 	struct chunkfs_cont_data co_cd;
 	u64 co_chunk_id;
 	/* Can be reconstructed */
 	u64 co_uino;
+	/* Client file for page cache I/O, only set in ii_cont_map */
+	struct file *co_file;
+	/* Written since the last fsync, only kept in ii_cont_map */
+	int co_dirty;
 };
 
+/*
+ * Client files opened on behalf of one open chunkfs file, kept in
+ * file->private_data so that each read or write doesn't have to open
+ * and close the client inode again.  Keyed by continuation uino and
+ * recycled least recently used first.  Each holds a use count on its
+ * chunk, so the client fs can't be detached from under it.
+ */
+
+#define	CHUNKFS_CLIENT_FILES	4
+
+struct chunkfs_client_file {
+	u64 cf_uino;
+	struct file *cf_file;
+	struct chunkfs_chunk_info *cf_chunk;
+	unsigned long cf_last_used;
+};
+
+struct chunkfs_file_info {
+	struct mutex fi_lock;
+	unsigned long fi_clock;
+	struct chunkfs_client_file fi_files[CHUNKFS_CLIENT_FILES];
+};
+
+static inline struct chunkfs_file_info *CHUNKFS_F(struct file *file)
+{
+	return (struct chunkfs_file_info *) file->private_data;
+}
+
 /*
  * We need a single client dentry hanging off the parent dentry, as
  * well as a client version of the nameidata.
@@ -75,6 +207,7 @@ struct chunkfs_continuation {
 struct chunkfs_dentry_priv {
 	struct dentry *dp_client_dentry;
 	struct nameidata *dp_client_nd;
+	struct chunkfs_chunk_info *dp_chunk;	/* Use count held */
 };
 
 static inline struct chunkfs_inode_info *CHUNKFS_I(struct inode * inode)
@@ -82,6 +215,21 @@ static inline struct chunkfs_inode_info *CHUNKFS_I(struct inode * inode)
 	return container_of(inode, struct chunkfs_inode_info, ii_vnode);
 }
 
+/*
+ * Bracket a metadata change to the chunk an inode lives in, so the
+ * chunk is marked dirty on disk first.  See dirty.c.
+ */
+
+static inline int chunkfs_start_write(struct inode *inode)
+{
+	return chunkfs_start_chunk_write(CHUNKFS_I(inode)->ii_chunk);
+}
+
+static inline void chunkfs_end_write(struct inode *inode)
+{
+	chunkfs_end_chunk_write(CHUNKFS_I(inode)->ii_chunk);
+}
+
 static inline struct inode *get_client_inode(struct inode *inode)
 {
 	struct chunkfs_inode_info *ii = CHUNKFS_I(inode);
@@ -24,8 +24,21 @@ struct chunkfs_pool {
 	__le32 p_chksum;
 	__le64 p_flags;
 	struct chunkfs_dev_desc p_root_desc;	/* Device containing root */
+	__le32 p_chunk_bits;	/* Chunk id bits in a uino, 0 for legacy */
+	__le32 p_pad;
 };
 
+/*
+ * Pool flags
+ */
+
+#define	CHUNKFS_POOL_CRC32C	0x00000001ULL	/* Real checksums, see chunkfs.h */
+
+static inline int chunkfs_legacy_chksum(struct chunkfs_pool *pool)
+{
+	return !(__le64_to_cpu(pool->p_flags) & CHUNKFS_POOL_CRC32C);
+}
+
 /*
  * Offset from beginning of partition of the pool summary/superblock.
  * A large initial offset avoids MBR, boot blocks, etc.
@@ -38,29 +51,124 @@ struct chunkfs_pool {
 
 #ifdef __KERNEL__
 
+/*
+ * Continuation placement policies (mount option placement=)
+ */
+
+enum {
+	CHUNKFS_PLACE_LEAST_FULL,	/* Chunk with the most free space */
+	CHUNKFS_PLACE_SAME_DEV,		/* Least full on the same device first */
+	CHUNKFS_PLACE_ROUND_ROBIN,	/* Stripe across chunks in turn */
+	CHUNKFS_PLACE_NR,
+};
+
+/*
+ * Mount options, parsed before we read the pool since chunks are
+ * attached while reading it.
+ */
+
+struct chunkfs_mount_opts {
+	int mo_placement;
+	char *mo_client_opts;
+	int mo_lazy;
+	unsigned int mo_idle_timeout;	/* Seconds */
+};
+
+#define CHUNKFS_DEFAULT_IDLE_TIMEOUT	300
+
 static inline int check_pool(struct chunkfs_pool *pool)
 {
-	return check_metadata(pool, sizeof(*pool), CHUNKFS_SUPER_MAGIC);
+	return check_metadata(pool, sizeof(*pool), CHUNKFS_SUPER_MAGIC,
+			      chunkfs_legacy_chksum(pool));
 }
 
 #include <linux/buffer_head.h>
+#include <linux/rcupdate.h>
+#include <linux/atomic.h>
+#include <linux/percpu.h>
+#include <linux/percpu_counter.h>
+#include <linux/workqueue.h>
+
+/*
+ * Every chunk in the pool, indexed by chunk id.  Built once all the
+ * devices have been read at mount time and read under RCU, so
+ * chunkfs_find_chunk() is a single array lookup.  Chunk ids are
+ * handed out densely by mkfs, so a flat array is fine.
+ */
+
+struct chunkfs_chunk_table {
+	__u64 ct_nr;		/* One more than the highest chunk id */
+	struct chunkfs_chunk_info *ct_chunks[];
+};
+
+/*
+ * Counts of what continuation handling is costing, for profiling.
+ * Per cpu, so counting on the I/O path doesn't bounce a shared
+ * cacheline, and summed for debugfs chunkfs/<dev>/stats, see
+ * super.c.  All u64, the summing relies on it.
+ */
+struct chunkfs_stats {
+	u64 st_lookups;		/* File offset to continuation */
+	u64 st_map_builds;	/* Continuation chains read from disk */
+	u64 st_hops;		/* Next pointers followed doing it */
+	u64 st_xattr_loads;	/* Continuation records read */
+	u64 st_reads;		/* Page and O_DIRECT reads */
+	u64 st_read_hops;	/* Continuation boundaries they crossed */
+	u64 st_creates;		/* New continuations */
+	u64 st_cross_creates;	/* ...in a different chunk from prev */
+	u64 st_client_opens;
+	u64 st_fsyncs;
+	u64 st_fsync_conts;	/* Continuations synced by them */
+};
 
 struct chunkfs_pool_info {
 	struct list_head pi_dlist_head; /* List of devices in this pool */
+	struct chunkfs_chunk_table __rcu *pi_chunk_table;
 	struct chunkfs_dev_info *pi_root_dev;
 	struct buffer_head *pi_bh;
 	/* Use bytes instead of blocks - block size may vary */
 	/*
 	 * Note that with shared storage or dynamically allocated
 	 * inodes, you don't want to assume that total = used + free
+	 *
+	 * Sums of the chunks' cached statfs numbers, kept up to date
+	 * as each chunk's cache changes so statfs() never has to ask
+	 * every client.  Chunks nobody has looked at yet aren't in
+	 * them.  See placement.c.
 	 */
-	__u64 pi_bytes_total;
-	__u64 pi_bytes_free;
-	__u64 pi_bytes_used;
-	__u64 pi_inodes_total;
-	__u64 pi_inodes_free;
-	__u64 pi_inodes_used;
+	struct percpu_counter pi_bytes_total;
+	struct percpu_counter pi_bytes_free;
+	struct percpu_counter pi_inodes_total;
+	struct percpu_counter pi_inodes_free;
+	struct delayed_work pi_stats_work;	/* Trickle refresh of chunk stats */
+	__u64 pi_stats_cursor;			/* Next chunk id to refresh */
 	__u64 pi_flags;
+	int pi_legacy_chksum;	/* Made before CHUNKFS_POOL_CRC32C */
+	/* Unified inode number layout, see chunkfs_i.h */
+	unsigned int pi_chunk_bits;
+	unsigned int pi_ino_bits;
+	/* Passed on when mounting client file systems, see part.c */
+	int pi_client_flags;
+	char *pi_client_opts;
+	/* Whose client files these are, whoever asks, see cont.c */
+	const struct cred *pi_cred;
+	/* Attach chunks on first use and detach idle ones, see super.c */
+	int pi_lazy;
+	unsigned long pi_idle_timeout;	/* jiffies, 0 for never */
+	struct delayed_work pi_idle_work;
+	/* Clears dirty chunks once they go quiet, see dirty.c */
+	struct delayed_work pi_clean_work;
+	/* Continuation placement, see placement.c */
+	int pi_placement;
+	atomic64_t pi_place_cursor;
+	atomic64_t pi_place_count[CHUNKFS_PLACE_NR];
+	atomic64_t pi_place_fallback;
+	atomic64_t pi_place_nospace;
+	atomic64_t pi_place_cross_dev;
+	atomic64_t pi_place_refresh;
+	atomic64_t pi_place_grow;
+	struct chunkfs_stats __percpu *pi_stats;
+	struct dentry *pi_debugfs;
 };
 
 static inline struct chunkfs_pool_info * CHUNKFS_PI(struct super_block *sb)
@@ -68,6 +176,10 @@ static inline struct chunkfs_pool_info * CHUNKFS_PI(struct super_block *sb)
 	return sb->s_fs_info;
 }
 
+#define chunkfs_count(sb, stat)	chunkfs_count_add(sb, stat, 1)
+#define chunkfs_count_add(sb, stat, n)				\
+	this_cpu_add(CHUNKFS_PI(sb)->pi_stats->st_##stat, n)
+
 static inline struct chunkfs_pool * CHUNKFS_POOL(struct chunkfs_pool_info *pi)
 {
 	return (struct chunkfs_pool *) pi->pi_bh->b_data;
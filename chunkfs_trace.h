@@ -0,0 +1,193 @@
+/*
+ * Chunkfs tracepoints
+ *
+ * Cheap enough to leave in: when nobody has enabled them they cost a
+ * not-taken branch.  Turn them on with
+ *
+ *	echo 1 > /sys/kernel/debug/tracing/events/chunkfs/enable
+ *
+ * super.c defines CREATE_TRACE_POINTS and so holds the tracepoints
+ * themselves.
+ *
+ * (C) 2007-2008 Valerie Henson <val@nmt.edu>
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM chunkfs
+
+#if !defined(_CHUNKFS_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _CHUNKFS_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/*
+ * File offset to continuation, from the continuation map.
+ */
+TRACE_EVENT(chunkfs_cont_lookup,
+	TP_PROTO(struct inode *inode, loff_t pos, u64 chunk_id, loff_t start,
+		 u64 len, int err),
+	TP_ARGS(inode, pos, chunk_id, start, len, err),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(ino_t,		ino)
+		__field(loff_t,		pos)
+		__field(u64,		chunk_id)
+		__field(loff_t,		start)
+		__field(u64,		len)
+		__field(int,		err)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= inode->i_sb->s_dev;
+		__entry->ino		= inode->i_ino;
+		__entry->pos		= pos;
+		__entry->chunk_id	= chunk_id;
+		__entry->start		= start;
+		__entry->len		= len;
+		__entry->err		= err;
+	),
+
+	TP_printk("dev %d,%d ino %lx pos %lld chunk %llu start %lld len %llu err %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  (unsigned long) __entry->ino, __entry->pos,
+		  __entry->chunk_id, __entry->start, __entry->len,
+		  __entry->err)
+);
+
+/*
+ * One next pointer followed on disk, while building the map.
+ */
+TRACE_EVENT(chunkfs_cont_hop,
+	TP_PROTO(struct inode *inode, u64 from_uino, u64 to_uino, int err),
+	TP_ARGS(inode, from_uino, to_uino, err),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(ino_t,		ino)
+		__field(u64,		from_uino)
+		__field(u64,		to_uino)
+		__field(int,		err)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= inode->i_sb->s_dev;
+		__entry->ino		= inode->i_ino;
+		__entry->from_uino	= from_uino;
+		__entry->to_uino	= to_uino;
+		__entry->err		= err;
+	),
+
+	TP_printk("dev %d,%d ino %lx from %llx to %llx err %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  (unsigned long) __entry->ino, __entry->from_uino,
+		  __entry->to_uino, __entry->err)
+);
+
+TRACE_EVENT(chunkfs_cont_create,
+	TP_PROTO(struct inode *inode, u64 from_chunk_id, u64 to_chunk_id,
+		 loff_t start, u64 len, int err),
+	TP_ARGS(inode, from_chunk_id, to_chunk_id, start, len, err),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(ino_t,		ino)
+		__field(u64,		from_chunk_id)
+		__field(u64,		to_chunk_id)
+		__field(loff_t,		start)
+		__field(u64,		len)
+		__field(int,		err)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= inode->i_sb->s_dev;
+		__entry->ino		= inode->i_ino;
+		__entry->from_chunk_id	= from_chunk_id;
+		__entry->to_chunk_id	= to_chunk_id;
+		__entry->start		= start;
+		__entry->len		= len;
+		__entry->err		= err;
+	),
+
+	TP_printk("dev %d,%d ino %lx chunk %llu -> %llu start %lld len %llu err %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  (unsigned long) __entry->ino, __entry->from_chunk_id,
+		  __entry->to_chunk_id, __entry->start, __entry->len,
+		  __entry->err)
+);
+
+/*
+ * A client file opened on behalf of a chunkfs file.
+ */
+TRACE_EVENT(chunkfs_client_open,
+	TP_PROTO(struct inode *inode, u64 chunk_id, struct dentry *client_dentry,
+		 int err),
+	TP_ARGS(inode, chunk_id, client_dentry, err),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(ino_t,		ino)
+		__field(u64,		chunk_id)
+		__field(ino_t,		client_ino)
+		__field(int,		err)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= inode->i_sb->s_dev;
+		__entry->ino		= inode->i_ino;
+		__entry->chunk_id	= chunk_id;
+		__entry->client_ino	= client_dentry->d_inode ?
+					  client_dentry->d_inode->i_ino : 0;
+		__entry->err		= err;
+	),
+
+	TP_printk("dev %d,%d ino %lx chunk %llu client ino %lu err %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  (unsigned long) __entry->ino, __entry->chunk_id,
+		  (unsigned long) __entry->client_ino, __entry->err)
+);
+
+/*
+ * fsync fan-out: nr continuations handed out, then all of them back.
+ */
+DECLARE_EVENT_CLASS(chunkfs_sync_class,
+	TP_PROTO(struct inode *inode, unsigned int nr, int err),
+	TP_ARGS(inode, nr, err),
+
+	TP_STRUCT__entry(
+		__field(dev_t,		dev)
+		__field(ino_t,		ino)
+		__field(unsigned int,	nr)
+		__field(int,		err)
+	),
+
+	TP_fast_assign(
+		__entry->dev		= inode->i_sb->s_dev;
+		__entry->ino		= inode->i_ino;
+		__entry->nr		= nr;
+		__entry->err		= err;
+	),
+
+	TP_printk("dev %d,%d ino %lx continuations %u err %d",
+		  MAJOR(__entry->dev), MINOR(__entry->dev),
+		  (unsigned long) __entry->ino, __entry->nr, __entry->err)
+);
+
+DEFINE_EVENT(chunkfs_sync_class, chunkfs_sync_conts_start,
+	TP_PROTO(struct inode *inode, unsigned int nr, int err),
+	TP_ARGS(inode, nr, err)
+);
+
+DEFINE_EVENT(chunkfs_sync_class, chunkfs_sync_conts_end,
+	TP_PROTO(struct inode *inode, unsigned int nr, int err),
+	TP_ARGS(inode, nr, err)
+);
+
+#endif /* _CHUNKFS_TRACE_H */
+
+/* Out of tree, so the Makefile adds our directory to the include path */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE chunkfs_trace
+#include <trace/define_trace.h>
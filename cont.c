@@ -6,71 +6,196 @@
  */
 
 #include <linux/xattr.h>
+#include <linux/slab.h>
+#include <linux/file.h>
+#include <linux/cred.h>
+#include <linux/namei.h>
+#include <linux/mount.h>
+#include <linux/vmalloc.h>
 #include "chunkfs.h"
 #include "chunkfs_pool.h"
 #include "chunkfs_dev.h"
 #include "chunkfs_chunk.h"
 #include "chunkfs_i.h"
+#include "chunkfs_trace.h"
 
 /*
- * Wow... all hack, all the time.  Don't try this at home, kids.
+ * Old-style continuation data: four decimal strings in separate
+ * "user.*" xattrs.  Only read now, to migrate inodes written by
+ * earlier versions.
  */
 
+static char *legacy_cont_names[] = {
+	"user.next", "user.prev", "user.start", "user.len",
+};
+
 static int
-get_set_cont_data(struct dentry *dentry, char *name, u64 value,
-		   u64 *ret_value, int type)
+get_legacy_cont_value(struct dentry *dentry, char *name, u64 *ret_value)
 {
-	/* Yaaaaaaay potential buffer overflow */
-	char value_str[50]; /* XXX */
-	char full_name[50]; /* XXX */
-
-	/* Our continuation data is stored in the "user" xattr namespace */
-	char prefix[] = "user.";
+	char value_str[24]; /* 20 digits for a u64 plus slop */
 	ssize_t size;
-	int err = 0;
 
-	chunkfs_debug("%s for inode %lu (%s)",
-		name, dentry->d_inode->i_ino, type ? "set" : "get");
-	/* Make our "user.name" xattr name */
-	sprintf(full_name, "%s%s", prefix, name);
-	if (type == 0) {
-		size = generic_getxattr(dentry, full_name, value_str,
-				sizeof(value_str));
-		if (size >= 0) {
-			/* No automatic null termination... */
-			value_str[size] = '\0';
-			*ret_value = simple_strtoull(value_str, NULL, 10);
-		} else {
-			err = size;
-		}
-		chunkfs_debug("%s=%llu ", name, *ret_value);
-	} else {
-		/* XXX Pad out to max number of characters to avoid ENOSPC */
-		sprintf(value_str, "%llu", value);
-		err = generic_setxattr(dentry, full_name, value_str,
-				       strlen(value_str) + 1, 0);
-		chunkfs_debug("%s=%s ", name, value_str);
+	size = generic_getxattr(dentry, name, value_str,
+				sizeof(value_str) - 1);
+	if (size < 0)
+		return size;
+	/* No automatic null termination... */
+	value_str[size] = '\0';
+	*ret_value = simple_strtoull(value_str, NULL, 10);
+	chunkfs_debug("%s=%llu\n", name, *ret_value);
+	return 0;
+}
+
+static int
+get_legacy_cont_data(struct dentry *dentry, struct chunkfs_cont_data *cd)
+{
+	u64 *values[] = {
+		&cd->cd_next, &cd->cd_prev, &cd->cd_start, &cd->cd_len,
+	};
+	int err;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(legacy_cont_names); i++) {
+		err = get_legacy_cont_value(dentry, legacy_cont_names[i],
+					    values[i]);
+		if (err)
+			return err;
 	}
-	/* XXX ENOSPC handling */
-	chunkfs_debug("err %d\n", err);
-	return err;
+	return 0;
+}
+
+static void
+remove_legacy_cont_data(struct dentry *dentry)
+{
+	int i;
+
+	/* Best effort, a stale copy is ignored once the record exists */
+	for (i = 0; i < ARRAY_SIZE(legacy_cont_names); i++)
+		generic_removexattr(dentry, legacy_cont_names[i]);
+}
+
+/*
+ * Convert between the on-disk record and the in-memory version.  In
+ * memory, next/prev are uinos in the pool's layout; sb is the
+ * chunkfs superblock.
+ */
+
+static void
+cont_data_to_disk(struct super_block *sb, struct chunkfs_cont_data *cd,
+		  struct chunkfs_cont *rec)
+{
+	memset(rec, 0, sizeof(*rec));
+	rec->cr_magic = cpu_to_le32(CHUNKFS_INODE_MAGIC);
+	rec->cr_version = cpu_to_le32(CHUNKFS_CONT_VERSION);
+	if (cd->cd_next) {
+		rec->cr_next_chunk = cpu_to_le64(UINO_TO_CHUNK_ID(sb, cd->cd_next));
+		rec->cr_next_ino = cpu_to_le64(UINO_TO_INO(sb, cd->cd_next));
+	}
+	if (cd->cd_prev) {
+		rec->cr_prev_chunk = cpu_to_le64(UINO_TO_CHUNK_ID(sb, cd->cd_prev));
+		rec->cr_prev_ino = cpu_to_le64(UINO_TO_INO(sb, cd->cd_prev));
+	}
+	rec->cr_start = cpu_to_le64(cd->cd_start);
+	rec->cr_len = cpu_to_le64(cd->cd_len);
+	write_chksum(rec, sizeof(*rec));
+}
+
+/*
+ * A chunk or inode number too big for the pool's layout would fold
+ * into some other uino, so refuse it.
+ */
+
+static int
+cont_link_ok(struct super_block *sb, __le64 chunk, __le64 ino)
+{
+	struct chunkfs_pool_info *pi = CHUNKFS_PI(sb);
+
+	if ((le64_to_cpu(chunk) >> pi->pi_chunk_bits) ||
+	    (le64_to_cpu(ino) >> pi->pi_ino_bits)) {
+		printk(KERN_ERR "chunkfs: continuation link %llu/%llu out of range\n",
+			le64_to_cpu(chunk), le64_to_cpu(ino));
+		return 0;
+	}
+	return 1;
 }
 
 static int
-set_cont_data(struct dentry *dentry, struct chunkfs_cont_data *cd)
+cont_data_from_disk(struct super_block *sb, struct chunkfs_cont *rec,
+		    struct chunkfs_cont_data *cd)
 {
 	int err;
 
-	err = get_set_cont_data(dentry, "next", cd->cd_next, NULL, 1);
-	if (err)
-		goto out;
-	err = get_set_cont_data(dentry, "prev", cd->cd_prev, NULL, 1);
-	if (err)
-		goto out;
-	err = get_set_cont_data(dentry, "start", cd->cd_start, NULL, 1);
-	if (err)
-		goto out;
-	err = get_set_cont_data(dentry, "len", cd->cd_len, NULL, 1);
+	if ((err = check_cont(rec, CHUNKFS_PI(sb)->pi_legacy_chksum)) != 0) {
+		printk(KERN_ERR "chunkfs: invalid continuation record, err %d chksum %0x\n",
+			err, le32_to_cpu(rec->cr_chksum));
+		return -EIO;
+	}
+	if (le32_to_cpu(rec->cr_version) != CHUNKFS_CONT_VERSION) {
+		printk(KERN_ERR "chunkfs: unknown continuation record version %u\n",
+			le32_to_cpu(rec->cr_version));
+		return -EIO;
+	}
+	if (!cont_link_ok(sb, rec->cr_next_chunk, rec->cr_next_ino) ||
+	    !cont_link_ok(sb, rec->cr_prev_chunk, rec->cr_prev_ino))
+		return -EIO;
+	cd->cd_next = 0;
+	if (rec->cr_next_ino)
+		cd->cd_next = MAKE_UINO(sb, le64_to_cpu(rec->cr_next_chunk),
+					le64_to_cpu(rec->cr_next_ino));
+	cd->cd_prev = 0;
+	if (rec->cr_prev_ino)
+		cd->cd_prev = MAKE_UINO(sb, le64_to_cpu(rec->cr_prev_chunk),
+					le64_to_cpu(rec->cr_prev_ino));
+	cd->cd_start = le64_to_cpu(rec->cr_start);
+	cd->cd_len = le64_to_cpu(rec->cr_len);
+	return 0;
+}
+
+/*
+ * Version 1 records and the string xattrs before them hold uinos in
+ * the legacy 32 bit layout.
+ */
+
+static u64
+legacy_uino_to_uino(struct super_block *sb, u64 legacy_uino)
+{
+	if (legacy_uino == 0)
+		return 0;
+	return MAKE_UINO(sb,
+		__UINO_TO_CHUNK_ID(CHUNKFS_LEGACY_INO_BITS, legacy_uino),
+		__UINO_TO_INO(CHUNKFS_LEGACY_INO_BITS, legacy_uino));
+}
+
+static int
+cont_data_from_disk_v1(struct super_block *sb, struct chunkfs_cont_v1 *rec,
+		       struct chunkfs_cont_data *cd)
+{
+	int err;
+
+	if ((err = check_cont_v1(rec)) != 0 ||
+	    le32_to_cpu(rec->cr_version) != 1) {
+		printk(KERN_ERR "chunkfs: invalid v1 continuation record, err %d chksum %0x\n",
+			err, le32_to_cpu(rec->cr_chksum));
+		return -EIO;
+	}
+	cd->cd_next = legacy_uino_to_uino(sb, le64_to_cpu(rec->cr_next));
+	cd->cd_prev = legacy_uino_to_uino(sb, le64_to_cpu(rec->cr_prev));
+	cd->cd_start = le64_to_cpu(rec->cr_start);
+	cd->cd_len = le64_to_cpu(rec->cr_len);
+	return 0;
+}
+
+static int
+set_cont_data(struct super_block *sb, struct dentry *dentry,
+	      struct chunkfs_cont_data *cd)
+{
+	struct chunkfs_cont rec;
+	int err;
+
+	cont_data_to_disk(sb, cd, &rec);
+	/* XXX ENOSPC handling */
+	err = generic_setxattr(dentry, CHUNKFS_CONT_XATTR, &rec,
+			       sizeof(rec), 0);
 	if (err)
 		goto out;
 
@@ -87,29 +212,50 @@ set_cont_data(struct dentry *dentry, struct chunkfs_cont_data *cd)
  * stick it into the continuation info for an element of the inode
  * list for a chunkfs inode.  Currently stored in an xattr, so can use
  * nice pretty fs-independent xattr routines.
+ *
+ * Inodes still carrying an older format are converted to the current
+ * record the first time they are read, if we are given their chunk
+ * (ci) and it can be marked dirty for the change.
  */
 
 static int
-get_cont_data(struct dentry *dentry, struct chunkfs_cont_data *cd)
+get_cont_data(struct super_block *sb, struct chunkfs_chunk_info *ci,
+	      struct dentry *dentry, struct chunkfs_cont_data *cd)
 {
+	union {
+		struct chunkfs_cont rec;
+		struct chunkfs_cont_v1 rec_v1;
+	} buf;
+	ssize_t size;
+	int legacy = 0;
 	int err;
 
-	err = get_set_cont_data(dentry, "next", 0, &cd->cd_next, 0);
-	if (err)
-		return err;
-	err = get_set_cont_data(dentry, "prev", 0, &cd->cd_prev, 0);
-	if (err)
-		return err;
-	err = get_set_cont_data(dentry, "start", 0, &cd->cd_start, 0);
-	if (err)
-		return err;
-	err = get_set_cont_data(dentry, "len", 0, &cd->cd_len, 0);
+	chunkfs_count(sb, xattr_loads);
+	size = generic_getxattr(dentry, CHUNKFS_CONT_XATTR, &buf, sizeof(buf));
+	if (size == sizeof(buf.rec)) {
+		err = cont_data_from_disk(sb, &buf.rec, cd);
+	} else if (size == sizeof(buf.rec_v1)) {
+		err = cont_data_from_disk_v1(sb, &buf.rec_v1, cd);
+		legacy = 1;
+	} else if (size == -ENODATA) {
+		err = get_legacy_cont_data(dentry, cd);
+		if (!err) {
+			cd->cd_next = legacy_uino_to_uino(sb, cd->cd_next);
+			cd->cd_prev = legacy_uino_to_uino(sb, cd->cd_prev);
+		}
+		legacy = 2;
+	} else {
+		err = (size < 0) ? size : -EIO;
+	}
 	if (err)
 		return err;
 
-	chunkfs_debug("inode %lu err %d next %llu prev %llu start %llu len %llu\n",
-		dentry->d_inode->i_ino, err,
-		cd->cd_next, cd->cd_prev, cd->cd_start, cd->cd_len);
+	/* Read-only client just keeps the old format */
+	if (legacy && ci && chunkfs_start_chunk_write(ci) == 0) {
+		if (set_cont_data(sb, dentry, cd) == 0 && legacy == 2)
+			remove_legacy_cont_data(dentry);
+		chunkfs_end_chunk_write(ci);
+	}
 
 	return 0;
 }
@@ -119,14 +265,16 @@ get_cont_data(struct dentry *dentry, struct chunkfs_cont_data *cd)
  */
 
 static int
-get_cont_data_inode(struct inode *inode, struct chunkfs_cont_data *cd)
+get_cont_data_inode(struct super_block *sb, struct inode *inode,
+		    struct chunkfs_cont_data *cd)
 {
 	struct dentry fake_dentry;
 	int err;
 
 	fake_dentry.d_inode = inode;
 	fake_dentry.d_sb = inode->i_sb;
-	err = get_cont_data(&fake_dentry, cd);
+	/* No converting through a fake dentry */
+	err = get_cont_data(sb, NULL, &fake_dentry, cd);
 	return err;
 }
 
@@ -145,8 +293,6 @@ load_continuation(struct inode *head_inode, struct dentry *client_dentry,
 	struct chunkfs_chunk_info *ci;
 	int err;
 
-	chunkfs_debug("chunk_id %llu\n", chunk_id);
-
 	cont = kzalloc(sizeof(*cont), GFP_ATOMIC);
 	if (cont == NULL)
 		return -ENOMEM;
@@ -154,19 +300,24 @@ load_continuation(struct inode *head_inode, struct dentry *client_dentry,
 	cont->co_inode = client_dentry->d_inode;
 	cont->co_dentry = client_dentry;
 	cont->co_chunk_id = chunk_id;
-	/* Hm.  Think I could pass in the mnt, too... */
+	/* The caller got client_dentry from this chunk, so it's attached */
 	ci = chunkfs_find_chunk(pi, chunk_id);
 	BUG_ON(ci == NULL); /* XXX */
+	chunkfs_hold_chunk(ci);
+	cont->co_chunk = ci;
 	cont->co_mnt = ci->ci_mnt;
-	cont->co_uino = MAKE_UINO(chunk_id, cont->co_inode->i_ino);
+	cont->co_uino = MAKE_UINO(head_inode->i_sb, chunk_id,
+				  cont->co_inode->i_ino);
 
-	err = get_cont_data(cont->co_dentry, &cont->co_cd);
+	err = get_cont_data(head_inode->i_sb, ci, cont->co_dentry,
+			    &cont->co_cd);
 	if (err)
 		goto out;
 
 	*ret_cont = cont;
 	return 0;
  out:
+	chunkfs_put_chunk(ci);
 	kfree(cont);
 	return err;
 }
@@ -175,7 +326,8 @@ void
 chunkfs_put_continuation(struct chunkfs_continuation *cont)
 {
 	dput(cont->co_dentry);
-	/* Should be doing mntput but don't do mntget either */
+	/* The chunk use count keeps co_mnt around */
+	chunkfs_put_chunk(cont->co_chunk);
 	kfree(cont);
 }
 
@@ -192,26 +344,25 @@ chunkfs_get_next_cont(struct dentry *head_dentry,
 		      struct chunkfs_continuation *prev_cont,
 		      struct chunkfs_continuation **next_cont)
 {
-	char *path = NULL;
 	struct inode *head_inode = head_dentry->d_inode;
+	struct chunkfs_chunk_info *ci = NULL;
 	struct chunkfs_cont_data *cd;
 	struct dentry *client_dentry;
-	struct nameidata nd;
+	struct path path;
+	char name[48];
 	u64 from_chunk_id;
 	u64 chunk_id;
 	u64 from_ino;
-	u64 next_uino;
+	u64 next_uino = 0;
 	int err;
 
-	chunkfs_debug("prev_cont %p\n", prev_cont);
-
 	/*
 	 * Get the dentry for the continuation we want.
 	 */
 
 	if (prev_cont == NULL) {
 		client_dentry = dget(get_client_dentry(head_dentry));
-		chunk_id = UINO_TO_CHUNK_ID(head_inode->i_ino);
+		chunk_id = UINO_TO_CHUNK_ID(head_inode->i_sb, head_inode->i_ino);
 	} else {
 		cd = &prev_cont->co_cd;
 		/* If it's the head inode again, return */
@@ -226,80 +377,604 @@ chunkfs_get_next_cont(struct dentry *head_dentry,
 		}
 		/* Laboriously construct the path and look it up */
 		next_uino = cd->cd_next;
-		chunk_id = UINO_TO_CHUNK_ID(next_uino);
+		chunk_id = UINO_TO_CHUNK_ID(head_inode->i_sb, next_uino);
 		from_chunk_id = prev_cont->co_chunk_id;
-		from_ino = UINO_TO_INO(prev_cont->co_uino);
-
-		path = __getname();
-		err = PTR_ERR_OR_ZERO(path);
-		if (err)
-			return err;
+		from_ino = UINO_TO_INO(head_inode->i_sb, prev_cont->co_uino);
 
-		sprintf(path, "/chunk%llu/%llu/%llu",
-			chunk_id, from_chunk_id, from_ino);
-		err = kern_path(path, 0, &nd.path);
-		__putname(path);
-		if (err)
-			return -ENOENT;
+		chunkfs_count(head_inode->i_sb, hops);
+		ci = chunkfs_get_chunk(CHUNKFS_PI(head_inode->i_sb), chunk_id);
+		if (!ci) {
+			err = -EIO;
+			goto out;
+		}
+		sprintf(name, "%llu/%llu", from_chunk_id, from_ino);
+		err = chunkfs_client_lookup(ci, name, 0, &path);
+		if (err) {
+			chunkfs_put_chunk(ci);
+			err = -ENOENT;
+			goto out;
+		}
 
-		client_dentry = dget(nd.path.dentry);
-		path_put(&nd.path);
+		client_dentry = dget(path.dentry);
+		path_put(&path);
 	}
 
 	/* Now we know the dentry of the continuation we want. */
 
 	err = load_continuation(head_inode, client_dentry, chunk_id,
 				next_cont);
+	/* The continuation holds its own use count */
+	if (ci)
+		chunkfs_put_chunk(ci);
+ out:
+	if (prev_cont)
+		trace_chunkfs_cont_hop(head_inode, prev_cont->co_uino,
+				       next_uino, err);
+	return err;
+}
 
-	chunkfs_debug("returning err %d\n", err);
+/*
+ * Continuation map.  All of these must be called with
+ * ii_continuations_lock held.
+ */
+
+static int
+cont_map_append(struct chunkfs_cont_map *map,
+		struct chunkfs_continuation *cont)
+{
+	struct chunkfs_continuation *conts;
+	unsigned int alloc;
+
+	if (map->cm_nr == map->cm_alloc) {
+		alloc = map->cm_alloc ? map->cm_alloc * 2 : 4;
+		conts = krealloc(map->cm_conts, alloc * sizeof(*conts),
+				 GFP_KERNEL);
+		if (!conts)
+			return -ENOMEM;
+		map->cm_conts = conts;
+		map->cm_alloc = alloc;
+	}
+	/* The map takes over the references to co_dentry and co_chunk */
+	map->cm_conts[map->cm_nr++] = *cont;
+	kfree(cont);
+	return 0;
+}
+
+static void
+cont_map_free(struct chunkfs_cont_map *map)
+{
+	unsigned int i;
+
+	for (i = 0; i < map->cm_nr; i++) {
+		if (map->cm_conts[i].co_dirty)
+			map->cm_lost_dirty = 1;
+		if (map->cm_conts[i].co_file)
+			fput(map->cm_conts[i].co_file);
+		dput(map->cm_conts[i].co_dentry);
+		chunkfs_put_chunk(map->cm_conts[i].co_chunk);
+	}
+	kfree(map->cm_conts);
+	map->cm_conts = NULL;
+	map->cm_nr = 0;
+	map->cm_alloc = 0;
+	map->cm_valid = 0;
+}
+
+/*
+ * Walk the on-disk chain once and remember every continuation.
+ */
+
+static int
+cont_map_build(struct dentry *head_dentry, struct chunkfs_cont_map *map)
+{
+	struct chunkfs_continuation *prev_cont = NULL;
+	struct chunkfs_continuation *next_cont;
+	int err;
+
+	if (map->cm_valid)
+		return 0;
+	cont_map_free(map);
+	chunkfs_count(head_dentry->d_sb, map_builds);
+
+	while (1) {
+		err = chunkfs_get_next_cont(head_dentry, prev_cont, &next_cont);
+		if (err)
+			goto out;
+		if (next_cont == NULL)
+			break;
+		err = cont_map_append(map, next_cont);
+		if (err) {
+			chunkfs_put_continuation(next_cont);
+			goto out;
+		}
+		prev_cont = &map->cm_conts[map->cm_nr - 1];
+	}
+	map->cm_valid = 1;
+	chunkfs_debug("ino %0lx: %u continuations\n",
+		head_dentry->d_inode->i_ino, map->cm_nr);
+	return 0;
+ out:
+	cont_map_free(map);
 	return err;
 }
 
+/*
+ * Binary search for the continuation containing offset.
+ */
+
+static struct chunkfs_continuation *
+cont_map_search(struct chunkfs_cont_map *map, loff_t offset)
+{
+	struct chunkfs_continuation *cont;
+	unsigned int lo = 0;
+	unsigned int hi = map->cm_nr;
+	unsigned int mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		cont = &map->cm_conts[mid];
+		if (offset < cont->co_cd.cd_start)
+			hi = mid;
+		else if (offset >= cont->co_cd.cd_start + cont->co_cd.cd_len)
+			lo = mid + 1;
+		else
+			return cont;
+	}
+	return NULL;
+}
+
+static struct chunkfs_continuation *
+cont_map_tail(struct chunkfs_cont_map *map)
+{
+	if (map->cm_nr == 0)
+		return NULL;
+	return &map->cm_conts[map->cm_nr - 1];
+}
+
+/*
+ * Hand out a private copy of a cached continuation.
+ */
+
+static struct chunkfs_continuation *
+cont_dup(struct chunkfs_continuation *cont)
+{
+	struct chunkfs_continuation *new_cont;
+
+	new_cont = kmemdup(cont, sizeof(*cont), GFP_KERNEL);
+	if (!new_cont)
+		return NULL;
+	dget(new_cont->co_dentry);
+	chunkfs_hold_chunk(new_cont->co_chunk);
+	/* The map's client file stays with the map */
+	new_cont->co_file = NULL;
+	return new_cont;
+}
+
+/*
+ * Forget the cached continuation map, e.g. after truncate.
+ */
+
+void
+chunkfs_invalidate_cont_map(struct inode *inode)
+{
+	struct chunkfs_inode_info *ii = CHUNKFS_I(inode);
+
+	mutex_lock(&ii->ii_continuations_lock);
+	cont_map_free(&ii->ii_cont_map);
+	mutex_unlock(&ii->ii_continuations_lock);
+}
+
+/*
+ * Inode is going away, no locking needed.
+ */
+
+void
+chunkfs_free_cont_map(struct inode *inode)
+{
+	cont_map_free(&CHUNKFS_I(inode)->ii_cont_map);
+}
+
 int
 chunkfs_get_cont_at_offset(struct dentry *dentry, loff_t offset,
 			   struct chunkfs_continuation **ret_cont)
 {
 	struct chunkfs_inode_info *ii = CHUNKFS_I(dentry->d_inode);
-	struct chunkfs_continuation *prev_cont = NULL;
-	struct chunkfs_continuation *next_cont;
-	struct chunkfs_cont_data *cd;
+	struct chunkfs_continuation *cont = NULL;
 	int err;
 
-	chunkfs_debug("reading ino %0lx offset %llu\n",
-		dentry->d_inode->i_ino, offset);
+	chunkfs_count(dentry->d_sb, lookups);
+	mutex_lock(&ii->ii_continuations_lock);
+	err = cont_map_build(dentry, &ii->ii_cont_map);
+	if (err)
+		goto out;
+	cont = cont_map_search(&ii->ii_cont_map, offset);
+	/* If we didn't find a cont at all, return -ENOENT */
+	if (cont == NULL) {
+		err = -ENOENT;
+		goto out;
+	}
+	*ret_cont = cont_dup(cont);
+	if (*ret_cont == NULL)
+		err = -ENOMEM;
+ out:
+	trace_chunkfs_cont_lookup(dentry->d_inode, offset,
+				  cont ? cont->co_chunk_id : 0,
+				  cont ? cont->co_cd.cd_start : 0,
+				  cont ? cont->co_cd.cd_len : 0, err);
+	mutex_unlock(&ii->ii_continuations_lock);
+	return err;
+}
 
+/*
+ * Open a client file for a continuation in the map, if it doesn't
+ * have one yet.  Called with ii_continuations_lock held.
+ *
+ * The file outlives whoever caused the open (a reader, or the
+ * flusher), so it is opened with the pool's creds.  Users were
+ * checked against the chunkfs inode already.
+ */
+
+static int
+cont_open_file(struct inode *inode, struct chunkfs_continuation *cont)
+{
+	const struct cred *cred = CHUNKFS_PI(inode->i_sb)->pi_cred;
+	struct file *file;
+	struct path co_path;
+
+	if (cont->co_file)
+		return 0;
+	chunkfs_count(inode->i_sb, client_opens);
+	co_path.mnt = cont->co_mnt;
+	co_path.dentry = cont->co_dentry;
+	file = dentry_open(&co_path, O_RDWR | O_LARGEFILE, cred);
+	if (PTR_ERR(file) == -EROFS)
+		file = dentry_open(&co_path, O_RDONLY | O_LARGEFILE, cred);
+	trace_chunkfs_client_open(inode, cont->co_chunk_id, cont->co_dentry,
+				  PTR_ERR_OR_ZERO(file));
+	if (IS_ERR(file))
+		return PTR_ERR(file);
+	cont->co_file = file;
+	return 0;
+}
+
+/*
+ * Map a file offset to the client file and continuation data backing
+ * it, for the page cache.  There is no struct file in writeback, so
+ * the map keeps one client file per continuation open for as long as
+ * the map lives.  Returns -ENOENT for offsets no continuation covers.
+ * Writes mark the continuation dirty for fsync.  *chunk stays valid
+ * for as long as the client file is held.
+ */
+
+int
+chunkfs_map_cont(struct inode *inode, loff_t pos, int rw,
+		 struct file **client_file, struct chunkfs_cont_data *cd,
+		 struct chunkfs_chunk_info **chunk)
+{
+	struct chunkfs_inode_info *ii = CHUNKFS_I(inode);
+	struct chunkfs_cont_map *map = &ii->ii_cont_map;
+	struct chunkfs_continuation *cont = NULL;
+	struct dentry *dentry;
+	int err = 0;
+
+	chunkfs_count(inode->i_sb, lookups);
 	mutex_lock(&ii->ii_continuations_lock);
-	while (1) {
-		err = chunkfs_get_next_cont(dentry, prev_cont, &next_cont);
-		if (err || (next_cont == NULL))
-			break;
-		cd = &next_cont->co_cd;
-		chunkfs_debug("offset %llu start %llu len %llu err %d\n",
-			offset, cd->cd_start, cd->cd_len, err);
-		if ((offset >= cd->cd_start) &&
-		    (offset < (cd->cd_start + cd->cd_len))) {
-			chunkfs_debug("found it!\n");
-			*ret_cont = next_cont;
+	if (!map->cm_valid) {
+		/* Normally built at open, this is the odd case */
+		dentry = d_find_alias(inode);
+		if (!dentry) {
+			err = -EIO;
+			goto out;
+		}
+		err = cont_map_build(dentry, map);
+		dput(dentry);
+		if (err)
+			goto out;
+	}
+	cont = cont_map_search(map, pos);
+	if (!cont) {
+		err = -ENOENT;
+		goto out;
+	}
+	err = cont_open_file(inode, cont);
+	if (err)
+		goto out;
+	if (rw == WRITE)
+		cont->co_dirty = 1;
+	*client_file = get_file(cont->co_file);
+	*cd = cont->co_cd;
+	*chunk = cont->co_chunk;
+ out:
+	trace_chunkfs_cont_lookup(inode, pos, cont ? cont->co_chunk_id : 0,
+				  cont ? cont->co_cd.cd_start : 0,
+				  cont ? cont->co_cd.cd_len : 0, err);
+	mutex_unlock(&ii->ii_continuations_lock);
+	return err;
+}
+
+/*
+ * For writes that go around the page cache (O_DIRECT).
+ */
+
+void
+chunkfs_mark_cont_dirty(struct inode *inode, loff_t pos)
+{
+	struct chunkfs_inode_info *ii = CHUNKFS_I(inode);
+	struct chunkfs_continuation *cont;
+
+	mutex_lock(&ii->ii_continuations_lock);
+	if (ii->ii_cont_map.cm_valid) {
+		cont = cont_map_search(&ii->ii_cont_map, pos);
+		if (cont)
+			cont->co_dirty = 1;
+	} else {
+		ii->ii_cont_map.cm_lost_dirty = 1;
+	}
+	mutex_unlock(&ii->ii_continuations_lock);
+}
+
+/*
+ * fsync fan-out.  The dirty continuations of a file are usually on
+ * different client file systems, so sync them all at once on
+ * chunkfs_wq and wait for the lot rather than one after the other.
+ */
+
+struct chunkfs_sync_ctl {
+	atomic_t		sc_pending;
+	struct completion	sc_done;
+};
+
+struct chunkfs_sync {
+	struct work_struct	cs_work;
+	struct chunkfs_sync_ctl	*cs_ctl;
+	struct file		*cs_file;
+	u64			cs_uino;
+	loff_t			cs_start;	/* Client file offsets */
+	loff_t			cs_end;
+	int			cs_datasync;
+	int			cs_err;
+};
+
+static void
+chunkfs_sync_work(struct work_struct *work)
+{
+	struct chunkfs_sync *cs = container_of(work, struct chunkfs_sync,
+					       cs_work);
+
+	cs->cs_err = vfs_fsync_range(cs->cs_file, cs->cs_start, cs->cs_end,
+				     cs->cs_datasync);
+	if (atomic_dec_and_test(&cs->cs_ctl->sc_pending))
+		complete(&cs->cs_ctl->sc_done);
+}
+
+/*
+ * Set up a sync of the part of cont inside [start, end].  Returns 0 if
+ * there is nothing to do.
+ */
+
+static int
+cont_sync_range(struct chunkfs_continuation *cont, loff_t start, loff_t end,
+		struct chunkfs_sync *cs)
+{
+	struct chunkfs_cont_data *cd = &cont->co_cd;
+	loff_t cont_end = cd->cd_start + cd->cd_len - 1;
+
+	if (end < cd->cd_start || start > cont_end)
+		return 0;
+	cs->cs_start = max_t(loff_t, start, cd->cd_start) - cd->cd_start;
+	cs->cs_end = min_t(loff_t, end, cont_end) - cd->cd_start;
+	cs->cs_file = get_file(cont->co_file);
+	cs->cs_uino = cont->co_uino;
+	return 1;
+}
+
+/*
+ * Sync the client files of every continuation written since the last
+ * fsync (all of them if we lost track) that overlaps [start, end].
+ * Returns the first error.
+ */
+
+int
+chunkfs_sync_conts(struct inode *inode, loff_t start, loff_t end,
+		   int datasync)
+{
+	struct chunkfs_inode_info *ii = CHUNKFS_I(inode);
+	struct chunkfs_cont_map *map = &ii->ii_cont_map;
+	struct chunkfs_continuation *cont;
+	struct chunkfs_sync_ctl ctl;
+	struct chunkfs_sync *cs = NULL;
+	struct dentry *dentry;
+	unsigned int nr = 0;
+	unsigned int i, j;
+	int err = 0;
+
+	mutex_lock(&ii->ii_continuations_lock);
+	if (!map->cm_valid) {
+		if (!map->cm_lost_dirty)
+			goto out_unlock;
+		dentry = d_find_alias(inode);
+		if (!dentry) {
+			err = -EIO;
+			goto out_unlock;
+		}
+		err = cont_map_build(dentry, map);
+		dput(dentry);
+		if (err)
+			goto out_unlock;
+	}
+	for (i = 0; i < map->cm_nr; i++)
+		if (map->cm_conts[i].co_dirty || map->cm_lost_dirty)
+			nr++;
+	if (nr == 0)
+		goto out_unlock;
+	cs = kcalloc(nr, sizeof(*cs), GFP_KERNEL | __GFP_NOWARN);
+	if (!cs)
+		cs = vzalloc(nr * sizeof(*cs));
+	if (!cs) {
+		err = -ENOMEM;
+		goto out_unlock;
+	}
+	nr = 0;
+	for (i = 0; i < map->cm_nr; i++) {
+		cont = &map->cm_conts[i];
+		if (!cont->co_dirty && !map->cm_lost_dirty)
+			continue;
+		err = cont_open_file(inode, cont);
+		if (err)
 			break;
+		if (!cont_sync_range(cont, start, end, &cs[nr])) {
+			/* Outside the range, still needs a sync later */
+			cont->co_dirty = 1;
+			continue;
 		}
-		chunkfs_debug("not this one\n");
-		prev_cont = next_cont;
+		/* Anything written from here on is for the next fsync */
+		cont->co_dirty = 0;
+		nr++;
+	}
+	if (err) {
+		for (i = 0; i < nr; i++)
+			cs[i].cs_err = err;
+		goto out_redirty;
 	}
+	map->cm_lost_dirty = 0;
+	mutex_unlock(&ii->ii_continuations_lock);
+
+	chunkfs_count(inode->i_sb, fsyncs);
+	chunkfs_count_add(inode->i_sb, fsync_conts, nr);
+	trace_chunkfs_sync_conts_start(inode, nr, 0);
+	atomic_set(&ctl.sc_pending, nr);
+	init_completion(&ctl.sc_done);
+	for (i = 0; i < nr; i++) {
+		cs[i].cs_ctl = &ctl;
+		cs[i].cs_datasync = datasync;
+		INIT_WORK(&cs[i].cs_work, chunkfs_sync_work);
+		/* Do the last one ourselves rather than just wait */
+		if (i == nr - 1)
+			chunkfs_sync_work(&cs[i].cs_work);
+		else
+			queue_work(chunkfs_wq, &cs[i].cs_work);
+	}
+	if (nr)
+		wait_for_completion(&ctl.sc_done);
+
+	mutex_lock(&ii->ii_continuations_lock);
+ out_redirty:
+	/* Failed ones are still dirty */
+	for (i = 0; i < nr; i++) {
+		if (!cs[i].cs_err)
+			continue;
+		if (!err)
+			err = cs[i].cs_err;
+		for (j = 0; j < map->cm_nr; j++)
+			if (map->cm_conts[j].co_uino == cs[i].cs_uino)
+				map->cm_conts[j].co_dirty = 1;
+		if (!map->cm_valid)
+			map->cm_lost_dirty = 1;
+	}
+	for (i = 0; i < nr; i++)
+		fput(cs[i].cs_file);
+	kvfree(cs);
+	trace_chunkfs_sync_conts_end(inode, nr, err);
+ out_unlock:
 	mutex_unlock(&ii->ii_continuations_lock);
-	/* If we didn't find a cont at all, return -ENOENT */
-	if (next_cont == NULL)
-		err = -ENOENT;
-	*ret_cont = next_cont;
 	return err;
 }
 
 /*
- * Traverse the list of continuations using iget() only.
+ * Try to stretch the last continuation to cover pos.  At least
+ * doubles it, so steady appends don't come back here every time.
+ * Called with ii_continuations_lock held.
+ */
+
+static int
+cont_grow_tail(struct super_block *sb, struct chunkfs_cont_map *map,
+	       loff_t pos)
+{
+	struct chunkfs_continuation *tail = cont_map_tail(map);
+	struct chunkfs_cont_data *cd = &tail->co_cd;
+	struct chunkfs_chunk_info *ci = tail->co_chunk;
+	u64 len;
+	int err;
+
+	if (cd->cd_len >= CHUNKFS_CONT_MAX_LEN)
+		return 0;
+	len = round_up(pos - cd->cd_start + 1, CHUNKFS_CONT_LEN);
+	len = max_t(u64, len, cd->cd_len * 2);
+	len = min_t(u64, len, CHUNKFS_CONT_MAX_LEN);
+	if (!chunkfs_grow_in_place(ci, len - cd->cd_len))
+		return 0;
+
+	if (chunkfs_start_chunk_write(ci))
+		return 0;
+	cd->cd_len = len;
+	err = set_cont_data(sb, tail->co_dentry, cd);
+	chunkfs_end_chunk_write(ci);
+	if (err) {
+		/* Let the map be reread from what's on disk */
+		cont_map_free(map);
+		return 0;
+	}
+	chunkfs_debug("ino %0lx grew to %llu\n",
+		tail->co_inode->i_ino, len);
+	return pos < cd->cd_start + cd->cd_len;
+}
+
+/*
+ * Length of a new continuation following prev.
+ */
+
+static u64
+cont_next_len(struct chunkfs_continuation *prev)
+{
+	return clamp_t(u64, prev->co_cd.cd_len * 2, CHUNKFS_CONT_LEN,
+		       CHUNKFS_CONT_MAX_LEN);
+}
+
+/*
+ * Make sure there is a continuation covering pos, growing the last
+ * one or creating as many as it takes.  Cheap when one already
+ * exists.
  */
 
 int
-chunkfs_get_next_inode(struct inode *head_inode,
-		       struct inode *prev_inode, struct inode **ret_inode)
+chunkfs_grow_to(struct dentry *dentry, loff_t pos)
+{
+	struct chunkfs_inode_info *ii = CHUNKFS_I(dentry->d_inode);
+	struct super_block *sb = dentry->d_sb;
+	struct chunkfs_continuation *cont;
+	struct file *client_file;
+	int found;
+	int err;
+
+	while (1) {
+		mutex_lock(&ii->ii_continuations_lock);
+		err = cont_map_build(dentry, &ii->ii_cont_map);
+		found = !err && cont_map_search(&ii->ii_cont_map, pos);
+		if (!err && !found)
+			found = cont_grow_tail(sb, &ii->ii_cont_map, pos);
+		mutex_unlock(&ii->ii_continuations_lock);
+		if (err || found)
+			return err;
+
+		err = chunkfs_create_continuation(dentry, &client_file, &cont);
+		if (err)
+			return err;
+		fput(client_file);
+		chunkfs_put_continuation(cont);
+	}
+}
+
+/*
+ * Traverse the list of continuations using iget() only.  *chunk
+ * holds a use count on the chunk of the returned inode (NULL for the
+ * head, whose chunk the head inode holds), start with it NULL.
+ * *start is the file offset the returned continuation begins at.
+ */
+
+int
+chunkfs_get_next_inode(struct inode *head_inode, struct inode *prev_inode,
+		       struct inode **ret_inode,
+		       struct chunkfs_chunk_info **chunk, loff_t *start)
 {
 	struct chunkfs_pool_info *pi = CHUNKFS_PI(head_inode->i_sb);
 	struct chunkfs_chunk_info *ci;
@@ -314,12 +989,17 @@ chunkfs_get_next_inode(struct inode *head_inode,
 	if (prev_inode == NULL) {
 		prev_inode = get_client_inode(head_inode);
 		next_inode = iget_locked(prev_inode->i_sb, prev_inode->i_ino);
-		BUG_ON(!next_inode);
+		if (!next_inode)
+			return -ENOMEM;
+		*start = 0;
 		goto found_inode;
-	} else
-		iput(prev_inode);
+	}
 	/* Find the superblock and inode for the next one */
-	err = get_cont_data_inode(prev_inode, &cd);
+	err = get_cont_data_inode(head_inode->i_sb, prev_inode, &cd);
+	iput(prev_inode);
+	if (*chunk)
+		chunkfs_put_chunk(*chunk);
+	*chunk = NULL;
 	if (err)
 		return err;
 	next_uino = cd.cd_next;
@@ -327,25 +1007,166 @@ chunkfs_get_next_inode(struct inode *head_inode,
 		*ret_inode = NULL;
 		return 0;
 	}
-	next_ino = UINO_TO_INO(next_uino);
-	chunk_id = UINO_TO_CHUNK_ID(next_uino);
+	*start = cd.cd_start + cd.cd_len;
+	next_ino = UINO_TO_INO(head_inode->i_sb, next_uino);
+	chunk_id = UINO_TO_CHUNK_ID(head_inode->i_sb, next_uino);
 	chunkfs_debug("next_uino %llu next_ino %lu, next chunk_id %llu\n",
 		next_uino, next_ino, chunk_id);
-	ci = chunkfs_find_chunk(pi, chunk_id);
-	BUG_ON(ci == NULL); /* XXX */
+	ci = chunkfs_get_chunk(pi, chunk_id);
+	if (!ci)
+		return -EIO;
 	next_inode = iget_locked(ci->ci_sb, next_ino);
-	BUG_ON(!next_inode);
+	if (!next_inode) {
+		chunkfs_put_chunk(ci);
+		return -ENOMEM;
+	}
+	*chunk = ci;
  found_inode:
 	unlock_inode(next_inode);
 
-	if (is_bad_inode(next_inode))
+	if (is_bad_inode(next_inode)) {
+		iput(next_inode);
+		if (*chunk)
+			chunkfs_put_chunk(*chunk);
+		*chunk = NULL;
 		return -EIO;
+	}
 	*ret_inode = next_inode;
 	return 0;
 }
 
 /*
- * Create a new continuation in this chunk.  Never called on the head.
+ * Client namespace helpers.  Names are relative to the root of the
+ * chunk's client file system, so it doesn't matter where (or whether)
+ * userland can see it.
+ *
+ * Everything here runs with the pool's creds, so the hidden client
+ * objects have the same owner and mode whichever user's write made
+ * them, and every user can get at them.
+ */
+
+static const struct cred *
+client_override_creds(struct chunkfs_chunk_info *ci)
+{
+	return override_creds(ci->ci_dev->di_pool->pi_cred);
+}
+
+int
+chunkfs_client_lookup(struct chunkfs_chunk_info *ci, const char *name,
+		      unsigned int flags, struct path *path)
+{
+	const struct cred *old_cred;
+	int err;
+
+	old_cred = client_override_creds(ci);
+	err = vfs_path_lookup(ci->ci_mnt->mnt_root, ci->ci_mnt, name, flags,
+			      path);
+	revert_creds(old_cred);
+	return err;
+}
+
+/*
+ * Make a directory at the top of the client fs.  Not an error if it
+ * is already there.
+ */
+
+int
+chunkfs_client_mkdir(struct chunkfs_chunk_info *ci, const char *name,
+		     umode_t mode)
+{
+	struct dentry *root = ci->ci_mnt->mnt_root;
+	const struct cred *old_cred;
+	struct dentry *dentry;
+	int err;
+
+	err = mnt_want_write(ci->ci_mnt);
+	if (err)
+		return err;
+	old_cred = client_override_creds(ci);
+	mutex_lock_nested(&root->d_inode->i_mutex, I_MUTEX_PARENT);
+	dentry = lookup_one_len(name, root, strlen(name));
+	err = PTR_ERR_OR_ZERO(dentry);
+	if (!err) {
+		if (!dentry->d_inode)
+			err = vfs_mkdir(root->d_inode, dentry, mode);
+		dput(dentry);
+	}
+	mutex_unlock(&root->d_inode->i_mutex);
+	revert_creds(old_cred);
+	mnt_drop_write(ci->ci_mnt);
+	chunkfs_debug("chunk %llu %s: err %d\n", ci->ci_chunk_id, name, err);
+	return err;
+}
+
+/*
+ * Continuations live in <from chunk>/<from ino> in the chunk they are
+ * in.  They can land in any chunk, so the <from chunk> directory may
+ * not exist yet.
+ */
+
+static int
+create_cont_file(struct chunkfs_chunk_info *ci, u64 from_chunk_id,
+		 u64 from_ino, struct file **ret_file)
+{
+	const struct cred *cred = ci->ci_dev->di_pool->pi_cred;
+	const struct cred *old_cred;
+	char dir_name[24];
+	char name[24];
+	struct dentry *dentry;
+	struct path dir;
+	struct path path;
+	struct file *file;
+	int err;
+
+	sprintf(dir_name, "%llu", from_chunk_id);
+	sprintf(name, "%llu", from_ino);
+
+	err = chunkfs_client_lookup(ci, dir_name, LOOKUP_DIRECTORY, &dir);
+	if (err == -ENOENT) {
+		/* First continuation from that chunk into this one */
+		err = chunkfs_client_mkdir(ci, dir_name, S_IRWXU);
+		if (!err)
+			err = chunkfs_client_lookup(ci, dir_name,
+						    LOOKUP_DIRECTORY, &dir);
+	}
+	if (err)
+		return err;
+
+	err = mnt_want_write(dir.mnt);
+	if (err)
+		goto out_dir;
+	old_cred = override_creds(cred);
+	mutex_lock_nested(&dir.dentry->d_inode->i_mutex, I_MUTEX_PARENT);
+	dentry = lookup_one_len(name, dir.dentry, strlen(name));
+	err = PTR_ERR_OR_ZERO(dentry);
+	if (!err && !dentry->d_inode)
+		err = vfs_create(dir.dentry->d_inode, dentry,
+				 S_IFREG | S_IRUSR | S_IWUSR, true);
+	mutex_unlock(&dir.dentry->d_inode->i_mutex);
+	revert_creds(old_cred);
+	mnt_drop_write(dir.mnt);
+	if (IS_ERR(dentry))
+		goto out_dir;
+	if (err)
+		goto out_dentry;
+
+	path.mnt = dir.mnt;
+	path.dentry = dentry;
+	file = dentry_open(&path, O_RDWR | O_LARGEFILE, cred);
+	err = PTR_ERR_OR_ZERO(file);
+	if (!err)
+		*ret_file = file;
+ out_dentry:
+	dput(dentry);
+ out_dir:
+	path_put(&dir);
+	chunkfs_debug("chunk %llu %s/%s: err %d\n", ci->ci_chunk_id, dir_name,
+		name, err);
+	return err;
+}
+
+/*
+ * Create a new continuation.  Never called on the head.
  * Length is set arbitrarily so be sure to write continuously.
  *
  * We have to bootstrap ourselves up, starting with a dentry.  We are,
@@ -353,59 +1174,77 @@ chunkfs_get_next_inode(struct inode *head_inode,
  */
 
 int
-chunkfs_create_continuation(struct file *file, loff_t *ppos,
+chunkfs_create_continuation(struct dentry *head_dentry,
 			    struct file **client_file,
 			    struct chunkfs_continuation **ret_cont)
 {
-	char *path = NULL;
-	struct chunkfs_continuation *prev_cont = NULL;
-	struct chunkfs_continuation *next_cont;
+	struct super_block *sb = head_dentry->d_sb;
+	struct chunkfs_inode_info *ii = CHUNKFS_I(head_dentry->d_inode);
+	struct chunkfs_cont_map *map = &ii->ii_cont_map;
+	struct chunkfs_continuation *prev_cont;
 	struct chunkfs_continuation *new_cont;
+	struct chunkfs_chunk_info *from_ci;
+	struct chunkfs_chunk_info *to_ci;
 	struct file *new_file;
-	u64 from_chunk_id;
-	u64 to_chunk_id;
+	u64 from_chunk_id = 0;
+	u64 to_chunk_id = 0;
 	u64 from_ino;
 	struct dentry *dentry;
-	struct chunkfs_cont_data cd;
+	struct chunkfs_cont_data cd = { 0 };
+	u64 len = 0;
 	int err;
 
-	chunkfs_debug("enter\n");
+	mutex_lock(&ii->ii_continuations_lock);
 
 	/* Get the last continuation */
-	while (1) {
-		err = chunkfs_get_next_cont(file->f_dentry, prev_cont,
-					    &next_cont);
-		if (err)
-			return err;
-		if (next_cont == NULL)
-			break;
-		prev_cont = next_cont;
-	}
+	err = cont_map_build(head_dentry, map);
+	if (err)
+		goto out;
+	prev_cont = cont_map_tail(map);
+	BUG_ON(prev_cont == NULL); /* There is always a head */
 
 	/* Figure out what chunk and inode we are continuing from. */
 	from_chunk_id = prev_cont->co_chunk_id;
-	from_ino = UINO_TO_INO(prev_cont->co_uino);
-	/* Temporary hack, do the next chunk for creation. */
-	to_chunk_id = from_chunk_id + 1;
-	chunkfs_debug("to chunk %llu\n", to_chunk_id);
-
-	/* Now we need the filename for the continuation inode. */
-	path = __getname();
-	err = PTR_ERR_OR_ZERO(path);
+	from_ino = UINO_TO_INO(sb, prev_cont->co_uino);
+	from_ci = chunkfs_find_chunk(CHUNKFS_PI(sb), from_chunk_id);
+	BUG_ON(from_ci == NULL);
+	/* Settle for the smallest size rather than nothing */
+	len = cont_next_len(prev_cont);
+	err = chunkfs_place_continuation(CHUNKFS_PI(sb), from_ci, len,
+					 &to_chunk_id);
+	if (err == -ENOSPC && len > CHUNKFS_CONT_LEN) {
+		len = CHUNKFS_CONT_LEN;
+		err = chunkfs_place_continuation(CHUNKFS_PI(sb), from_ci, len,
+						 &to_chunk_id);
+	}
 	if (err)
 		goto out;
-	sprintf(path, "/chunk%llu/%llu/%llu", to_chunk_id, from_chunk_id,
-		from_ino);
+	to_ci = chunkfs_get_chunk(CHUNKFS_PI(sb), to_chunk_id);
+	if (!to_ci) {
+		err = -EIO;
+		goto out;
+	}
+	/* Both ends of the link change */
+	err = chunkfs_start_chunk_write(to_ci);
+	if (err)
+		goto out_put;
+	err = chunkfs_start_chunk_write(from_ci);
+	if (err) {
+		chunkfs_end_chunk_write(to_ci);
+		goto out_put;
+	}
 
 	/* Create the file */
-	new_file = filp_open(path, O_CREAT | O_RDWR, MAY_WRITE | MAY_READ | MAY_APPEND);
-	if (IS_ERR(new_file)) {
-		err = PTR_ERR(new_file);
-		chunkfs_debug("open_namei for %s: err %d\n", path, err);
-		chunkfs_debug("dentry_open: err %d\n", err);
-		goto out_free;
-	}
+	chunkfs_count(sb, client_opens);
+	err = create_cont_file(to_ci, from_chunk_id, from_ino, &new_file);
+	if (err)
+		goto out_end;
+	trace_chunkfs_client_open(head_dentry->d_inode, to_chunk_id,
+				  new_file->f_dentry, 0);
 	*client_file = new_file;
+	chunkfs_count(sb, creates);
+	if (to_chunk_id != from_chunk_id)
+		chunkfs_count(sb, cross_creates);
 
 	dentry = dget(new_file->f_dentry);
 
@@ -413,32 +1252,114 @@ chunkfs_create_continuation(struct file *file, loff_t *ppos,
 	cd.cd_next = 0;
 	cd.cd_prev = prev_cont->co_uino;
 	cd.cd_start = prev_cont->co_cd.cd_start + prev_cont->co_cd.cd_len;
-	cd.cd_len = 10 * 4096;
-	set_cont_data(dentry, &cd);
-	/* Now update prev */
-	prev_cont->co_cd.cd_next = MAKE_UINO(to_chunk_id,
+	cd.cd_len = len;
+	err = set_cont_data(sb, dentry, &cd);
+	if (err)
+		goto out_new;
+	/* Now update prev, in memory as well as on disk */
+	prev_cont->co_cd.cd_next = MAKE_UINO(sb, to_chunk_id,
 					     dentry->d_inode->i_ino);
-	set_cont_data(prev_cont->co_dentry, &prev_cont->co_cd);
+	err = set_cont_data(sb, prev_cont->co_dentry, &prev_cont->co_cd);
+	if (err)
+		goto out_new;
+	/* The link has to reach disk with the next fsync too */
+	prev_cont->co_dirty = 1;
 	/* Now! It's all in the inode and we can load it like normal. */
-	err = load_continuation(file->f_dentry->d_inode, dentry,
+	err = load_continuation(head_dentry->d_inode, dentry,
 				to_chunk_id, &new_cont);
+	if (err)
+		goto out_new;
 
-	chunkfs_copy_down_file(file, ppos, new_file, new_cont->co_cd.cd_start);
+	/* Caller gets a copy, the map keeps the original. */
+	*ret_cont = cont_dup(new_cont);
+	if (cont_map_append(map, new_cont)) {
+		chunkfs_put_continuation(new_cont);
+		cont_map_free(map);
+	}
+	if (*ret_cont == NULL) {
+		fput(new_file);
+		err = -ENOMEM;
+	}
+	goto out_end;
+ out_new:
+	/* Anything half linked is an orphan for fsck to remove */
+	dput(dentry);
+	fput(new_file);
+	/* Let the map be reread from what's on disk */
+	cont_map_free(map);
+ out_end:
+	chunkfs_end_chunk_write(from_ci);
+	chunkfs_end_chunk_write(to_ci);
+ out_put:
+	/* The continuation holds its own use count */
+	chunkfs_put_chunk(to_ci);
+ out:
+	mutex_unlock(&ii->ii_continuations_lock);
 
-	*ret_cont = new_cont;
+	trace_chunkfs_cont_create(head_dentry->d_inode, from_chunk_id,
+				  to_chunk_id, cd.cd_start, len, err);
+	return err;
+}
 
- out_free:
-	__putname(path);
- out:
+/*
+ * Set every continuation to its share of size.  The chain stays as it
+ * is; continuations past the new end are just left empty.  A caller
+ * growing the file has already grown the chain to reach size, so the
+ * last client size says where the file ends even when it's all hole.
+ * Caller holds the chunkfs inode's i_mutex and has already trimmed
+ * the page cache.
+ */
+
+int
+chunkfs_truncate_conts(struct dentry *dentry, loff_t size)
+{
+	struct chunkfs_inode_info *ii = CHUNKFS_I(dentry->d_inode);
+	struct chunkfs_cont_map *map = &ii->ii_cont_map;
+	struct chunkfs_continuation *cont;
+	struct inode *client_inode;
+	struct iattr attr;
+	loff_t client_size;
+	unsigned int i;
+	int err;
+
+	mutex_lock(&ii->ii_continuations_lock);
+	err = cont_map_build(dentry, map);
 	if (err)
-		chunkfs_put_continuation(prev_cont);
+		goto out;
+	for (i = 0; i < map->cm_nr; i++) {
+		cont = &map->cm_conts[i];
+		client_inode = cont->co_inode;
+		if (size <= cont->co_cd.cd_start)
+			client_size = 0;
+		else
+			client_size = min_t(loff_t, size - cont->co_cd.cd_start,
+					    cont->co_cd.cd_len);
+		if (client_size == i_size_read(client_inode))
+			continue;
 
-	chunkfs_debug("start %llu returning %d\n", cd.cd_start, err);
+		attr.ia_valid = ATTR_SIZE | ATTR_MTIME | ATTR_CTIME;
+		attr.ia_size = client_size;
+		attr.ia_mtime = attr.ia_ctime = current_fs_time(client_inode->i_sb);
+		err = chunkfs_start_chunk_write(cont->co_chunk);
+		if (err)
+			break;
+		mutex_lock(&client_inode->i_mutex);
+		err = notify_change(cont->co_dentry, &attr, NULL);
+		mutex_unlock(&client_inode->i_mutex);
+		chunkfs_end_chunk_write(cont->co_chunk);
+		if (err)
+			break;
+		cont->co_dirty = 1;
+	}
+ out:
+	mutex_unlock(&ii->ii_continuations_lock);
+	chunkfs_debug("ino %0lx size %llu err %d\n", dentry->d_inode->i_ino,
+		size, err);
 	return err;
 }
 
 int
-chunkfs_init_cont_data(struct dentry *client_dentry)
+chunkfs_init_cont_data(struct super_block *sb, struct dentry *client_dentry)
 {
 	struct chunkfs_cont_data cd;
 	int err;
@@ -446,7 +1367,32 @@ chunkfs_init_cont_data(struct dentry *client_dentry)
 	cd.cd_prev = 0;
 	cd.cd_next = 0;
 	cd.cd_start = 0;
-	cd.cd_len = 10 * 4096;
-	err = set_cont_data(client_dentry, &cd);
+	cd.cd_len = CHUNKFS_CONT_LEN;
+	err = set_cont_data(sb, client_dentry, &cd);
+	return err;
+}
+
+/*
+ * The root directory's record, at mount.  Only written if it isn't
+ * there or can't be read, and then with the chunk marked dirty like
+ * any other change.
+ */
+
+int
+chunkfs_init_root_cont_data(struct super_block *sb,
+			    struct chunkfs_chunk_info *ci,
+			    struct dentry *client_dentry)
+{
+	struct chunkfs_cont_data cd;
+	int err;
+
+	/* Converts an old format record, if that's what it has */
+	if (get_cont_data(sb, ci, client_dentry, &cd) == 0)
+		return 0;
+	err = chunkfs_start_chunk_write(ci);
+	if (err)
+		return err;
+	err = chunkfs_init_cont_data(sb, client_dentry);
+	chunkfs_end_chunk_write(ci);
 	return err;
 }
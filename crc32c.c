@@ -0,0 +1,142 @@
+/*
+ * CRC32C (Castagnoli) for the chunkfs userland tools, with the same
+ * interface as the kernel's crc32c(): no pre or post inversion, the
+ * caller does that.
+ *
+ * Uses the SSE4.2 crc32 instruction when the CPU has it and
+ * slice-by-8 tables otherwise.  The choice is made once at startup,
+ * before any threads exist.
+ *
+ * (C) 2007-2008 Valerie Henson <val@nmt.edu>
+ */
+
+#include <string.h>
+
+#include <linux/byteorder/little_endian.h>
+
+#include "chunkfs.h"
+
+#define	CRC32C_POLY	0x82f63b78	/* Reflected */
+
+static __u32 crc32c_table[8][256];
+
+static __u32 (*crc32c_fn)(__u32, const void *, unsigned int);
+
+__u32 crc32c_bytewise(__u32 crc, const void *buf, unsigned int len)
+{
+	const unsigned char *p = buf;
+
+	while (len--)
+		crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+/*
+ * Eight table lookups per eight bytes, all independent of each other
+ * so they can overlap.  Assumes little endian, like the rest of the
+ * tools.
+ */
+__u32 crc32c_slice8(__u32 crc, const void *buf, unsigned int len)
+{
+	const unsigned char *p = buf;
+
+	while (len && ((unsigned long) p & 7)) {
+		crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+		len--;
+	}
+	while (len >= 8) {
+		__u32 lo;
+		__u32 hi;
+
+		memcpy(&lo, p, 4);
+		memcpy(&hi, p + 4, 4);
+		lo ^= crc;
+		crc = crc32c_table[7][lo & 0xff] ^
+			crc32c_table[6][(lo >> 8) & 0xff] ^
+			crc32c_table[5][(lo >> 16) & 0xff] ^
+			crc32c_table[4][lo >> 24] ^
+			crc32c_table[3][hi & 0xff] ^
+			crc32c_table[2][(hi >> 8) & 0xff] ^
+			crc32c_table[1][(hi >> 16) & 0xff] ^
+			crc32c_table[0][hi >> 24];
+		p += 8;
+		len -= 8;
+	}
+	return crc32c_bytewise(crc, p, len);
+}
+
+#ifdef __x86_64__
+
+__attribute__((target("sse4.2")))
+__u32 crc32c_sse42(__u32 crc, const void *buf, unsigned int len)
+{
+	const unsigned char *p = buf;
+	unsigned long long crc64;
+
+	while (len && ((unsigned long) p & 7)) {
+		crc = __builtin_ia32_crc32qi(crc, *p++);
+		len--;
+	}
+	crc64 = crc;
+	while (len >= 8) {
+		unsigned long long v;
+
+		memcpy(&v, p, 8);
+		crc64 = __builtin_ia32_crc32di(crc64, v);
+		p += 8;
+		len -= 8;
+	}
+	crc = crc64;
+	while (len--)
+		crc = __builtin_ia32_crc32qi(crc, *p++);
+	return crc;
+}
+
+int crc32c_sse42_ok(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse4.2");
+}
+
+#else
+
+__u32 crc32c_sse42(__u32 crc, const void *buf, unsigned int len)
+{
+	return crc32c_slice8(crc, buf, len);
+}
+
+int crc32c_sse42_ok(void)
+{
+	return 0;
+}
+
+#endif
+
+__attribute__((constructor))
+static void crc32c_init(void)
+{
+	__u32 crc;
+	int i;
+	int j;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (CRC32C_POLY & -(crc & 1));
+		crc32c_table[0][i] = crc;
+	}
+	for (i = 0; i < 256; i++) {
+		crc = crc32c_table[0][i];
+		for (j = 1; j < 8; j++) {
+			crc = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+			crc32c_table[j][i] = crc;
+		}
+	}
+
+	crc32c_fn = crc32c_sse42_ok() ? crc32c_sse42 : crc32c_slice8;
+}
+
+__u32 crc32c(__u32 crc, const void *buf, unsigned int len)
+{
+	return crc32c_fn(crc, buf, len);
+}
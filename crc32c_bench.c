@@ -0,0 +1,169 @@
+/*
+ * Check that the CRC32C implementations in crc32c.c agree, and time
+ * them over a range of buffer sizes, including the metadata checksum
+ * of a 4KB block the way chunkfs computes it.
+ *
+ * (C) 2007-2008 Valerie Henson <val@nmt.edu>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <error.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+
+#include <linux/byteorder/little_endian.h>
+
+#include "chunkfs.h"
+
+struct impl {
+	const char *name;
+	__u32 (*fn)(__u32, const void *, unsigned int);
+	int sse42;		/* Needs the crc32 instruction */
+};
+
+static struct impl impls[] = {
+	{ "bytewise", crc32c_bytewise, 0 },
+	{ "slice8", crc32c_slice8, 0 },
+	{ "sse4.2", crc32c_sse42, 1 },
+	{ "default", crc32c, 0 },
+};
+
+#define	NR_IMPLS	(sizeof(impls) / sizeof(impls[0]))
+
+static unsigned int sizes[] = { 16, 64, 512, 4096, 65536, 1048576 };
+
+#define	NR_SIZES	(sizeof(sizes) / sizeof(sizes[0]))
+
+#define	MAX_SIZE	1048576
+
+static char * cmd;
+static double seconds = 0.2;
+
+static void usage (void)
+{
+	fprintf(stderr, "Usage: %s [-t <seconds per test>]\n", cmd);
+	exit(1);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Keeps the compiler from throwing away the work */
+static volatile __u32 sink;
+
+static void check(unsigned char *buf)
+{
+	unsigned int i;
+	unsigned int j;
+	__u32 want;
+
+	/* The standard check value */
+	for (i = 0; i < NR_IMPLS; i++) {
+		if (impls[i].sse42 && !crc32c_sse42_ok())
+			continue;
+		if (~impls[i].fn(~0U, "123456789", 9) != 0xe3069283)
+			error(1, 0, "%s: wrong check value", impls[i].name);
+	}
+
+	/* Every length and alignment against the simplest one */
+	for (i = 0; i < 256; i++) {
+		for (j = 0; j < 8; j++) {
+			unsigned int k;
+
+			want = crc32c_bytewise(~0U, buf + j, i);
+			for (k = 1; k < NR_IMPLS; k++) {
+				if (impls[k].sse42 && !crc32c_sse42_ok())
+					continue;
+				if (impls[k].fn(~0U, buf + j, i) != want)
+					error(1, 0, "%s: mismatch at length %u offset %u",
+					      impls[k].name, i, j);
+			}
+		}
+	}
+}
+
+static void bench(const char *name, unsigned char *buf, unsigned int size,
+		  __u32 (*fn)(__u32, const void *, unsigned int))
+{
+	unsigned long long iters = 0;
+	unsigned long long batch = 1;
+	double start = now();
+	double elapsed;
+	__u32 crc = ~0U;
+	unsigned long long i;
+
+	do {
+		for (i = 0; i < batch; i++)
+			crc = fn(crc, buf, size);
+		iters += batch;
+		if (batch < (1ULL << 20))
+			batch *= 2;
+		elapsed = now() - start;
+	} while (elapsed < seconds);
+	sink = crc;
+
+	printf("%-10s %8u %12.1f %10.1f\n", name, size,
+	       iters * (double) size / elapsed / (1024 * 1024),
+	       elapsed / iters * 1e9);
+}
+
+/* What every metadata read and write pays */
+static __u32 block_chksum(__u32 crc, const void *buf, unsigned int size)
+{
+	return chunkfs_chksum((void *) buf, size);
+}
+
+int main (int argc, char * argv[])
+{
+	unsigned char *buf;
+	unsigned int i;
+	unsigned int j;
+	int opt;
+
+	cmd = argv[0];
+
+	while ((opt = getopt(argc, argv, "t:")) != -1) {
+		switch (opt) {
+		case 't':
+			seconds = strtod(optarg, NULL);
+			if (seconds <= 0)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc)
+		usage();
+
+	buf = malloc(MAX_SIZE + 8);
+	if (!buf)
+		error(1, errno, "Cannot allocate buffer");
+	srandom(42);
+	for (i = 0; i < MAX_SIZE + 8; i++)
+		buf[i] = random();
+
+	check(buf);
+	printf("All implementations agree, sse4.2 %s\n",
+	       crc32c_sse42_ok() ? "available" : "not available");
+
+	printf("%-10s %8s %12s %10s\n", "impl", "bytes", "MB/s", "ns/call");
+	for (i = 0; i < NR_IMPLS; i++) {
+		if (impls[i].sse42 && !crc32c_sse42_ok())
+			continue;
+		for (j = 0; j < NR_SIZES; j++)
+			bench(impls[i].name, buf, sizes[j], impls[i].fn);
+	}
+	bench("metadata", buf, CHUNKFS_BLK_SIZE, block_chksum);
+
+	free(buf);
+	return 0;
+}
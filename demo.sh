@@ -44,15 +44,9 @@ losetup -o 21016576 /dev/loop3 ${FILE}
 OFFSET=$(((4096 * 4) + 0x0e00))
 dd if=/dev/zero of=/dev/loop1 seek=${OFFSET} bs=1 count=128
 
-# Repair individual chunks
+# Repair individual chunks, then cross-chunk repair, in parallel
 
-fsck -f /dev/loop1
-fsck -f /dev/loop2
-fsck -f /dev/loop3
-
-# Cross-chunk repair
-
-${BINPATH}/cross.sh
+${BINPATH}/fsck.chunkfs -f -y ${FILE}
 
 for i in 1 2 3; do
     mount -t ext2 -o user_xattr /dev/loop${i} /chunk${i}
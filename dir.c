@@ -64,5 +64,6 @@ struct file_operations chunkfs_dir_fops = {
 	.llseek		= chunkfs_dir_llseek,
 	.read		= generic_read_dir,
 	.open		= chunkfs_open,
+	.release	= chunkfs_release,
 	.iterate	= chunkfs_iterate,
 };
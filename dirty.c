@@ -0,0 +1,414 @@
+/*
+ * Chunkfs dirty chunk tracking
+ *
+ * Each device has a bitmap with one bit per chunk.  Before the first
+ * metadata change to a chunk we set its bit and wait for the map to
+ * hit the disk.  Once nothing has touched the chunk for a
+ * CHUNKFS_CLEAN_PERIOD we sync its client file system and clear the
+ * bit again, lazily.  After a crash, fsck.chunkfs only has to look at
+ * chunks with their bit set.
+ *
+ * Every metadata change is bracketed with chunkfs_start_chunk_write()
+ * and chunkfs_end_chunk_write().  The clean pass only clears a chunk
+ * that had no changes in flight and none started across a whole
+ * period and the sync that followed.
+ *
+ * Chunks that were already dirty at mount stay dirty until fsck has
+ * looked at them.
+ *
+ * (C) 2007-2008 Valerie Henson <val@nmt.edu>
+ */
+
+#include <linux/fs.h>
+#include <linux/buffer_head.h>
+#include <linux/blkdev.h>
+#include <linux/vmalloc.h>
+#include <linux/bitops.h>
+
+#include "chunkfs.h"
+#include "chunkfs_pool.h"
+#include "chunkfs_dev.h"
+#include "chunkfs_chunk.h"
+#include "chunkfs_i.h"
+
+static int
+dirty_map_read_only(struct chunkfs_dev_info *di)
+{
+	return di->di_pool->pi_client_flags & MS_RDONLY;
+}
+
+/*
+ * Write out the map if anything up to seq isn't on disk yet.  Whoever
+ * gets here first writes everybody's bits, so a burst of newly dirty
+ * chunks costs one write.
+ */
+
+static int
+chunkfs_flush_dirty_map(struct chunkfs_dev_info *di, u64 seq)
+{
+	struct block_device *bdev = di->di_bh->b_bdev;
+	sector_t block = le64_to_cpu(CHUNKFS_DEV(di)->d_dirty_map) /
+		CHUNKFS_BLK_SIZE;
+	unsigned int nr_blocks = di->di_dirty_len / CHUNKFS_BLK_SIZE;
+	struct buffer_head *bh;
+	unsigned int i;
+	u64 flushing;
+	int err = 0;
+
+	mutex_lock(&di->di_dirty_mutex);
+	if (di->di_dirty_flushed >= seq || dirty_map_read_only(di))
+		goto out;
+
+	spin_lock(&di->di_dirty_lock);
+	flushing = di->di_dirty_seq;
+	memcpy(di->di_dirty_buf, di->di_dirty, di->di_dirty_len);
+	spin_unlock(&di->di_dirty_lock);
+	write_chksum(di->di_dirty_buf, di->di_dirty_len);
+
+	for (i = 0; i < nr_blocks; i++) {
+		bh = __getblk(bdev, block + i, CHUNKFS_BLK_SIZE);
+		if (!bh) {
+			err = -ENOMEM;
+			break;
+		}
+		lock_buffer(bh);
+		memcpy(bh->b_data,
+		       (char *) di->di_dirty_buf + i * CHUNKFS_BLK_SIZE,
+		       CHUNKFS_BLK_SIZE);
+		set_buffer_uptodate(bh);
+		mark_buffer_dirty(bh);
+		unlock_buffer(bh);
+		/* Must be stable before the metadata it covers */
+		write_dirty_buffer(bh, WRITE_FUA);
+		brelse(bh);
+	}
+	for (i = 0; i < nr_blocks && !err; i++) {
+		bh = __getblk(bdev, block + i, CHUNKFS_BLK_SIZE);
+		if (!bh) {
+			err = -ENOMEM;
+			break;
+		}
+		wait_on_buffer(bh);
+		if (!buffer_uptodate(bh))
+			err = -EIO;
+		brelse(bh);
+	}
+	if (!err)
+		di->di_dirty_flushed = flushing;
+	else
+		printk(KERN_ERR "chunkfs: can't write dirty chunk map: %d\n",
+			err);
+ out:
+	mutex_unlock(&di->di_dirty_mutex);
+	return err;
+}
+
+/*
+ * Called with ci_dirty_lock held.
+ */
+
+static u64
+dirty_map_change(struct chunkfs_chunk_info *ci, int dirty)
+{
+	struct chunkfs_dev_info *di = ci->ci_dev;
+	unsigned long *bits = (unsigned long *) di->di_dirty->m_bits;
+	u64 seq;
+
+	spin_lock(&di->di_dirty_lock);
+	if (dirty)
+		__set_bit_le(ci->ci_chunk_id, bits);
+	else
+		__clear_bit_le(ci->ci_chunk_id, bits);
+	seq = ++di->di_dirty_seq;
+	spin_unlock(&di->di_dirty_lock);
+	return seq;
+}
+
+static int
+chunk_tracked(struct chunkfs_chunk_info *ci)
+{
+	struct chunkfs_dirty_map *map = ci->ci_dev->di_dirty;
+
+	return map && ci->ci_chunk_id < le64_to_cpu(map->m_nr);
+}
+
+int
+chunkfs_start_chunk_write(struct chunkfs_chunk_info *ci)
+{
+	u64 seq = 0;
+	int err;
+
+	spin_lock(&ci->ci_dirty_lock);
+	ci->ci_writers++;
+	ci->ci_changes++;
+	if (!ci->ci_dirty && chunk_tracked(ci))
+		seq = dirty_map_change(ci, 1);
+	spin_unlock(&ci->ci_dirty_lock);
+	if (!seq)
+		return 0;
+
+	err = chunkfs_flush_dirty_map(ci->ci_dev, seq);
+	if (err) {
+		chunkfs_end_chunk_write(ci);
+		return err;
+	}
+	spin_lock(&ci->ci_dirty_lock);
+	ci->ci_dirty = 1;
+	spin_unlock(&ci->ci_dirty_lock);
+	return 0;
+}
+
+void
+chunkfs_end_chunk_write(struct chunkfs_chunk_info *ci)
+{
+	spin_lock(&ci->ci_dirty_lock);
+	BUG_ON(ci->ci_writers == 0);
+	ci->ci_writers--;
+	spin_unlock(&ci->ci_dirty_lock);
+}
+
+/*
+ * Clear the bit of a dirty chunk if nothing has been started since
+ * changes was sampled.  The caller has synced the client since then.
+ */
+
+static void
+clear_if_unchanged(struct chunkfs_chunk_info *ci, unsigned long changes)
+{
+	spin_lock(&ci->ci_dirty_lock);
+	if (ci->ci_dirty && !ci->ci_needs_check && !ci->ci_writers &&
+	    ci->ci_changes == changes) {
+		dirty_map_change(ci, 0);
+		ci->ci_dirty = 0;
+	}
+	spin_unlock(&ci->ci_dirty_lock);
+}
+
+/*
+ * A chunk being detached has lost ci_mnt, so nothing new can start
+ * on it, but its client sb is still ours.  Sync it and clear the bit
+ * if that worked.  The unmount that follows can't be counted on to
+ * sync, it may not be dropping the last reference.
+ */
+
+void
+chunkfs_clean_detaching_chunk(struct chunkfs_chunk_info *ci,
+			      struct super_block *sb)
+{
+	unsigned long changes;
+	int err;
+
+	if (!chunk_tracked(ci))
+		return;
+	spin_lock(&ci->ci_dirty_lock);
+	changes = ci->ci_changes;
+	spin_unlock(&ci->ci_dirty_lock);
+
+	down_read(&sb->s_umount);
+	err = sync_filesystem(sb);
+	up_read(&sb->s_umount);
+	if (!err)
+		clear_if_unchanged(ci, changes);
+}
+
+static int
+sync_chunk(struct chunkfs_chunk_info *ci)
+{
+	struct super_block *sb;
+	int err;
+
+	/* Detached chunks were cleaned on the way out */
+	if (!chunkfs_tryget_chunk(ci))
+		return -EAGAIN;
+	sb = ci->ci_sb;
+	down_read(&sb->s_umount);
+	err = sync_filesystem(sb);
+	up_read(&sb->s_umount);
+	chunkfs_put_chunk(ci);
+	return err;
+}
+
+static void
+clean_chunk(struct chunkfs_chunk_info *ci, int force)
+{
+	unsigned long changes;
+	int quiet;
+
+	spin_lock(&ci->ci_dirty_lock);
+	changes = ci->ci_changes;
+	quiet = ci->ci_dirty && !ci->ci_needs_check && !ci->ci_writers &&
+		(force || changes == ci->ci_clean_changes);
+	ci->ci_clean_changes = changes;
+	spin_unlock(&ci->ci_dirty_lock);
+	if (!quiet)
+		return;
+
+	if (sync_chunk(ci))
+		return;
+	clear_if_unchanged(ci, changes);
+}
+
+static void
+clean_pool(struct chunkfs_pool_info *pi, int force)
+{
+	struct chunkfs_dev_info *di;
+	struct chunkfs_chunk_info *ci;
+
+	list_for_each_entry(di, &pi->pi_dlist_head, di_dlist) {
+		if (!di->di_dirty)
+			continue;
+		list_for_each_entry(ci, &di->di_clist_head, ci_clist)
+			if (chunk_tracked(ci))
+				clean_chunk(ci, force);
+		/* Clearing can wait for the next write, but don't make it */
+		chunkfs_flush_dirty_map(di, di->di_dirty_seq);
+	}
+}
+
+static void
+chunkfs_clean_work(struct work_struct *work)
+{
+	struct chunkfs_pool_info *pi = container_of(to_delayed_work(work),
+				struct chunkfs_pool_info, pi_clean_work);
+
+	clean_pool(pi, 0);
+	queue_delayed_work(chunkfs_wq, &pi->pi_clean_work,
+			   CHUNKFS_CLEAN_PERIOD);
+}
+
+void
+chunkfs_init_clean(struct chunkfs_pool_info *pi)
+{
+	INIT_DELAYED_WORK(&pi->pi_clean_work, chunkfs_clean_work);
+}
+
+void
+chunkfs_start_clean(struct chunkfs_pool_info *pi)
+{
+	if (pi->pi_client_flags & MS_RDONLY)
+		return;
+	queue_delayed_work(chunkfs_wq, &pi->pi_clean_work,
+			   CHUNKFS_CLEAN_PERIOD);
+}
+
+/*
+ * Unmount.  All our inodes are gone, so nothing is in flight; sync
+ * and clear whatever is still dirty.
+ */
+
+void
+chunkfs_stop_clean(struct chunkfs_pool_info *pi)
+{
+	cancel_delayed_work_sync(&pi->pi_clean_work);
+	if (pi->pi_client_flags & MS_RDONLY)
+		return;
+	clean_pool(pi, 1);
+}
+
+/*
+ * Read the dirty map at mount.  A device without one is fine, we just
+ * don't track it.  A bad one makes every chunk dirty.
+ */
+
+int
+chunkfs_read_dirty_map(struct super_block *sb, struct chunkfs_dev_info *di)
+{
+	struct chunkfs_dev *dev = CHUNKFS_DEV(di);
+	ci_byte_t offset = le64_to_cpu(dev->d_dirty_map);
+	ci_byte_t len = le64_to_cpu(dev->d_dirty_map_len);
+	sector_t block = offset / CHUNKFS_BLK_SIZE;
+	/* Big enough for every chunk id, and no bigger than the disk */
+	ci_byte_t max_len = round_up(chunkfs_dirty_map_bytes(1ULL <<
+					di->di_pool->pi_chunk_bits),
+				     CHUNKFS_BLK_SIZE);
+	ci_byte_t dev_size = i_size_read(sb->s_bdev->bd_inode);
+	struct chunkfs_dirty_map *map;
+	struct chunkfs_chunk_info *ci;
+	struct buffer_head *bh;
+	struct blk_plug plug;
+	unsigned int nr_blocks;
+	unsigned int nr_dirty = 0;
+	unsigned int nr_chunks = 0;
+	unsigned int i;
+	int bad = 0;
+	int err;
+
+	spin_lock_init(&di->di_dirty_lock);
+	mutex_init(&di->di_dirty_mutex);
+	if (offset == 0)
+		return 0;
+	if (offset % CHUNKFS_BLK_SIZE || len % CHUNKFS_BLK_SIZE ||
+	    len < CHUNKFS_BLK_SIZE || len > max_len ||
+	    offset >= dev_size || len > dev_size - offset) {
+		printk(KERN_ERR "chunkfs: bad dirty chunk map location\n");
+		return -EINVAL;
+	}
+	nr_blocks = len / CHUNKFS_BLK_SIZE;
+
+	map = vzalloc(len);
+	di->di_dirty_buf = vzalloc(len);
+	if (!map || !di->di_dirty_buf) {
+		vfree(map);
+		vfree(di->di_dirty_buf);
+		di->di_dirty_buf = NULL;
+		return -ENOMEM;
+	}
+
+	blk_start_plug(&plug);
+	for (i = 0; i < nr_blocks; i++)
+		sb_breadahead(sb, block + i);
+	blk_finish_plug(&plug);
+	for (i = 0; i < nr_blocks; i++) {
+		bh = sb_bread(sb, block + i);
+		if (!bh) {
+			bad = 1;
+			break;
+		}
+		memcpy((char *) map + i * CHUNKFS_BLK_SIZE, bh->b_data,
+		       CHUNKFS_BLK_SIZE);
+		brelse(bh);
+	}
+	if (!bad && (err = check_dirty_map(map, len,
+				di->di_pool->pi_legacy_chksum)) != 0) {
+		printk(KERN_ERR "chunkfs: invalid dirty chunk map, err %d chksum %0x\n",
+			err, le32_to_cpu(map->m_chksum));
+		bad = 1;
+	}
+	if (bad) {
+		/* Assume the worst, and write a good one out next time */
+		memset(map, 0, len);
+		map->m_magic = cpu_to_le32(CHUNKFS_DIRTY_MAGIC);
+		map->m_nr = cpu_to_le64((len - sizeof(*map)) * 8);
+		memset(map->m_bits, 0xff, len - sizeof(*map));
+		di->di_dirty_seq = 1;
+	}
+	di->di_dirty = map;
+	di->di_dirty_len = len;
+
+	list_for_each_entry(ci, &di->di_clist_head, ci_clist) {
+		nr_chunks++;
+		if (!chunk_tracked(ci)) {
+			printk(KERN_ERR "chunkfs: chunk %llu not in dirty chunk map\n",
+				ci->ci_chunk_id);
+			continue;
+		}
+		if (chunkfs_dirty_map_test(map, ci->ci_chunk_id)) {
+			ci->ci_dirty = 1;
+			ci->ci_needs_check = 1;
+			nr_dirty++;
+		}
+	}
+	if (nr_dirty)
+		printk(KERN_WARNING "chunkfs: %u of %u chunks were not cleanly unmounted, run fsck.chunkfs\n",
+			nr_dirty, nr_chunks);
+	return 0;
+}
+
+void
+chunkfs_free_dirty_map(struct chunkfs_dev_info *di)
+{
+	vfree(di->di_dirty);
+	vfree(di->di_dirty_buf);
+	di->di_dirty = NULL;
+	di->di_dirty_buf = NULL;
+}
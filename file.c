@@ -8,12 +8,17 @@
 #include <linux/security.h>
 #include <linux/quotaops.h>
 #include <linux/file.h>
+#include <linux/slab.h>
+#include <linux/uio.h>
+#include <linux/pagemap.h>
+#include <linux/mm.h>
 
 #include "chunkfs.h"
 #include "chunkfs_pool.h"
 #include "chunkfs_dev.h"
 #include "chunkfs_chunk.h"
 #include "chunkfs_i.h"
+#include "chunkfs_trace.h"
 
 /*
  * The point of all these wrapper functions is the following:
@@ -60,41 +65,146 @@ copy_up_file(struct file *file, struct file *client_file, u64 client_start)
 }
 
 /*
- * Open the client inode at offset and return the file struct.
+ * Look for an already open client file for this continuation.  The
+ * returned file has an extra reference for the caller.
  */
 
-int
-chunkfs_open_cont_file(struct file *file, loff_t *ppos,
-		       struct file **client_file,
-		       struct chunkfs_continuation **ret_cont)
+static struct file *
+get_cached_client_file(struct chunkfs_file_info *fi, u64 uino)
+{
+	struct chunkfs_client_file *cf;
+	struct file *client_file = NULL;
+	int i;
+
+	mutex_lock(&fi->fi_lock);
+	for (i = 0; i < CHUNKFS_CLIENT_FILES; i++) {
+		cf = &fi->fi_files[i];
+		if (cf->cf_file && cf->cf_uino == uino) {
+			cf->cf_last_used = ++fi->fi_clock;
+			client_file = get_file(cf->cf_file);
+			break;
+		}
+	}
+	mutex_unlock(&fi->fi_lock);
+	return client_file;
+}
+
+/*
+ * Remember a client file for later, throwing out the least recently
+ * used one if we're full.  Takes its own reference, and its own use
+ * count on the chunk.
+ */
+
+void
+chunkfs_cache_client_file(struct file *file, u64 uino,
+			  struct file *client_file,
+			  struct chunkfs_chunk_info *ci)
+{
+	struct chunkfs_file_info *fi = CHUNKFS_F(file);
+	struct chunkfs_client_file *cf;
+	struct chunkfs_client_file *victim = &fi->fi_files[0];
+	struct chunkfs_chunk_info *old_chunk;
+	struct file *old_file;
+	int i;
+
+	mutex_lock(&fi->fi_lock);
+	for (i = 0; i < CHUNKFS_CLIENT_FILES; i++) {
+		cf = &fi->fi_files[i];
+		if (cf->cf_file && cf->cf_uino == uino) {
+			/* Somebody beat us to it */
+			mutex_unlock(&fi->fi_lock);
+			return;
+		}
+		if (!cf->cf_file || cf->cf_last_used < victim->cf_last_used)
+			victim = cf;
+		if (!victim->cf_file)
+			break;
+	}
+	old_file = victim->cf_file;
+	old_chunk = victim->cf_chunk;
+	chunkfs_hold_chunk(ci);
+	victim->cf_uino = uino;
+	victim->cf_file = get_file(client_file);
+	victim->cf_chunk = ci;
+	victim->cf_last_used = ++fi->fi_clock;
+	mutex_unlock(&fi->fi_lock);
+
+	if (old_file) {
+		fput(old_file);
+		chunkfs_put_chunk(old_chunk);
+	}
+}
+
+/*
+ * Find the continuation covering pos and a client file open on it,
+ * without touching any file positions.  Opens are cached in the
+ * chunkfs file struct and reused until release.  The caller must
+ * fput() the client file and put the continuation.
+ */
+
+static int
+get_cont_file(struct file *file, loff_t pos, struct file **client_file,
+	      struct chunkfs_continuation **ret_cont)
 {
+	const struct cred *cred = CHUNKFS_PI(file->f_dentry->d_sb)->pi_cred;
 	struct chunkfs_continuation *cont;
-	struct chunkfs_cont_data *cd;
 	struct file *new_file;
 	/* TODO: embed struct path into chunkfs_continuation */
 	struct path co_path;
 	int err;
 
-	chunkfs_debug("pos %llu\n", *ppos);
-
-	err = chunkfs_get_cont_at_offset(file->f_dentry, *ppos, &cont);
+	err = chunkfs_get_cont_at_offset(file->f_dentry, pos, &cont);
 	if (err)
 		return err;
 
-	co_path.mnt = cont->co_mnt;
-	co_path.dentry = cont->co_dentry;
-
-	new_file = dentry_open(&co_path, file->f_flags, file->f_cred);
-	if (IS_ERR(new_file)) {
-		err = PTR_ERR(new_file);
-		chunkfs_debug("dentry_open: err %d\n", err);
-		goto out;
+	new_file = get_cached_client_file(CHUNKFS_F(file), cont->co_uino);
+	if (!new_file) {
+		co_path.mnt = cont->co_mnt;
+		co_path.dentry = cont->co_dentry;
+
+		/*
+		 * Client offsets are ours to pick, never append.  The
+		 * user was checked against our inode at open, the
+		 * client file is the pool's, see cont_open_file().
+		 */
+		chunkfs_count(file->f_dentry->d_sb, client_opens);
+		new_file = dentry_open(&co_path, file->f_flags & ~O_APPEND,
+				       cred);
+		trace_chunkfs_client_open(file->f_dentry->d_inode,
+					  cont->co_chunk_id, cont->co_dentry,
+					  PTR_ERR_OR_ZERO(new_file));
+		if (IS_ERR(new_file)) {
+			err = PTR_ERR(new_file);
+			chunkfs_put_continuation(cont);
+			return err;
+		}
+		chunkfs_cache_client_file(file, cont->co_uino, new_file,
+					  cont->co_chunk);
 	}
-	cd = &cont->co_cd;
-	chunkfs_copy_down_file(file, ppos, new_file, cd->cd_start);
-
 	*ret_cont = cont;
 	*client_file = new_file;
+	return 0;
+}
+
+/*
+ * Open the client inode at offset and return the file struct, with
+ * the positions converted to be relative to the client file.
+ */
+
+int
+chunkfs_open_cont_file(struct file *file, loff_t *ppos,
+		       struct file **client_file,
+		       struct chunkfs_continuation **ret_cont)
+{
+	int err;
+
+	chunkfs_debug("pos %llu\n", *ppos);
+
+	err = get_cont_file(file, *ppos, client_file, ret_cont);
+	if (err)
+		goto out;
+	chunkfs_copy_down_file(file, ppos, *client_file,
+			       (*ret_cont)->co_cd.cd_start);
  out:
 	chunkfs_debug("returning %d\n", err);
 	return err;
@@ -105,12 +215,14 @@ chunkfs_close_cont_file(struct file *file, struct file *client_file,
 			   struct chunkfs_continuation *cont)
 {
 	struct chunkfs_cont_data *cd = &cont->co_cd;
-	/* XXX... sys_close does a lot more than this. */
+
 	chunkfs_debug("enter\n");
 	copy_up_file(file, client_file, cd->cd_start);
 	chunkfs_copy_up_inode(file->f_dentry->d_inode,
 			      client_file->f_dentry->d_inode);
 	chunkfs_put_continuation(cont);
+	/* The cache keeps its own reference */
+	fput(client_file);
 }
 
 /*
@@ -127,82 +239,255 @@ chunkfs_llseek_file(struct file *file, loff_t offset, int origin)
 }
 
 /*
- * Find the right inode for the offset and read from it.  Opens and
- * closes the client file struct every time because I'm lazy.
+ * Synchronous read or write of one continuation's worth of an
+ * iov_iter through the client file.
  */
 
 static ssize_t
-chunkfs_read(struct file *file, char __user *buf, size_t len, loff_t *ppos)
+client_rw_iter(struct file *client_file, struct iov_iter *iter,
+	       loff_t client_pos, int rw)
 {
-	struct file *client_file;
-	struct chunkfs_continuation *cont;
-	int err;
+	struct kiocb kiocb;
+	ssize_t ret;
 
-	chunkfs_debug("enter\n");
+	init_sync_kiocb(&kiocb, client_file);
+	kiocb.ki_pos = client_pos;
+	kiocb.ki_nbytes = iov_iter_count(iter);
 
-	err = chunkfs_open_cont_file(file, ppos, &client_file, &cont);
-	/* Read off the end of the file */
-	/* XXX distinguish between this and EIO */
-	if (err == -ENOENT)
-		return 0;
-	if (err)
-		return err;
+	if (rw == WRITE) {
+		file_start_write(client_file);
+		ret = client_file->f_op->write_iter(&kiocb, iter);
+	} else {
+		ret = client_file->f_op->read_iter(&kiocb, iter);
+	}
+	if (ret == -EIOCBQUEUED)
+		ret = wait_on_sync_kiocb(&kiocb);
+	if (rw == WRITE)
+		file_end_write(client_file);
+	return ret;
+}
 
-	/* XXX assume not longer than len */
-	if (client_file->f_op->read)
-		err = client_file->f_op->read(client_file, buf, len, ppos);
-	else
-		err = do_sync_read(client_file, buf, len, ppos);
+/*
+ * Walk the continuations covering [pos, pos + count) and do one
+ * client I/O for each.  Writes past the last continuation grow the
+ * file into new ones.  Returns the number of bytes transferred, or
+ * an error if nothing was.
+ *
+ * Only used for O_DIRECT now, everything else goes through our page
+ * cache (see aops.c).
+ */
+
+static ssize_t
+chunkfs_rw_iter(struct file *file, struct iov_iter *iter, loff_t *ppos,
+		int rw)
+{
+	struct inode *inode = file->f_dentry->d_inode;
+	struct chunkfs_continuation *cont;
+	struct chunkfs_cont_data *cd;
+	struct file *client_file;
+	struct inode *client_inode = NULL;
+	loff_t pos = *ppos;
+	size_t count;
+	size_t seg;
+	ssize_t done = 0;
+	ssize_t ret = 0;
+
+	chunkfs_debug("pos %llu len %zu %s\n", pos, iov_iter_count(iter),
+		rw == WRITE ? "write" : "read");
+
+	if (rw == READ)
+		chunkfs_count(inode->i_sb, reads);
+	while ((count = iov_iter_count(iter)) != 0) {
+		if (rw == WRITE) {
+			ret = chunkfs_grow_to(file->f_dentry, pos);
+			if (ret)
+				break;
+		}
+		ret = get_cont_file(file, pos, &client_file, &cont);
+		/* Read off the end of the file */
+		/* XXX distinguish between this and EIO */
+		if (ret == -ENOENT)
+			ret = 0;
+		if (ret)
+			break;
 
-	/* If we read off the end, no problemo */
-	if (err == -ENODATA)
-		err = 0;
+		cd = &cont->co_cd;
+		seg = min_t(u64, count, cd->cd_start + cd->cd_len - pos);
+		iov_iter_truncate(iter, seg);
+		if (rw == WRITE)
+			ret = chunkfs_start_chunk_write(cont->co_chunk);
+		if (!ret) {
+			ret = client_rw_iter(client_file, iter,
+					     pos - cd->cd_start, rw);
+			if (rw == WRITE)
+				chunkfs_end_chunk_write(cont->co_chunk);
+		}
+		/* If we read off the end, no problemo */
+		if (ret == -ENODATA)
+			ret = 0;
+		iov_iter_reexpand(iter, count - (ret > 0 ? ret : 0));
+
+		if (rw == WRITE && ret > 0)
+			chunkfs_mark_cont_dirty(inode, pos);
+		if (client_inode) {
+			iput(client_inode);
+			/* Not our first continuation */
+			if (rw == READ)
+				chunkfs_count(inode->i_sb, read_hops);
+		}
+		client_inode = igrab(client_file->f_dentry->d_inode);
+		fput(client_file);
+		chunkfs_put_continuation(cont);
 
-	chunkfs_close_cont_file(file, client_file, cont);
-	return err;
+		if (ret <= 0)
+			break;
+		pos += ret;
+		done += ret;
+		/* Short transfer means EOF or hole, or the client is full */
+		if (ret < seg)
+			break;
+	}
+
+	if (client_inode) {
+		chunkfs_copy_up_inode(inode, client_inode);
+		iput(client_inode);
+	}
+	if (rw == WRITE && pos > i_size_read(inode))
+		i_size_write(inode, pos);
+	*ppos = pos;
+	chunkfs_debug("pos %llu returning %zd (err %zd)\n", pos, done, ret);
+	return done ? done : ret;
 }
 
 static ssize_t
-chunkfs_write(struct file *file, const char __user *buf, size_t len,
-	      loff_t *ppos)
+chunkfs_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
-	struct chunkfs_continuation *cont;
-	struct file *client_file;
-	ssize_t size;
+	struct file *file = iocb->ki_filp;
+	loff_t pos = iocb->ki_pos;
+	ssize_t ret;
+
+	if (!(file->f_flags & O_DIRECT))
+		return generic_file_read_iter(iocb, to);
+
+	ret = filemap_write_and_wait_range(file->f_mapping, pos,
+					   pos + iov_iter_count(to) - 1);
+	if (ret)
+		return ret;
+	return chunkfs_rw_iter(file, to, &iocb->ki_pos, READ);
+}
+
+static ssize_t
+chunkfs_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct file *file = iocb->ki_filp;
+	struct inode *inode = file->f_dentry->d_inode;
+	size_t count = iov_iter_count(from);
+	loff_t pos = iocb->ki_pos;
+	ssize_t ret;
+
+	if (!(file->f_flags & O_DIRECT))
+		return generic_file_write_iter(iocb, from);
+
+	mutex_lock(&inode->i_mutex);
+	/* Takes care of O_APPEND and size limits */
+	ret = generic_write_checks(file, &pos, &count, 0);
+	if (ret || count == 0)
+		goto out;
+	iov_iter_truncate(from, count);
+	/* Push out and drop anything cached over the range */
+	ret = filemap_write_and_wait_range(file->f_mapping, pos,
+					   pos + count - 1);
+	if (ret)
+		goto out;
+	invalidate_inode_pages2_range(file->f_mapping,
+				      pos >> PAGE_CACHE_SHIFT,
+				      (pos + count - 1) >> PAGE_CACHE_SHIFT);
+	ret = chunkfs_rw_iter(file, from, &pos, WRITE);
+	iocb->ki_pos = pos;
+ out:
+	mutex_unlock(&inode->i_mutex);
+	return ret;
+}
+
+/*
+ * Truncate grows the chain to the end of the file, but make sure a
+ * continuation covers the page now anyway, while we can still turn
+ * failure into SIGBUS, instead of in writeback.
+ */
+
+static int
+chunkfs_page_mkwrite(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+	struct page *page = vmf->page;
+	struct file *file = vma->vm_file;
+	struct inode *inode = file_inode(file);
+	loff_t size;
+	loff_t end;
+	int ret = VM_FAULT_LOCKED;
 	int err;
 
-	chunkfs_debug("pos %llu len %zu\n", *ppos, len);
+	sb_start_pagefault(inode->i_sb);
+	file_update_time(file);
 
-	err = chunkfs_open_cont_file(file, ppos, &client_file, &cont);
-	if (err == -ENOENT) {
-		err = chunkfs_create_continuation(file, ppos, &client_file,
-						  &cont);
+	size = i_size_read(inode);
+	end = min_t(loff_t, page_offset(page) + PAGE_CACHE_SIZE, size);
+	if (page_offset(page) >= size) {
+		ret = VM_FAULT_NOPAGE;
+		goto out;
+	}
+	err = chunkfs_grow_to(file->f_dentry, end - 1);
+	if (err) {
+		ret = (err == -ENOMEM) ? VM_FAULT_OOM : VM_FAULT_SIGBUS;
+		goto out;
 	}
-	if (err)
-		return err;
 
-	/* XXX assume not longer than len */
-	if (client_file->f_op->write)
-		size = client_file->f_op->write(client_file, buf, len, ppos);
-	else
-		size = do_sync_write(client_file, buf, len, ppos);
+	lock_page(page);
+	if (page->mapping != inode->i_mapping) {
+		/* Truncated while we weren't looking */
+		unlock_page(page);
+		ret = VM_FAULT_NOPAGE;
+		goto out;
+	}
+	set_page_dirty(page);
+	wait_for_stable_page(page);
+ out:
+	sb_end_pagefault(inode->i_sb);
+	return ret;
+}
 
-	chunkfs_close_cont_file(file, client_file, cont);
+static const struct vm_operations_struct chunkfs_file_vm_ops = {
+	.fault		= filemap_fault,
+	.map_pages	= filemap_map_pages,
+	.page_mkwrite	= chunkfs_page_mkwrite,
+	.remap_pages	= generic_file_remap_pages,
+};
 
-	chunkfs_debug("pos %llu len %zu, returning size %zu\n", *ppos, len, size);
+/*
+ * Pages come from our own page cache, so this is the generic mmap
+ * with our own write fault handler.
+ */
 
-	return size;
+static int
+chunkfs_file_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	chunkfs_debug("enter\n");
+
+	file_accessed(file);
+	vma->vm_ops = &chunkfs_file_vm_ops;
+	return 0;
 }
 
 /*
  * Open only affects the top-level chunkfs file struct.  Do an open of
- * the underlying head client inode just to see that we can, then
- * close it again.
+ * the underlying head client inode just to see that we can; it stays
+ * in the client file cache for the first read or write.  Permission
+ * was already checked against the chunkfs inode.
  */
 
 int
 chunkfs_open(struct inode *inode, struct file *filp)
 {
+	struct chunkfs_file_info *fi;
 	struct file *client_file;
 	struct chunkfs_continuation *cont;
 	loff_t dummy_pos = 0;
@@ -210,16 +495,48 @@ chunkfs_open(struct inode *inode, struct file *filp)
 
 	chunkfs_debug("enter\n");
 
+	fi = kzalloc(sizeof(*fi), GFP_KERNEL);
+	if (!fi)
+		return -ENOMEM;
+	mutex_init(&fi->fi_lock);
+	filp->private_data = fi;
+
 	err = chunkfs_open_cont_file(filp, &dummy_pos, &client_file, &cont);
 	if (err)
 		goto out;
 	chunkfs_close_cont_file(filp, client_file, cont);
 	return 0;
  out:
+	chunkfs_release(inode, filp);
 	chunkfs_debug("returning %d\n", err);
 	return err;
 }
 
+/*
+ * Drop all the client files we've been hanging on to.
+ */
+
+int
+chunkfs_release(struct inode *inode, struct file *filp)
+{
+	struct chunkfs_file_info *fi = CHUNKFS_F(filp);
+	int i;
+
+	chunkfs_debug("enter\n");
+
+	if (!fi)
+		return 0;
+	for (i = 0; i < CHUNKFS_CLIENT_FILES; i++) {
+		if (fi->fi_files[i].cf_file) {
+			fput(fi->fi_files[i].cf_file);
+			chunkfs_put_chunk(fi->fi_files[i].cf_chunk);
+		}
+	}
+	kfree(fi);
+	filp->private_data = NULL;
+	return 0;
+}
+
 /*
  * Apparently, file may be null at this point.  Uh.  Whatever.
  */
@@ -227,44 +544,47 @@ chunkfs_open(struct inode *inode, struct file *filp)
 static int
 chunkfs_fsync_file(struct file *file, loff_t start, loff_t end, int datasync)
 {
-	struct chunkfs_inode_info *ii = CHUNKFS_I(file->f_dentry->d_inode);
-	struct chunkfs_continuation *prev_cont = NULL;
-	struct chunkfs_continuation *next_cont;
-	struct dentry *client_dentry;
-	struct inode *client_inode;
-	struct file client_file;
-	int err = -EIO;
+	struct inode *inode = file->f_dentry->d_inode;
+	int err;
 
 	chunkfs_debug("enter\n");
 
-	/* XXX syncs all inodes instead of just ones in mem */
-	mutex_lock(&ii->ii_continuations_lock);
-	while (1) {
-		err = chunkfs_get_next_cont(file->f_dentry, prev_cont, &next_cont);
-		if (err || (next_cont == NULL))
-			break;
-		client_dentry = next_cont->co_dentry;
-		client_inode = client_dentry->d_inode;
-
-		client_file.f_dentry = client_dentry;
-		client_file.f_inode = client_inode;
-		/* XXX error propagation */
-		err = client_inode->i_fop->fsync(&client_file, start, end, datasync);
-		prev_cont = next_cont;
-	}
-	mutex_unlock(&ii->ii_continuations_lock);
+	/* Get our own dirty pages down to the clients first */
+	err = filemap_write_and_wait_range(file->f_mapping, start, end);
+	if (err)
+		return err;
+
+	/* Then only the continuations that took any of them */
+	err = chunkfs_sync_conts(inode, start, end, datasync);
 	chunkfs_debug("err %d\n", err);
 	return err;
 }
 
 int chunkfs_setattr(struct dentry *dentry, struct iattr *attr)
 {
-	struct inode *client_inode = get_client_inode(dentry->d_inode);
+	struct inode *inode = dentry->d_inode;
+	struct inode *client_inode = get_client_inode(inode);
 	struct dentry *client_dentry = get_client_dentry(dentry);
+	int truncate = 0;
 	int error;
 
 	chunkfs_debug("enter\n");
 
+	/*
+	 * A regular file's size belongs to us, not the head, so resize
+	 * every continuation ourselves and pass the rest down.
+	 */
+	if (S_ISREG(inode->i_mode) && (attr->ia_valid & ATTR_SIZE)) {
+		error = inode_newsize_ok(inode, attr->ia_size);
+		if (error)
+			return error;
+		attr->ia_valid &= ~ATTR_SIZE;
+		truncate = 1;
+	}
+
+	error = chunkfs_start_write(inode);
+	if (error)
+		return error;
 	if (client_inode->i_op->setattr) {
 		error = client_inode->i_op->setattr(client_dentry, attr);
 	} else {
@@ -277,8 +597,20 @@ int chunkfs_setattr(struct dentry *dentry, struct iattr *attr)
 			mark_inode_dirty(client_inode);
 		}
 	}
+	/*
+	 * Growing makes the chain reach the new end first, so the
+	 * size can be read back from the clients, see read_inode_size().
+	 */
+	if (!error && truncate && attr->ia_size > i_size_read(inode))
+		error = chunkfs_grow_to(dentry, attr->ia_size - 1);
+	if (!error && truncate) {
+		truncate_setsize(inode, attr->ia_size);
+		error = chunkfs_truncate_conts(dentry, attr->ia_size);
+		attr->ia_valid |= ATTR_SIZE;
+	}
 	if (!error)
-		chunkfs_copy_up_inode(dentry->d_inode, client_inode);
+		chunkfs_copy_up_inode(inode, client_inode);
+	chunkfs_end_write(inode);
 	return error;
 }
 
@@ -300,13 +632,24 @@ int chunkfs_permission(struct inode *inode, int submask)
 
 struct file_operations chunkfs_file_fops = {
 	.llseek		= chunkfs_llseek_file,
-	.read		= chunkfs_read,
-	.write		= chunkfs_write,
+	.read		= new_sync_read,
+	.write		= new_sync_write,
+	.read_iter	= chunkfs_read_iter,
+	.write_iter	= chunkfs_write_iter,
+	.mmap		= chunkfs_file_mmap,
+	.splice_read	= generic_file_splice_read,
+	.splice_write	= iter_file_splice_write,
 	.open		= chunkfs_open,
+	.release	= chunkfs_release,
 	.fsync		= chunkfs_fsync_file,
 };
 
+/*
+ * No ->permission: the VFS checks the chunkfs inode, whose owner and
+ * mode are the head's.  Continuations belong to the pool, so asking
+ * a client inode would give different answers along the file.
+ */
+
 struct inode_operations chunkfs_file_iops = {
 	.setattr	= chunkfs_setattr,
-	.permission	= chunkfs_permission,
 };
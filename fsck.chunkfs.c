@@ -1,212 +1,1151 @@
 /*
- * Check and repair a chunkfs file system.
+ * Check a chunkfs file system.
+ *
+ * Only chunks marked in the dirty chunk map are checked, unless -f is
+ * given.  Checking happens in two phases, each run by a pool of
+ * worker threads:
+ *
+ * 1. Each dirty chunk's client file system is checked by its own
+ *    fsck.<client fs>, on a loop device covering the chunk.
+ *
+ * 2. Cross-chunk checks.  Continuations live in <from chunk>/<from
+ *    ino> in the chunk they are in.  Each chunk's client fs is
+ *    mounted and read once, building sorted sets of its inodes and
+ *    their next pointers, and of the continuations it holds.  The
+ *    sets are then matched against each other to find orphan
+ *    continuations, whose <from ino> is gone or points elsewhere, and
+ *    dangling next pointers.  Orphans are removed and dangling
+ *    pointers cut.  Only pairs where either end is dirty are looked
+ *    at.
+ *
+ * Chunks that come out clean get their dirty bit cleared.
+ *
+ * -M marks chunks dirty instead of checking anything, so that tests
+ * can pretend those chunks were being written when the system went
+ * down.
  *
  * (C) 2007-2008 Val Henson <val@nmt.edu>
  */
 
+#define _GNU_SOURCE	/* nftw() */
+
 #include <stdio.h>
-#include <stdlib.h>
 #include <error.h>
 #include <errno.h>
-#include <sys/types.h>
-#include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <pthread.h>
 #include <time.h>
+#include <dirent.h>
+#include <ftw.h>
+#include <sys/wait.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
 
-#include <asm/byteorder.h>
+#include <linux/byteorder/little_endian.h>
 
 #include "chunkfs.h"
+#include "chunkfs_pool.h"
+#include "chunkfs_dev.h"
+#include "chunkfs_chunk.h"
+#include "chunkfs_i.h"
+
+/* fsck(8) exit codes */
+#define	FSCK_OK		0
+#define	FSCK_CORRECTED	1
+#define	FSCK_UNCORRECTED 4
+#define	FSCK_ERROR	8
+
+/* Give up removing orphans made by removing orphans after this */
+#define	MAX_CROSS_PASSES	8
+
+enum {
+	PHASE_CLIENT,
+	PHASE_CROSS,
+	NR_PHASES,
+};
+
+struct fsck_chunk {
+	__u64 chunk_id;
+	__u64 begin;
+	__u64 end;
+	__u64 innards_begin;
+	__u64 innards_end;
+	char client_fs[CHUNKFS_CLIENT_NAME_LEN + 1];
+	int dirty;
+	char loop[32];		/* Loop device over the innards, once set up */
+	char mnt[32];		/* Where the client fs is mounted, ditto */
+	int status;		/* fsck(8) exit code bits */
+	int broken;		/* Can't be cross-checked */
+	__u64 *from;		/* Continuation directories at the top */
+	unsigned int nr_from;
+	int full_walk;		/* Need every inode, not just continuations */
+	struct cont_src *srcs;	/* Sorted by ino */
+	unsigned int nr_srcs;
+	struct cont_dst *dsts;	/* Sorted by <from chunk>/<from ino> */
+	unsigned int nr_dsts;
+	char **orphans;		/* Paths to remove */
+	unsigned int nr_orphans;
+	char **dangling;	/* Paths whose next pointer to cut */
+	unsigned int nr_dangling;
+	unsigned int found_orphans;
+	unsigned int found_dangling;
+	double time[NR_PHASES];	/* Seconds spent on this chunk */
+};
+
+struct fsck_phase {
+	int phase;
+	void (*check)(struct fsck_chunk *);
+	pthread_mutex_t lock;
+	unsigned int next;	/* Next chunk to hand out */
+};
+
+/* A client inode and where its continuation record says to go next */
+struct cont_src {
+	__u64 ino;
+	int has_rec;
+	__u64 next_chunk;
+	__u64 next_ino;		/* 0 if none */
+	char *path;		/* Only kept if there is a next */
+};
+
+/* A continuation, <from chunk>/<from ino> in the chunk it lives in */
+struct cont_dst {
+	__u64 from_chunk;
+	__u64 from_ino;
+	__u64 ino;
+	char *path;
+};
+
+union cont_rec {
+	struct chunkfs_cont v2;
+	struct chunkfs_cont_v1 v1;
+};
+
+struct fsck_cont {
+	__u64 next_chunk;
+	__u64 next_ino;
+	__u64 prev_chunk;
+	__u64 prev_ino;
+};
 
 static char * cmd;
+static char * dev_name;
+static int force;
+static int no_change;
+static int yes;
+static int legacy;		/* Pool predates real checksums */
+static long jobs;
+static char * mark_list;	/* Chunks to mark dirty, from -M */
+static struct fsck_chunk * chunks;
+static unsigned int nr_chunks;
+static struct chunkfs_dirty_map * dirty_map;
+static pthread_mutex_t loop_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static void usage (void)
 {
-	fprintf(stderr, "Usage: %s <device>\n", cmd);
-	exit(1);
+	fprintf(stderr, "Usage: %s [-f] [-p|-n|-y] [-j <jobs>] <device>\n"
+		"       %s -M <chunk id>[,<chunk id>...] <device>\n", cmd, cmd);
+	exit(FSCK_ERROR);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void read_data(int fd, void *buf, __u64 size, __u64 offset)
+{
+	if (pread(fd, buf, size, offset) < (ssize_t) size)
+		error(FSCK_ERROR, errno, "Cannot read %llu bytes at offset %llu",
+		      (unsigned long long) size, (unsigned long long) offset);
+}
+
+/*
+ * Run a command and return its exit code, or FSCK_ERROR if it didn't
+ * exit normally.  If out is set, stdout is collected into a malloced
+ * string and stderr thrown away; otherwise both go where ours do.
+ */
+static int run_cmd(char *const argv[], char **out)
+{
+	size_t len = 0;
+	size_t size = 0;
+	char *buf = NULL;
+	int pipefd[2];
+	ssize_t n;
+	pid_t pid;
+	int status;
+
+	if (out && pipe(pipefd) < 0)
+		return FSCK_ERROR;
+
+	pid = fork();
+	if (pid < 0) {
+		if (out) {
+			close(pipefd[0]);
+			close(pipefd[1]);
+		}
+		return FSCK_ERROR;
+	}
+	if (pid == 0) {
+		if (out) {
+			int null = open("/dev/null", O_WRONLY);
+
+			dup2(pipefd[1], 1);
+			if (null >= 0)
+				dup2(null, 2);
+			close(pipefd[0]);
+		}
+		execvp(argv[0], argv);
+		_exit(FSCK_ERROR);
+	}
+
+	if (out) {
+		close(pipefd[1]);
+		do {
+			if (len + 1 >= size) {
+				size = size ? size * 2 : 4096;
+				buf = realloc(buf, size);
+				if (!buf)
+					error(FSCK_ERROR, errno, "Cannot allocate output buffer");
+			}
+			n = read(pipefd[0], buf + len, size - len - 1);
+			if (n > 0)
+				len += n;
+		} while (n > 0 || (n < 0 && errno == EINTR));
+		close(pipefd[0]);
+		buf[len] = '\0';
+		*out = buf;
+	}
+
+	while (waitpid(pid, &status, 0) < 0)
+		if (errno != EINTR)
+			return FSCK_ERROR;
+	if (!WIFEXITED(status))
+		return FSCK_ERROR;
+	return WEXITSTATUS(status);
+}
+
+static void * grow(void *array, unsigned int nr, size_t size)
+{
+	/* Double whenever nr reaches a power of two */
+	if (nr & (nr - 1))
+		return array;
+	array = realloc(array, (nr ? nr * 2 : 1) * size);
+	if (!array)
+		error(FSCK_ERROR, errno, "Out of memory");
+	return array;
+}
+
+static struct fsck_chunk * find_chunk(__u64 chunk_id)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr_chunks; i++)
+		if (chunks[i].chunk_id == chunk_id)
+			return &chunks[i];
+	return NULL;
+}
+
+static void add_chunk(struct chunkfs_chunk *chunk)
+{
+	struct fsck_chunk *fc;
+
+	chunks = grow(chunks, nr_chunks, sizeof(*chunks));
+	fc = &chunks[nr_chunks++];
+	bzero(fc, sizeof(*fc));
+	fc->chunk_id = __le64_to_cpu(chunk->c_chunk_id);
+	fc->begin = __le64_to_cpu(chunk->c_begin);
+	fc->end = __le64_to_cpu(chunk->c_end);
+	fc->innards_begin = __le64_to_cpu(chunk->c_innards_begin);
+	fc->innards_end = __le64_to_cpu(chunk->c_innards_end);
+	memcpy(fc->client_fs, chunk->c_client_fs, CHUNKFS_CLIENT_NAME_LEN);
+}
+
+static int read_chunk_summary(int fd, __u64 offset, char *buf)
+{
+	read_data(fd, buf, CHUNKFS_BLK_SIZE, offset);
+	if (check_chunk((struct chunkfs_chunk *) buf, legacy)) {
+		fprintf(stderr, "Bad chunk summary at %llu\n",
+			(unsigned long long) offset);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Same order as the kernel: the chunk table if there is a good one,
+ * otherwise follow the chain of chunk summaries.  Either way we need
+ * the summaries themselves for the client fs location.
+ */
+static int read_chunk_table(int fd, struct chunkfs_dev *dev, int *err)
+{
+	__u64 offset = __le64_to_cpu(dev->d_chunk_table);
+	__u64 len = __le64_to_cpu(dev->d_chunk_table_len);
+	char buf[CHUNKFS_BLK_SIZE];
+	struct chunkfs_ctab *ctab;
+	__u64 i;
+
+	if (!offset || len < sizeof(*ctab) ||
+	    offset > __le64_to_cpu(dev->d_end) ||
+	    len > __le64_to_cpu(dev->d_end) - offset + 1)
+		return 1;
+
+	ctab = malloc(len);
+	if (!ctab)
+		error(FSCK_ERROR, errno, "Cannot allocate chunk table");
+	read_data(fd, ctab, len, offset);
+	if (check_ctab(ctab, len, legacy)) {
+		fprintf(stderr, "Bad chunk table at %llu, following chunk chain\n",
+			(unsigned long long) offset);
+		free(ctab);
+		return 1;
+	}
+
+	for (i = 0; i < __le64_to_cpu(ctab->t_nr); i++) {
+		if (read_chunk_summary(fd,
+			__le64_to_cpu(ctab->t_entries[i].e_begin), buf)) {
+			*err = 1;
+			continue;
+		}
+		add_chunk((struct chunkfs_chunk *) buf);
+	}
+	free(ctab);
+	return 0;
+}
+
+static int read_chunk_chain(int fd, struct chunkfs_dev *dev)
+{
+	char buf[CHUNKFS_BLK_SIZE];
+	struct chunkfs_chunk *chunk = (struct chunkfs_chunk *) buf;
+	__u64 offset = __le64_to_cpu(dev->d_root_chunk);
+
+	while (offset) {
+		if (read_chunk_summary(fd, offset, buf))
+			return 1;
+		add_chunk(chunk);
+		offset = __le64_to_cpu(chunk->c_next_chunk);
+	}
+	return 0;
+}
+
+/*
+ * Mark the chunks that need checking.  No map, or one that fails its
+ * checksum, means we can't tell, so all of them do.  A good map is
+ * kept so we can clear bits in it later.
+ */
+static void read_dirty_map(int fd, struct chunkfs_dev *dev)
+{
+	__u64 offset = __le64_to_cpu(dev->d_dirty_map);
+	__u64 len = __le64_to_cpu(dev->d_dirty_map_len);
+	struct chunkfs_dirty_map *map = NULL;
+	unsigned int i;
+	int bad = 0;
+
+	if (!offset || len < sizeof(*map)) {
+		printf("No dirty chunk map, checking all chunks\n");
+		bad = 1;
+	} else {
+		map = malloc(len);
+		if (!map)
+			error(FSCK_ERROR, errno, "Cannot allocate dirty chunk map");
+		read_data(fd, map, len, offset);
+		if (check_dirty_map(map, len, legacy)) {
+			fprintf(stderr, "Bad dirty chunk map at %llu, checking all chunks\n",
+				(unsigned long long) offset);
+			bad = 1;
+		}
+	}
+
+	for (i = 0; i < nr_chunks; i++)
+		chunks[i].dirty = force || bad ||
+			chunkfs_dirty_map_test(map, chunks[i].chunk_id);
+
+	if (bad && map) {
+		/* Start over with an empty one */
+		bzero(map, len);
+		map->m_magic = __cpu_to_le32(CHUNKFS_DIRTY_MAGIC);
+		map->m_nr = __cpu_to_le64((len - sizeof(*map)) * 8);
+	}
+	dirty_map = map;
+}
+
+static int flush_dirty_map(int fd, struct chunkfs_dev *dev)
+{
+	__u64 offset = __le64_to_cpu(dev->d_dirty_map);
+	__u64 len = __le64_to_cpu(dev->d_dirty_map_len);
+
+	write_chksum(dirty_map, len);
+
+	if (pwrite(fd, dirty_map, len, offset) < (ssize_t) len ||
+	    fsync(fd) < 0) {
+		fprintf(stderr, "Cannot write dirty chunk map at offset %llu: %s\n",
+			(unsigned long long) offset, strerror(errno));
+		return FSCK_ERROR;
+	}
+	return 0;
+}
+
+/*
+ * Clear the bits of chunks that came out clean and write the map back.
+ */
+static int write_dirty_map(int fd, struct chunkfs_dev *dev)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr_chunks; i++) {
+		struct fsck_chunk *fc = &chunks[i];
+
+		if (fc->chunk_id >= __le64_to_cpu(dirty_map->m_nr))
+			continue;
+		if (fc->status & ~FSCK_CORRECTED)
+			dirty_map->m_bits[fc->chunk_id / 8] |=
+				1 << (fc->chunk_id % 8);
+		else if (fc->dirty)
+			dirty_map->m_bits[fc->chunk_id / 8] &=
+				~(1 << (fc->chunk_id % 8));
+	}
+	return flush_dirty_map(fd, dev);
+}
+
+/*
+ * Set the bits of the chunks in mark_list.  Only done to a good map,
+ * since a bad one has already lost track of what was dirty.
+ */
+static int mark_dirty(int fd, struct chunkfs_dev *dev)
+{
+	char *p = mark_list;
+	char *end;
+
+	if (!dirty_map || check_dirty_map(dirty_map,
+					  __le64_to_cpu(dev->d_dirty_map_len),
+					  legacy)) {
+		fprintf(stderr, "%s: no good dirty chunk map to mark\n", dev_name);
+		return FSCK_ERROR;
+	}
+
+	for (;;) {
+		__u64 chunk_id = strtoull(p, &end, 0);
+
+		if (end == p || (*end && *end != ','))
+			error(FSCK_ERROR, 0, "Bad chunk list %s", mark_list);
+		if (!find_chunk(chunk_id) ||
+		    chunk_id >= __le64_to_cpu(dirty_map->m_nr))
+			error(FSCK_ERROR, 0, "No chunk %llu",
+			      (unsigned long long) chunk_id);
+		dirty_map->m_bits[chunk_id / 8] |= 1 << (chunk_id % 8);
+		if (!*end)
+			break;
+		p = end + 1;
+	}
+	return flush_dirty_map(fd, dev);
+}
+
+/*
+ * A loop device over the chunk's client file system, set up the first
+ * time it is asked for.  losetup -f picks a free device racily, so
+ * only one at a time.
+ */
+static char * chunk_dev(struct fsck_chunk *fc)
+{
+	char offset[24];
+	char size[24];
+	char *argv[10];
+	char *out = NULL;
+	int i = 0;
+
+	pthread_mutex_lock(&loop_lock);
+	if (fc->loop[0])
+		goto out;
+
+	snprintf(offset, sizeof(offset), "%llu",
+		 (unsigned long long) fc->innards_begin);
+	snprintf(size, sizeof(size), "%llu",
+		 (unsigned long long) (fc->innards_end + 1 - fc->innards_begin));
+	argv[i++] = "losetup";
+	argv[i++] = "-f";
+	argv[i++] = "--show";
+	if (no_change)
+		argv[i++] = "-r";
+	argv[i++] = "-o";
+	argv[i++] = offset;
+	argv[i++] = "--sizelimit";
+	argv[i++] = size;
+	argv[i++] = dev_name;
+	argv[i] = NULL;
+
+	if (run_cmd(argv, &out) == 0 && out[0] == '/') {
+		out[strcspn(out, "\n")] = '\0';
+		snprintf(fc->loop, sizeof(fc->loop), "%s", out);
+		printf("chunk %llu: %s\n", (unsigned long long) fc->chunk_id,
+		       fc->loop);
+	} else {
+		fprintf(stderr, "chunk %llu: cannot set up loop device\n",
+			(unsigned long long) fc->chunk_id);
+	}
+	free(out);
+ out:
+	pthread_mutex_unlock(&loop_lock);
+	return fc->loop[0] ? fc->loop : NULL;
+}
+
+static void put_chunk_devs(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr_chunks; i++) {
+		char *argv[] = { "losetup", "-d", chunks[i].loop, NULL };
+
+		if (chunks[i].loop[0])
+			run_cmd(argv, NULL);
+	}
+}
+
+/*
+ * Phase 1: the client fsck.  It does its own reporting.
+ */
+static void check_client(struct fsck_chunk *fc)
+{
+	char fsck_name[CHUNKFS_CLIENT_NAME_LEN + 8];
+	char *argv[] = { fsck_name, "-f", NULL, NULL, NULL };
+	char *dev;
+
+	if (!fc->dirty)
+		return;
+
+	dev = chunk_dev(fc);
+	if (!dev) {
+		fc->status |= FSCK_ERROR;
+		return;
+	}
+	snprintf(fsck_name, sizeof(fsck_name), "fsck.%s", fc->client_fs);
+	argv[2] = no_change ? "-n" : yes ? "-y" : "-p";
+	argv[3] = dev;
+	fc->status |= run_cmd(argv, NULL);
+}
+
+static int is_number(const char *s)
+{
+	if (!*s)
+		return 0;
+	for (; *s; s++)
+		if (!isdigit((unsigned char) *s))
+			return 0;
+	return 1;
 }
 
-static void read_data(void *buf, int size, int fd, size_t offset)
+static void add_path(char ***paths, unsigned int *nr, const char *path)
 {
-	bzero(buf, size);
+	*paths = grow(*paths, *nr, sizeof(**paths));
+	(*paths)[(*nr)++] = strdup(path);
+}
+
+static void free_paths(char ***paths, unsigned int *nr)
+{
+	unsigned int i;
+
+	for (i = 0; i < *nr; i++)
+		free((*paths)[i]);
+	free(*paths);
+	*paths = NULL;
+	*nr = 0;
+}
 
-	if (lseek(fd, block, SEEK_SET) < 0)
-		error(1, errno, "Cannot seek");
+/*
+ * Mount the client fs, the first time it is asked for.  Each chunk is
+ * only handled by one worker at a time, so no locking.
+ */
+static char * chunk_mnt(struct fsck_chunk *fc)
+{
+	unsigned long flags = no_change ? MS_RDONLY : 0;
+	char *dev;
+
+	if (fc->mnt[0])
+		return fc->mnt;
+
+	dev = chunk_dev(fc);
+	if (!dev)
+		return NULL;
+	strcpy(fc->mnt, "/tmp/fsck.chunkfs.XXXXXX");
+	if (!mkdtemp(fc->mnt))
+		goto out_err;
+	/* We need the continuation xattrs, ask for them if it's ext2/3 */
+	if (mount(dev, fc->mnt, fc->client_fs, flags, "user_xattr") == 0 ||
+	    mount(dev, fc->mnt, fc->client_fs, flags, NULL) == 0)
+		return fc->mnt;
+	rmdir(fc->mnt);
+ out_err:
+	fprintf(stderr, "chunk %llu: cannot mount %s on %s: %s\n",
+		(unsigned long long) fc->chunk_id, fc->client_fs, dev,
+		strerror(errno));
+	fc->mnt[0] = '\0';
+	return NULL;
+}
+
+static void put_chunk_mnts(void)
+{
+	unsigned int i;
 
-	if (read(fd, buf, size) < size)
-		error(1, errno, "Cannot read
+	for (i = 0; i < nr_chunks; i++) {
+		if (!chunks[i].mnt[0])
+			continue;
+		if (umount(chunks[i].mnt) == 0)
+			rmdir(chunks[i].mnt);
+		else
+			fprintf(stderr, "Cannot unmount %s: %s\n",
+				chunks[i].mnt, strerror(errno));
+	}
 }
 
 /*
- * Construct a "superblock."  In chunkfs, this means a pool summary.
+ * The continuation record of a client inode, as far as fsck cares.
+ * Returns 1 if there is one, 0 if not, -1 if it is bad.  Inodes still
+ * using the old string xattrs count as having none.
  */
-static void create_pool_summary(char *dev_name, struct chunkfs_pool *pool)
-{
-	struct chunkfs_dev_desc *root_dev = &pool->p_root;
-	int hint_len = sizeof (root_dev->d_hint);
-
-	bzero(pool, sizeof(*pool));
-	pool->p_magic = __cpu_to_le32(CHUNKFS_SUPER_MAGIC);
-	/* Fill in root device description. */
-	strncpy(root_dev->d_hint, dev_name, hint_len);
-	root_dev->d_hint[hint_len - 1] = '\0';
-	pool->p_flags = 0;
-	/* XXX need userland generated uuid... ask kernel to do it on mount? */
-	root_dev->d_uuid = __cpu_to_le64(0x001d001d);
-
-	write_chksum(pool, sizeof(*pool), &pool->p_chksum);
-}
-
-static void create_dev_summary(char *dev_name, int devfd,
-			       struct chunkfs_pool *pool,
-			       struct chunkfs_dev *dev)
-{
-	struct stat stat_buf;
-	struct chunkfs_dev_desc *root_dev = &pool->p_root;
-
-	if (fstat(devfd, &stat_buf) != 0)
-		error(1, errno, "Cannot stat device %s", dev_name);
-
-	bzero(dev, sizeof(*dev));
-	dev->d_uuid = root_dev->d_uuid; /* Already endian swapped */
-	dev->d_bytes_total = __cpu_to_le64(stat_buf.st_size);
-	dev->d_magic = __cpu_to_le32(CHUNKFS_DEV_MAGIC);
-	write_chksum(dev, sizeof (dev), &dev->d_chksum);
-}
-
-static void create_chunk_summary(struct chunkfs_pool *pool,
-				 struct chunkfs_dev *dev,
-				 struct chunkfs_chunk *chunk,
-				 __u64 start, __u64 size, __u64 next_chunk)
-{
-	__u64 end = start + size - 1;
-	/* XXX use chunk->ci_blk_bits; */
-	__u64 start_blk = (start >> CHUNKFS_BLK_BITS) + 2;
-	__u64 end_blk = end >> CHUNKFS_BLK_BITS;
-	__u64 start_inode;
-	__u64 end_inode;
-
-	bzero(chunk, sizeof(*chunk));
-	chunk->c_next_chunk = __cpu_to_le64(next_chunk);
-	chunk->c_blk_size = __cpu_to_le64(CHUNKFS_BLK_SIZE);
-	chunk->c_blk_bits = __cpu_to_le64(CHUNKFS_BLK_BITS);
-	chunk->c_blk_start = __cpu_to_le64(start_blk);
-	chunk->c_blk_end = __cpu_to_le64(end_blk);
-	/* XXX subtract space used for bitmaps and chunk summary
-	 * For now assume only takes two blocks
-	 * XXX put data at one end of the chunk and metadata at other */
-	chunk->c_blks_free = __cpu_to_le64((end_blk - start_blk) - 2);
-	start_inode = blk_to_inode(start_blk);
-	chunk->c_inode_begin = __cpu_to_le64(start_inode);
-	/* Get the last inode in the last blk, not the first */
-	end_inode = blk_to_inode(end_blk + 1) - 1;
-	chunk->c_inode_end = __cpu_to_le64(end_inode);
-	chunk->c_magic = __cpu_to_le32(CHUNKFS_CHUNK_MAGIC);
-	write_chksum(chunk, sizeof (chunk), &chunk->c_chksum);
-}
-
-static void write_chunk_summaries(int fd, struct chunkfs_pool *pool,
-				   struct chunkfs_dev *dev,
-				   struct chunkfs_chunk *root_chunk)
-{
-	struct chunkfs_chunk chunk;
-	__u64 dev_size = __le64_to_cpu(dev->d_bytes_total);
-	__u64 chunk_size = CHUNKFS_CHUNK_SIZE;
-	__u64 chunk_start = CHUNKFS_CHUNK_OFFSET;;
-	__u64 next_chunk_offset;
-	unsigned int chunk_id = 0;
-	int root = 1;
-
-	while (chunk_start < dev_size) {
-		/* XXX What is chunk min size? */
-		if ((chunk_start + chunk_size) > dev_size) {
-			chunk_size = dev_size - chunk_start;
-			next_chunk_offset = 0;
-		} else {
-			next_chunk_offset = chunk_start + chunk_size;
+static int read_cont(const char *path, union cont_rec *rec, ssize_t *size,
+		     struct fsck_cont *c)
+{
+	bzero(c, sizeof(*c));
+	*size = lgetxattr(path, CHUNKFS_CONT_XATTR, rec, sizeof(*rec));
+	if (*size == sizeof(rec->v2)) {
+		if (check_cont(&rec->v2, legacy) ||
+		    __le32_to_cpu(rec->v2.cr_version) != CHUNKFS_CONT_VERSION)
+			return -1;
+		c->next_chunk = __le64_to_cpu(rec->v2.cr_next_chunk);
+		c->next_ino = __le64_to_cpu(rec->v2.cr_next_ino);
+		c->prev_chunk = __le64_to_cpu(rec->v2.cr_prev_chunk);
+		c->prev_ino = __le64_to_cpu(rec->v2.cr_prev_ino);
+		return 1;
+	}
+	if (*size == sizeof(rec->v1)) {
+		__u64 next = __le64_to_cpu(rec->v1.cr_next);
+		__u64 prev = __le64_to_cpu(rec->v1.cr_prev);
+
+		if (check_cont_v1(&rec->v1) ||
+		    __le32_to_cpu(rec->v1.cr_version) != 1)
+			return -1;
+		c->next_chunk = __UINO_TO_CHUNK_ID(CHUNKFS_LEGACY_INO_BITS, next);
+		c->next_ino = __UINO_TO_INO(CHUNKFS_LEGACY_INO_BITS, next);
+		c->prev_chunk = __UINO_TO_CHUNK_ID(CHUNKFS_LEGACY_INO_BITS, prev);
+		c->prev_ino = __UINO_TO_INO(CHUNKFS_LEGACY_INO_BITS, prev);
+		return 1;
+	}
+	return 0;
+}
+
+/* Make the inode at path the end of its file */
+static int clear_next(const char *path)
+{
+	union cont_rec rec;
+	struct fsck_cont c;
+	ssize_t size;
+
+	if (read_cont(path, &rec, &size, &c) != 1)
+		return -1;
+	if (size == sizeof(rec.v2)) {
+		rec.v2.cr_next_chunk = 0;
+		rec.v2.cr_next_ino = 0;
+	} else {
+		rec.v1.cr_next = 0;
+	}
+	write_chksum(&rec, size);
+	return lsetxattr(path, CHUNKFS_CONT_XATTR, &rec, size, XATTR_REPLACE);
+}
+
+static int cmp_src(const void *a, const void *b)
+{
+	const struct cont_src *x = a;
+	const struct cont_src *y = b;
+
+	return (x->ino > y->ino) - (x->ino < y->ino);
+}
+
+static int cmp_dst(const void *a, const void *b)
+{
+	const struct cont_dst *x = a;
+	const struct cont_dst *y = b;
+
+	if (x->from_chunk != y->from_chunk)
+		return (x->from_chunk > y->from_chunk) ? 1 : -1;
+	return (x->from_ino > y->from_ino) - (x->from_ino < y->from_ino);
+}
+
+static struct cont_src * find_src(struct fsck_chunk *fc, __u64 ino)
+{
+	struct cont_src key = { .ino = ino };
+
+	return bsearch(&key, fc->srcs, fc->nr_srcs, sizeof(key), cmp_src);
+}
+
+static struct cont_dst * find_dst(struct fsck_chunk *fc, __u64 from_chunk,
+				  __u64 from_ino)
+{
+	struct cont_dst key = { .from_chunk = from_chunk, .from_ino = from_ino };
+
+	return bsearch(&key, fc->dsts, fc->nr_dsts, sizeof(key), cmp_dst);
+}
+
+static void reset_conts(struct fsck_chunk *fc)
+{
+	unsigned int i;
+
+	for (i = 0; i < fc->nr_srcs; i++)
+		free(fc->srcs[i].path);
+	for (i = 0; i < fc->nr_dsts; i++)
+		free(fc->dsts[i].path);
+	free(fc->srcs);
+	free(fc->dsts);
+	free(fc->from);
+	fc->srcs = NULL;
+	fc->dsts = NULL;
+	fc->from = NULL;
+	fc->nr_srcs = 0;
+	fc->nr_dsts = 0;
+	fc->nr_from = 0;
+	fc->full_walk = 0;
+}
+
+/*
+ * Phase 2a: which chunks have continuation directories in this one.
+ */
+static void scan_top(struct fsck_chunk *fc)
+{
+	struct dirent *d;
+	DIR *dir;
+
+	reset_conts(fc);
+	/* Client fsck gave up, nothing in it can be trusted */
+	if (fc->status & ~FSCK_CORRECTED) {
+		fc->broken = 1;
+		return;
+	}
+	if (fc->broken)
+		return;
+	if (!chunk_mnt(fc) || !(dir = opendir(fc->mnt))) {
+		fc->status |= FSCK_ERROR;
+		fc->broken = 1;
+		return;
+	}
+	while ((d = readdir(dir)) != NULL) {
+		if ((d->d_type != DT_DIR && d->d_type != DT_UNKNOWN) ||
+		    !is_number(d->d_name))
+			continue;
+		fc->from = grow(fc->from, fc->nr_from, sizeof(*fc->from));
+		fc->from[fc->nr_from++] = strtoull(d->d_name, NULL, 10);
+	}
+	closedir(dir);
+}
+
+/*
+ * Continuations out of a dirty chunk can be anywhere, and the chunks
+ * they come from need every inode read to know which ones exist.
+ * Clean chunks only need their directories of continuations out of
+ * dirty chunks read.
+ *
+ * XXX A dirty chunk that lost its whole directory for a clean one
+ * hides dangling pointers in the clean one.  -f finds those.
+ */
+static void plan_walks(void)
+{
+	unsigned int i;
+	unsigned int j;
+
+	for (i = 0; i < nr_chunks; i++) {
+		struct fsck_chunk *fc = &chunks[i];
+
+		if (fc->broken || !fc->dirty)
+			continue;
+		fc->full_walk = 1;
+		for (j = 0; j < fc->nr_from; j++) {
+			struct fsck_chunk *from = find_chunk(fc->from[j]);
+
+			if (from)
+				from->full_walk = 1;
 		}
-		create_chunk_summary(pool, dev, &chunk, chunk_start,
-				     chunk_size, next_chunk_offset);
-		if (root) {
-			/* Make root the first inode */
-			chunk.c_root_inode = chunk.c_inode_begin;
-			*root_chunk = chunk;
-			root = 0;
+	}
+}
+
+/* nftw() doesn't pass an argument through, so each worker sets this */
+static __thread struct fsck_chunk * walk_chunk;
+
+static int walk_inode(const char *path, const struct stat *st, int type,
+		      struct FTW *ftw)
+{
+	struct fsck_chunk *fc = walk_chunk;
+	const char *rel = path + strlen(fc->mnt);
+	unsigned long long from_chunk;
+	unsigned long long from_ino;
+	union cont_rec rec;
+	struct fsck_cont c;
+	ssize_t size;
+	int has_rec;
+	int n = 0;
+
+	if (type != FTW_F || !S_ISREG(st->st_mode))
+		return 0;
+
+	has_rec = read_cont(path, &rec, &size, &c);
+	if (has_rec < 0) {
+		printf("chunk %llu: bad continuation record on %s\n",
+		       (unsigned long long) fc->chunk_id, rel);
+		fc->status |= FSCK_UNCORRECTED;
+		has_rec = 0;
+	}
+
+	if (fc->full_walk) {
+		struct cont_src *s;
+
+		fc->srcs = grow(fc->srcs, fc->nr_srcs, sizeof(*fc->srcs));
+		s = &fc->srcs[fc->nr_srcs++];
+		s->ino = st->st_ino;
+		s->has_rec = has_rec;
+		s->next_chunk = c.next_chunk;
+		s->next_ino = c.next_ino;
+		s->path = c.next_ino ? strdup(path) : NULL;
+	}
+
+	/*
+	 * A continuation is <from chunk>/<from ino> and says so in its
+	 * own record, which keeps user files with numeric names out.
+	 */
+	if (has_rec && c.prev_ino &&
+	    sscanf(rel, "/%llu/%llu%n", &from_chunk, &from_ino, &n) == 2 &&
+	    rel[n] == '\0' &&
+	    c.prev_chunk == from_chunk && c.prev_ino == from_ino) {
+		struct cont_dst *d;
+
+		fc->dsts = grow(fc->dsts, fc->nr_dsts, sizeof(*fc->dsts));
+		d = &fc->dsts[fc->nr_dsts++];
+		d->from_chunk = from_chunk;
+		d->from_ino = from_ino;
+		d->ino = st->st_ino;
+		d->path = strdup(path);
+	}
+	return 0;
+}
+
+/*
+ * Phase 2b: read the inodes and continuation records of this chunk
+ * in one pass.
+ */
+static void walk_conts(struct fsck_chunk *fc)
+{
+	char path[64];
+	unsigned int i;
+
+	if (fc->broken)
+		return;
+
+	walk_chunk = fc;
+	if (fc->full_walk) {
+		if (nftw(fc->mnt, walk_inode, 16, FTW_PHYS | FTW_MOUNT))
+			fc->status |= FSCK_ERROR;
+	} else {
+		for (i = 0; i < fc->nr_from; i++) {
+			struct fsck_chunk *from = find_chunk(fc->from[i]);
+
+			if (!from || !from->dirty)
+				continue;
+			snprintf(path, sizeof(path), "%s/%llu", fc->mnt,
+				 (unsigned long long) fc->from[i]);
+			if (nftw(path, walk_inode, 16, FTW_PHYS | FTW_MOUNT))
+				fc->status |= FSCK_ERROR;
 		}
+	}
+	walk_chunk = NULL;
+
+	qsort(fc->srcs, fc->nr_srcs, sizeof(*fc->srcs), cmp_src);
+	qsort(fc->dsts, fc->nr_dsts, sizeof(*fc->dsts), cmp_dst);
+}
+
+/*
+ * Phase 2c: match this chunk's continuations against the inodes they
+ * came from, and its next pointers against the continuations they
+ * point to.  Only the sets built in 2b are read, so every chunk can
+ * do this at once.
+ *
+ * An orphan is a continuation whose <from ino> is gone, or no longer
+ * points to it.  A dangling pointer points to a continuation that
+ * isn't there.
+ */
+static void match_conts(struct fsck_chunk *fc)
+{
+	unsigned int i;
+
+	if (fc->broken)
+		return;
+
+	for (i = 0; i < fc->nr_dsts; i++) {
+		struct cont_dst *d = &fc->dsts[i];
+		struct fsck_chunk *from = find_chunk(d->from_chunk);
+		struct cont_src *s;
+
+		if (!fc->dirty && !(from && from->dirty))
+			continue;
+		if (from && from->broken)
+			continue;
+		s = from ? find_src(from, d->from_ino) : NULL;
+		if (s && (!s->has_rec || (s->next_chunk == fc->chunk_id &&
+					  s->next_ino == d->ino)))
+			continue;
+		printf("chunk %llu: orphan continuation %s\n",
+		       (unsigned long long) fc->chunk_id,
+		       d->path + strlen(fc->mnt));
+		add_path(&fc->orphans, &fc->nr_orphans, d->path);
+		fc->found_orphans++;
+	}
 
-		printf("Writing chunk %d (bytes %llu-%llu, blocks %llu-%llu, "
-		       "inodes %llu-%llu)\n", chunk.c_id, chunk.c_start,
-		       chunk_end, start_blk, end_blk,start_inode, end_inode);
+	for (i = 0; i < fc->nr_srcs; i++) {
+		struct cont_src *s = &fc->srcs[i];
+		struct fsck_chunk *to = find_chunk(s->next_chunk);
+		struct cont_dst *d;
 
-		write_block(chunk, sizeof(*chunk), fd, chunk_start);
-		chunk_start += chunk_size;
-		*chunk_id++;
+		if (!s->has_rec || !s->next_ino)
+			continue;
+		if (!fc->dirty && !(to && to->dirty))
+			continue;
+		if (to && to->broken)
+			continue;
+		d = to ? find_dst(to, fc->chunk_id, s->ino) : NULL;
+		if (d && d->ino == s->next_ino)
+			continue;
+		printf("chunk %llu: %s points to missing continuation %llu/%llu\n",
+		       (unsigned long long) fc->chunk_id,
+		       s->path + strlen(fc->mnt),
+		       (unsigned long long) s->next_chunk,
+		       (unsigned long long) s->next_ino);
+		add_path(&fc->dangling, &fc->nr_dangling, s->path);
+		fc->found_dangling++;
 	}
 }
 
-static void write_root(int fd, struct chunkfs_pool *pool,
-		       struct chunkfs_dev *dev,
-		       struct chunkfs_chunk *root_chunk,
-		       struct chunkfs_inode *root_inode)
+/*
+ * Phase 2d: remove orphans and cut dangling pointers.  Each worker
+ * only writes to its own chunk.
+ */
+static void repair_conts(struct fsck_chunk *fc)
 {
-	/* XXX This is zero presently. */
-	c_inode_num_t inode_num = __le64_to_cpu(root_chunk->c_root_inode);
-	c_byte_t root_offset = inode_num;
+	unsigned int i;
 
-	printf("root inode number %llu, offset %llu\n", inode_num, root_offset);
-	root_inode->i_self = __cpu_to_le64(inode_num);
-	/* uid, gid, size, etc. all 0 */
-	root_inode->i_nlink = __cpu_to_le32(2);
-	root_inode->i_atime.t_sec =
-		root_inode->i_mtime.t_sec =
-		root_inode->i_ctime.t_sec = __cpu_to_le32(time(NULL));
-	root_inode->i_mode = __cpu_to_le16(S_IFDIR | 0755); /* XXX */
-	root_inode->i_type = __cpu_to_le16(CHUNKFS_PUBLIC_INODE);
-	root_inode->i_magic  = __cpu_to_le32(CHUNKFS_INODE_MAGIC);
-	write_chksum(root_inode, sizeof(*root_inode), &root_inode->i_chksum);
+	if (!fc->nr_orphans && !fc->nr_dangling)
+		return;
 
-	write_block(root_inode, sizeof(*root_inode), fd, root_offset);
+	for (i = 0; i < fc->nr_orphans; i++) {
+		if (!no_change && unlink(fc->orphans[i]) == 0)
+			fc->status |= FSCK_CORRECTED;
+		else
+			fc->status |= FSCK_UNCORRECTED;
+	}
+	for (i = 0; i < fc->nr_dangling; i++) {
+		if (!no_change && clear_next(fc->dangling[i]) == 0)
+			fc->status |= FSCK_CORRECTED;
+		else
+			fc->status |= FSCK_UNCORRECTED;
+	}
+
+	free_paths(&fc->orphans, &fc->nr_orphans);
+	free_paths(&fc->dangling, &fc->nr_dangling);
+}
+
+static void * phase_worker(void *arg)
+{
+	struct fsck_phase *phase = arg;
+	struct fsck_chunk *fc;
+	double start;
+
+	for (;;) {
+		pthread_mutex_lock(&phase->lock);
+		fc = phase->next < nr_chunks ? &chunks[phase->next++] : NULL;
+		pthread_mutex_unlock(&phase->lock);
+		if (!fc)
+			break;
+		start = now();
+		phase->check(fc);
+		fc->time[phase->phase] += now() - start;
+	}
+	return NULL;
+}
+
+static void run_phase(const char *name, int nr, void (*check)(struct fsck_chunk *))
+{
+	struct fsck_phase phase = {
+		.phase = nr,
+		.check = check,
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.next = 0,
+	};
+	pthread_t *threads;
+	long nr_threads = jobs < (long) nr_chunks ? jobs : (long) nr_chunks;
+	double start = now();
+	long i;
+
+	threads = calloc(nr_threads, sizeof(*threads));
+	if (!threads)
+		error(FSCK_ERROR, errno, "Cannot allocate threads");
+	for (i = 0; i < nr_threads; i++)
+		if (pthread_create(&threads[i], NULL, phase_worker, &phase))
+			break;
+	if (i == 0)
+		error(FSCK_ERROR, 0, "Cannot start %s workers", name);
+	nr_threads = i;
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+	printf("%s: %.2fs with %ld workers\n", name, now() - start,
+	       nr_threads);
+}
+
+static int nr_cross_errors(void)
+{
+	unsigned int i;
+	int nr = 0;
+
+	for (i = 0; i < nr_chunks; i++)
+		nr += chunks[i].nr_orphans + chunks[i].nr_dangling;
+	return nr;
+}
+
+static void report(void)
+{
+	unsigned int i;
+
+	printf("%8s %-8s %-6s %9s %9s %7s %8s %6s\n", "chunk", "fs", "state",
+	       "client(s)", "cross(s)", "orphans", "dangling", "status");
+	for (i = 0; i < nr_chunks; i++) {
+		struct fsck_chunk *fc = &chunks[i];
+
+		printf("%8llu %-8s %-6s %9.2f %9.2f %7u %8u %6d\n",
+		       (unsigned long long) fc->chunk_id, fc->client_fs,
+		       fc->dirty ? "dirty" : "clean",
+		       fc->time[PHASE_CLIENT], fc->time[PHASE_CROSS],
+		       fc->found_orphans, fc->found_dangling, fc->status);
+	}
 }
 
 int main (int argc, char * argv[])
 {
 	int fd;
-	char * dev_name;
-	struct chunkfs_pool pool = { 0 };
-	struct chunkfs_dev root_dev = { 0 };
-	struct chunkfs_chunk root_chunk = { 0 };
-	struct chunkfs_inode root_inode = { 0 };
+	char pool_buf[CHUNKFS_BLK_SIZE];
+	char dev_buf[CHUNKFS_BLK_SIZE];
+	struct chunkfs_pool *pool = (struct chunkfs_pool *) pool_buf;
+	struct chunkfs_dev *dev = (struct chunkfs_dev *) dev_buf;
+	unsigned int nr_dirty = 0;
+	unsigned int i;
+	double start = now();
+	int status = 0;
+	int err = 0;
+	int pass;
+	int opt;
 
 	cmd = argv[0];
+	/* Keep our output in order with the checkers' */
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	jobs = sysconf(_SC_NPROCESSORS_ONLN);
+
+	while ((opt = getopt(argc, argv, "fapnyj:M:")) != -1) {
+		switch (opt) {
+		case 'f':
+			force = 1;
+			break;
+		case 'a':
+		case 'p':
+			/* Preening is the default */
+			break;
+		case 'n':
+			no_change = 1;
+			break;
+		case 'y':
+			yes = 1;
+			break;
+		case 'j':
+			jobs = strtol(optarg, NULL, 0);
+			if (jobs < 1)
+				error(FSCK_ERROR, 0, "jobs must be at least 1");
+			break;
+		case 'M':
+			mark_list = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
 
-	if (argc != 2)
+	if (argc - optind != 1 || (no_change && yes) ||
+	    (mark_list && (force || no_change || yes)))
 		usage();
+	if (jobs < 1)
+		jobs = 1;
 
-	dev_name = argv[1];
+	dev_name = argv[optind];
 
-	if ((fd = open(dev_name, O_RDWR)) < 0)
-		error(1, errno, "Cannot open device %s", dev_name);
-	/* XXX combine create and write_block */
-	/* The chunkfs equivalent of a superblock is the pool summary. */
+	/* O_EXCL on a block device fails if it is mounted */
+	if ((fd = open(dev_name, no_change ? O_RDONLY : O_RDWR | O_EXCL)) < 0)
+		error(FSCK_ERROR, errno, "Cannot open device %s", dev_name);
 
-	create_pool_summary(dev_name, &pool);
-	write_block(&pool, sizeof(pool), fd, CHUNKFS_POOL_OFFSET);
+	read_data(fd, pool_buf, sizeof(pool_buf), CHUNKFS_POOL_OFFSET);
+	legacy = chunkfs_legacy_chksum(pool);
+	if (check_metadata(pool, sizeof(*pool), CHUNKFS_SUPER_MAGIC, legacy))
+		error(FSCK_ERROR, 0, "%s: bad pool summary", dev_name);
 
-	/* We need one device summary per device. */
+	read_data(fd, dev_buf, sizeof(dev_buf), CHUNKFS_DEV_OFFSET);
+	if (check_dev(dev, legacy))
+		error(FSCK_ERROR, 0, "%s: bad device summary", dev_name);
 
-	create_dev_summary(dev_name, fd, &pool, &root_dev);
-	write_block(&root_dev, sizeof(root_dev), fd, CHUNKFS_DEV_OFFSET);
+	if (read_chunk_table(fd, dev, &err))
+		err |= read_chunk_chain(fd, dev);
+	if (!nr_chunks)
+		error(FSCK_ERROR, 0, "%s: no chunks found", dev_name);
+	if (err)
+		status |= FSCK_UNCORRECTED;
 
-	/* Now we get to the meaty bit: chunk summaries. */
+	read_dirty_map(fd, dev);
+	if (mark_list) {
+		status = mark_dirty(fd, dev);
+		goto out;
+	}
+	for (i = 0; i < nr_chunks; i++)
+		nr_dirty += chunks[i].dirty;
+	printf("%s: %u of %u chunks dirty\n", dev_name, nr_dirty, nr_chunks);
+	if (!nr_dirty)
+		goto out;
 
-	write_chunk_summaries(fd, &pool, &root_dev, &root_chunk);
+	run_phase("client fsck", PHASE_CLIENT, check_client);
 
-	/* Write root inode */
+	/* Removing an orphan can orphan the next continuation along */
+	for (pass = 0; pass < MAX_CROSS_PASSES; pass++) {
+		run_phase("continuation dirs", PHASE_CROSS, scan_top);
+		plan_walks();
+		run_phase("continuation scan", PHASE_CROSS, walk_conts);
+		run_phase("continuation match", PHASE_CROSS, match_conts);
+		if (!nr_cross_errors())
+			break;
+		run_phase("continuation repair", PHASE_CROSS, repair_conts);
+		if (no_change)
+			break;
+	}
 
-	write_root(fd, &pool, &root_dev, &root_chunk, &root_inode);
+	for (i = 0; i < nr_chunks; i++)
+		reset_conts(&chunks[i]);
+	put_chunk_mnts();
+	put_chunk_devs();
+	report();
 
+	for (i = 0; i < nr_chunks; i++)
+		status |= chunks[i].status;
+	if (!no_change && dirty_map)
+		status |= write_dirty_map(fd, dev);
+ out:
+	printf("%s: done in %.2fs\n", dev_name, now() - start);
 	close(fd);
-
-	return 0;
+	free(dirty_map);
+	free(chunks);
+	return status;
 }
@@ -20,27 +20,54 @@ __copy_inode(struct inode *dst, struct inode *src)
 	fsstack_copy_attr_all(dst, src);
 }
 
-void
-chunkfs_copy_up_inode(struct inode *inode, struct inode *client_inode)
+/*
+ * Work out the size of a regular file from its continuations.  The
+ * file ends where the last continuation with any data in it ends, so
+ * holes and continuations emptied by truncate don't throw it off.
+ * Only done when the inode is read in; after that i_size is ours.
+ * Fails if a continuation can't be read, e.g. its chunk won't attach.
+ */
+
+static int
+read_inode_size(struct inode *inode)
 {
+	struct chunkfs_chunk_info *chunk = NULL;
 	struct inode *prev_inode = NULL;
 	struct inode *next_inode;
 	loff_t total_size = 0;
-
-	__copy_inode(inode, client_inode);
+	loff_t start;
+	int err;
 
 	while (1) {
-		if (chunkfs_get_next_inode(inode, prev_inode, &next_inode))
-			break;
+		err = chunkfs_get_next_inode(inode, prev_inode, &next_inode,
+					     &chunk, &start);
+		if (err)
+			return err;
 		if (next_inode == NULL)
 			break;
-		/* XXX doesn't do holey files right */
-		chunkfs_debug("adding %llu\n", next_inode->i_size);
-		total_size += next_inode->i_size;
+		if (i_size_read(next_inode))
+			total_size = start + i_size_read(next_inode);
 		prev_inode = next_inode;
 	}
-	inode->i_size = total_size;
+	i_size_write(inode, total_size);
 	chunkfs_debug("ino %lu size %llu\n", inode->i_ino, inode->i_size);
+	return 0;
+}
+
+/*
+ * Regular files have their own page cache, so once the inode is set
+ * up the chunkfs i_size is the real one and the clients catch up at
+ * writeback.  Nothing else ever grows past its head, so the head's
+ * size is the whole story.
+ */
+
+void
+chunkfs_copy_up_inode(struct inode *inode, struct inode *client_inode)
+{
+	__copy_inode(inode, client_inode);
+
+	if (!S_ISREG(inode->i_mode))
+		fsstack_copy_inode_size(inode, client_inode);
 
 	mark_inode_dirty(inode);
 }
@@ -70,6 +97,10 @@ set_inode_ops(struct inode *inode, struct inode *client_inode)
 	else if (S_ISREG(client_inode->i_mode))
 		inode->i_fop = &chunkfs_file_fops;
 
+	/* Regular files keep their data in our own page cache */
+	if (S_ISREG(client_inode->i_mode))
+		inode->i_mapping->a_ops = &chunkfs_aops;
+
 	/* properly initialize special inodes */
 	if (S_ISBLK(client_inode->i_mode) || S_ISCHR(client_inode->i_mode) ||
 	    S_ISFIFO(client_inode->i_mode) || S_ISSOCK(client_inode->i_mode))
@@ -95,26 +126,36 @@ chunkfs_new_inode(struct super_block *sb, struct inode **inodep)
 
 /*
  * We've just read in a client inode.  Fill in the chunkfs inode.
- * Wait to fill in the continuation until the file is opened.
+ * Wait to fill in the continuation until the file is opened.  Fails
+ * if a regular file's size can't be read; the caller still has to
+ * iput() the inode.
  */
 
-void
+int
 chunkfs_start_inode(struct inode *inode, struct inode *client_inode,
 		    u64 chunk_id)
 {
 	struct chunkfs_inode_info *ii = CHUNKFS_I(inode);
+	int err = 0;
 
 	BUG_ON(!client_inode);
 
 	ii->ii_client_inode = client_inode;
-	inode->i_ino = MAKE_UINO(chunk_id, client_inode->i_ino);
-	/* XXX i_mapping? */
+	/* The client inode came from this chunk, so it is attached */
+	ii->ii_chunk = chunkfs_find_chunk(CHUNKFS_PI(inode->i_sb), chunk_id);
+	chunkfs_hold_chunk(ii->ii_chunk);
+	/* XXX should refuse client inodes that don't fit */
+	WARN_ON(client_inode->i_ino >= (1ULL << CHUNKFS_PI(inode->i_sb)->pi_ino_bits));
+	inode->i_ino = MAKE_UINO(inode->i_sb, chunk_id, client_inode->i_ino);
 	/* XXX check inode checksum, etc. */
 	set_inode_ops(inode, client_inode);
 	chunkfs_copy_up_inode(inode, client_inode);
+	if (S_ISREG(inode->i_mode))
+		err = read_inode_size(inode);
 
-	chunkfs_debug(" inode %p ino %0lx mode %0x client %p\n",
-		inode, inode->i_ino, inode->i_mode, ii->ii_client_inode);
+	chunkfs_debug(" inode %p ino %0lx mode %0x client %p err %d\n",
+		inode, inode->i_ino, inode->i_mode, ii->ii_client_inode, err);
+	return err;
 }
 
 /*
@@ -130,39 +171,53 @@ struct inode *chunkfs_iget(struct super_block *sb, unsigned long ino)
 	struct inode *inode;
 	u64 chunk_id;
 	unsigned long client_ino;
+	int err;
 
 	inode = iget_locked(sb, ino);
 	if (!inode)
 		return ERR_PTR(-ENOMEM);
 	if (!(inode->i_state & I_NEW))
-		return 0;
+		return inode;
 
-	chunk_id = UINO_TO_CHUNK_ID(inode->i_ino);
-	client_ino = UINO_TO_INO(inode->i_ino);
+	chunk_id = UINO_TO_CHUNK_ID(sb, inode->i_ino);
+	client_ino = UINO_TO_INO(sb, inode->i_ino);
 
 	chunkfs_debug("reading ino %0lx client ino %0lx chunk_id %0llx count %d\n",
 		inode->i_ino, client_ino, chunk_id, atomic_read(&inode->i_count));
 
-	/* XXX should be chunkfs_get_sb */
-	ci = chunkfs_find_chunk(sb->s_fs_info, chunk_id);
-	BUG_ON(ci == NULL); /* XXX */
+	/* Attaching can fail with lazy: client mount error, ENOMEM... */
+	ci = chunkfs_get_chunk(sb->s_fs_info, chunk_id);
+	if (!ci) {
+		err = -EIO;
+		goto out_failed;
+	}
 
 	client_sb = ci->ci_sb;
 	client_inode = iget_locked(client_sb, client_ino);
-	if (!(client_inode->i_state & I_NEW))
-		return 0;
-
+	if (!client_inode) {
+		err = -ENOMEM;
+		goto out_put;
+	}
+	if (client_inode->i_state & I_NEW)
+		unlock_inode(client_inode);
 	if (is_bad_inode(client_inode)) {
-		/* XXX should do something here */
-		BUG();
-		return 0;
+		iput(client_inode);
+		err = -EIO;
+		goto out_put;
 	}
-	chunkfs_start_inode(inode, client_inode, chunk_id);
+	/* The chunkfs inode owns client_inode from here on */
+	err = chunkfs_start_inode(inode, client_inode, chunk_id);
+	chunkfs_put_chunk(ci);
+	if (err)
+		goto out_failed;
 
 	unlock_inode(inode);
-	unlock_inode(client_inode);
-
-	return 0;
+	return inode;
+ out_put:
+	chunkfs_put_chunk(ci);
+ out_failed:
+	iget_failed(inode);
+	return ERR_PTR(err);
 }
 
 int chunkfs_write_inode(struct inode *inode, struct writeback_control *wbc)
@@ -10,6 +10,8 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdlib.h>
+#include <sys/stat.h>
 
 #include <linux/byteorder/little_endian.h>
 
@@ -29,10 +31,13 @@ static char canary_buf2[CHUNKFS_BLK_SIZE -
 			sizeof(struct chunkfs_dev)] __attribute__((unused));
 
 static char * cmd;
+static unsigned int chunk_bits = CHUNKFS_DEFAULT_CHUNK_BITS;
+static char * client_fs = "ext2";
 
 static void usage (void)
 {
-	fprintf(stderr, "Usage: %s <device>\n", cmd);
+	fprintf(stderr, "Usage: %s [-c <chunk id bits>] [-t <client fs type>] <device>\n",
+		cmd);
 	exit(1);
 }
 
@@ -65,27 +70,66 @@ static void create_pool_summary(char *dev_name, struct chunkfs_pool *pool)
 {
 	struct chunkfs_dev_desc *dev_desc = &pool->p_root_desc;
 
+	bzero(pool, sizeof(*pool));
 	/* Fill in device description. */
-	strcpy(dev_desc->d_hint, dev_name);
+	strncpy(dev_desc->d_hint, dev_name, sizeof(dev_desc->d_hint) - 1);
 	/* XXX need userland generated uuid  */
 	dev_desc->d_uuid = __cpu_to_le64(0x001d001d);
 
-	bzero(pool, sizeof(*pool));
+	pool->p_chunk_bits = __cpu_to_le32(chunk_bits);
+	pool->p_flags = __cpu_to_le64(CHUNKFS_POOL_CRC32C);
 	pool->p_magic = __cpu_to_le32(CHUNKFS_SUPER_MAGIC);
 }
 
+/*
+ * We don't know how many chunks fit until we know where the chunk
+ * table and dirty map end, so size them for the most there could be.
+ */
+static __u64 max_chunks(__u64 dev_size)
+{
+	__u64 nr = dev_size / CHUNKFS_CHUNK_SIZE;
+
+	if (nr > (1ULL << chunk_bits) - 1)
+		nr = (1ULL << chunk_bits) - 1;
+	return nr;
+}
+
+static __u64 round_blk(__u64 len)
+{
+	return (len + CHUNKFS_BLK_SIZE - 1) & ~((__u64) CHUNKFS_BLK_SIZE - 1);
+}
+
+static __u64 chunk_table_len(__u64 dev_size)
+{
+	return round_blk(chunkfs_ctab_bytes(max_chunks(dev_size)));
+}
+
+/* Chunk ids start at 1, so one extra bit */
+static __u64 dirty_map_len(__u64 dev_size)
+{
+	return round_blk(chunkfs_dirty_map_bytes(max_chunks(dev_size) + 1));
+}
+
 static void create_dev_summary(struct chunkfs_pool *pool,
 			       struct chunkfs_dev *dev,
 			       __u64 dev_begin,
 			       __u64 dev_size)
 {
 	struct chunkfs_dev_desc *dev_desc = &pool->p_root_desc;
+	__u64 table_begin = dev_begin + CHUNKFS_BLK_SIZE;
+	__u64 table_len = chunk_table_len(dev_size);
+	__u64 map_begin = table_begin + table_len;
+	__u64 map_len = dirty_map_len(dev_size);
 
 	bzero(dev, sizeof(*dev));
 	dev->d_uuid = dev_desc->d_uuid; /* Already swapped */
 	dev->d_begin = __cpu_to_le64(dev_begin);
 	dev->d_end = __cpu_to_le64(dev_begin + dev_size - 1); /* Starting counting from zero */
-	dev->d_innards_begin = __cpu_to_le64(dev_begin + CHUNKFS_BLK_SIZE);
+	dev->d_chunk_table = __cpu_to_le64(table_begin);
+	dev->d_chunk_table_len = __cpu_to_le64(table_len);
+	dev->d_dirty_map = __cpu_to_le64(map_begin);
+	dev->d_dirty_map_len = __cpu_to_le64(map_len);
+	dev->d_innards_begin = __cpu_to_le64(map_begin + map_len);
 	dev->d_innards_end = dev->d_end; /* Already swapped */
 	dev->d_root_chunk = dev->d_innards_begin; /* Already swapped */
 	dev->d_magic = __cpu_to_le32(CHUNKFS_DEV_MAGIC);
@@ -101,9 +145,66 @@ static void create_chunk_summary(struct chunkfs_chunk *chunk,
 	chunk->c_innards_begin = __cpu_to_le64(chunk_start + CHUNKFS_BLK_SIZE);
 	chunk->c_innards_end = chunk->c_end; /* Already swapped */
 	chunk->c_chunk_id = __cpu_to_le64(chunk_id);
+	/* Checked to fit with its terminator, the rest is zeroed above */
+	memcpy(chunk->c_client_fs, client_fs, strlen(client_fs));
 	chunk->c_magic = __cpu_to_le32(CHUNKFS_CHUNK_MAGIC);
 }
 
+static void add_table_entry(struct chunkfs_ctab *ctab,
+			    struct chunkfs_chunk *chunk)
+{
+	__u64 nr = __le64_to_cpu(ctab->t_nr);
+	struct chunkfs_ctab_entry *entry = &ctab->t_entries[nr];
+
+	entry->e_chunk_id = chunk->c_chunk_id; /* Already swapped */
+	entry->e_begin = chunk->c_begin;
+	entry->e_end = chunk->c_end;
+	entry->e_flags = chunk->c_flags;
+	memcpy(entry->e_client_fs, chunk->c_client_fs,
+	       sizeof(entry->e_client_fs));
+	ctab->t_nr = __cpu_to_le64(nr + 1);
+}
+
+static void write_chunk_table(struct chunkfs_ctab *ctab, __u64 len, int fd,
+			      __u64 offset)
+{
+	ctab->t_magic = __cpu_to_le32(CHUNKFS_CTAB_MAGIC);
+	ctab->t_entry_size = __cpu_to_le32(sizeof(struct chunkfs_ctab_entry));
+	write_chksum(ctab, len);
+
+	printf("Writing chunk table of %llu chunks to offset %llu\n",
+	       __le64_to_cpu(ctab->t_nr), offset);
+
+	if (pwrite(fd, ctab, len, offset) < (ssize_t) len)
+		error(1, errno, "Cannot write chunk table at offset %llu",
+		      (unsigned long long) offset);
+}
+
+/*
+ * A new file system has no dirty chunks.
+ */
+static void write_dirty_map(struct chunkfs_dev *dev, int fd)
+{
+	__u64 len = __le64_to_cpu(dev->d_dirty_map_len);
+	__u64 offset = __le64_to_cpu(dev->d_dirty_map);
+	struct chunkfs_dirty_map *map;
+
+	map = calloc(1, len);
+	if (!map)
+		error(1, errno, "Cannot allocate dirty chunk map");
+	map->m_magic = __cpu_to_le32(CHUNKFS_DIRTY_MAGIC);
+	map->m_nr = __cpu_to_le64((len - sizeof(*map)) * 8);
+	write_chksum(map, len);
+
+	printf("Writing dirty chunk map for %llu chunks to offset %llu\n",
+	       __le64_to_cpu(map->m_nr), offset);
+
+	if (pwrite(fd, map, len, offset) < (ssize_t) len)
+		error(1, errno, "Cannot write dirty chunk map at offset %llu",
+		      (unsigned long long) offset);
+	free(map);
+}
+
 static void write_chunk_summaries(struct chunkfs_dev *dev,
 				  struct chunkfs_chunk *chunk,
 				  int fd)
@@ -112,8 +213,19 @@ static void write_chunk_summaries(struct chunkfs_dev *dev,
 	__u64 chunk_start = __le64_to_cpu(dev->d_root_chunk);
 	__u64 chunk_size = CHUNKFS_CHUNK_SIZE;
 	__u64 dev_end = __le64_to_cpu(dev->d_end);
+	__u64 table_len = __le64_to_cpu(dev->d_chunk_table_len);
+	struct chunkfs_ctab *ctab;
+
+	ctab = calloc(1, table_len);
+	if (!ctab)
+		error(1, errno, "Cannot allocate chunk table");
 
 	while ((chunk_start + chunk_size - 1) < dev_end) {
+		if (chunk_id >= (1ULL << chunk_bits)) {
+			fprintf(stderr, "Out of %u bit chunk ids, ignoring rest of device\n",
+				chunk_bits);
+			break;
+		}
 		/* XXX Throwing away disk if not multiple of chunk size */
 		create_chunk_summary(chunk, chunk_start, chunk_size,
 				     chunk_id);
@@ -131,9 +243,14 @@ static void write_chunk_summaries(struct chunkfs_dev *dev,
 		printf("clientfs: start %llu\n", __le64_to_cpu(chunk->c_innards_begin));
 
 		write_block(chunk, sizeof(*chunk), fd, chunk_start);
+		add_table_entry(ctab, chunk);
 		chunk_start += chunk_size;
 		chunk_id++;
 	}
+
+	write_chunk_table(ctab, table_len, fd,
+			  __le64_to_cpu(dev->d_chunk_table));
+	free(ctab);
 }
 
 int main (int argc, char * argv[])
@@ -145,13 +262,32 @@ int main (int argc, char * argv[])
 	struct chunkfs_pool pool = { 0 };
 	struct chunkfs_dev root_dev = { 0 };
 	struct chunkfs_chunk root_chunk = { 0 };
+	int opt;
 
 	cmd = argv[0];
 
-	if (argc != 2)
+	while ((opt = getopt(argc, argv, "c:t:")) != -1) {
+		switch (opt) {
+		case 'c':
+			chunk_bits = strtoul(optarg, NULL, 0);
+			if (chunk_bits < 1 || chunk_bits > CHUNKFS_MAX_CHUNK_BITS)
+				error(1, 0, "chunk id bits must be 1-%d",
+				      CHUNKFS_MAX_CHUNK_BITS);
+			break;
+		case 't':
+			client_fs = optarg;
+			if (strlen(client_fs) >= CHUNKFS_CLIENT_NAME_LEN)
+				error(1, 0, "client fs type too long");
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (argc - optind != 1)
 		usage();
 
-	dev_name = argv[1];
+	dev_name = argv[optind];
 
 	/*
 	 * Get some info about the device.
@@ -183,6 +319,7 @@ int main (int argc, char * argv[])
 	/* Now we get to the meaty bit: chunk summaries. */
 
 	write_chunk_summaries(&root_dev, &root_chunk, fd);
+	write_dirty_map(&root_dev, fd);
 
 	close(fd);
 
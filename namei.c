@@ -24,6 +24,10 @@ chunkfs_release_nd(struct dentry *dentry)
 	struct nameidata *nd = get_client_nd(dentry);
 	dput(nd->path.dentry);
 	mntput(nd->path.mnt);
+	if (CHUNKFS_D(dentry)->dp_chunk) {
+		chunkfs_put_chunk(CHUNKFS_D(dentry)->dp_chunk);
+		CHUNKFS_D(dentry)->dp_chunk = NULL;
+	}
 }
 
 /*
@@ -37,8 +41,11 @@ chunkfs_init_nd(struct inode *dir, struct dentry *dentry,
 	struct nameidata *nd = get_client_nd(dentry);
 	struct chunkfs_chunk_info *chunk;
 
+	/* Same chunk as dir (or the root), which is attached */
 	chunk = chunkfs_find_chunk(CHUNKFS_PI(dir->i_sb), chunk_id);
 	BUG_ON(!chunk); /* XXX */
+	chunkfs_hold_chunk(chunk);
+	CHUNKFS_D(dentry)->dp_chunk = chunk;
 	/* Probably don't need dget/mntget */
 	nd->path.dentry = dget(client_dentry);
 	nd->path.mnt = mntget(chunk->ci_mnt);
@@ -182,7 +189,7 @@ chunkfs_create(struct inode *dir, struct dentry *dentry, umode_t mode,
 	struct inode *client_dir = get_client_inode(dir);
 	struct dentry *client_dentry = get_client_dentry(dentry);
 	struct nameidata *client_nd = get_client_nd(dentry);
-	u64 chunk_id = UINO_TO_CHUNK_ID(dir->i_ino);
+	u64 chunk_id = UINO_TO_CHUNK_ID(dir->i_sb, dir->i_ino);
 	struct inode *inode;
 	int err;
 	struct nameidata nd;
@@ -193,6 +200,9 @@ chunkfs_create(struct inode *dir, struct dentry *dentry, umode_t mode,
 	err = chunkfs_new_inode(dir->i_sb, &inode);
 	if (err)
 		goto out;
+	err = chunkfs_start_write(dir);
+	if (err)
+		goto out_inode;
 
 	// TODO: or d_flags OR i_size_seqcount ?
 	nd.flags = dir->i_flags;
@@ -205,17 +215,18 @@ chunkfs_create(struct inode *dir, struct dentry *dentry, umode_t mode,
 	err = client_dir->i_op->create(client_dir, client_dentry, mode,
 				       client_nd);
 	if (err)
-		goto out_inode;
+		goto out_end;
 
-	err = chunkfs_init_cont_data(client_dentry);
+	err = chunkfs_init_cont_data(dir->i_sb, client_dentry);
 	if (err)
-		goto out_inode;
+		goto out_end;
 	chunkfs_start_inode(inode, client_dentry->d_inode, chunk_id);
 	chunkfs_copy_up_inode(dir, client_dir);
 	chunkfs_copy_up_nd(&nd, client_nd);
 
 	/* Now put our new inode into the dentry */
 	d_instantiate(dentry, inode);
+	chunkfs_end_write(dir);
 
 	chunkfs_debug("dentry %p name %s inode %p ino %0lx\n",
 		dentry, dentry->d_iname, dentry->d_inode, dentry->d_inode->i_ino);
@@ -224,6 +235,8 @@ chunkfs_create(struct inode *dir, struct dentry *dentry, umode_t mode,
 		client_dentry, client_dentry->d_iname, client_dentry->d_inode,
 		client_dentry->d_inode->i_ino);
 	return 0;
+ out_end:
+	chunkfs_end_write(dir);
  out_inode:
 	iput(inode);
  out:
@@ -234,7 +247,7 @@ static struct dentry *
 chunkfs_lookup(struct inode * dir, struct dentry *dentry, unsigned int flags)
 {
 	struct inode *client_dir = get_client_inode(dir);
-	u64 chunk_id = UINO_TO_CHUNK_ID(dir->i_ino);
+	u64 chunk_id = UINO_TO_CHUNK_ID(dir->i_sb, dir->i_ino);
 	struct dentry *client_dentry;
 	struct dentry *new_dentry;
 	struct nameidata *client_nd;
@@ -289,11 +302,13 @@ chunkfs_lookup(struct inode * dir, struct dentry *dentry, unsigned int flags)
 		err = chunkfs_new_inode(dir->i_sb, &inode);
 		if (err)
 			goto out_dput;
-		err = chunkfs_init_cont_data(client_dentry);
-		if (err)
+		/* A continuation's chunk may fail to attach */
+		err = chunkfs_start_inode(inode, client_dentry->d_inode,
+					  chunk_id);
+		if (err) {
+			iput(inode);
 			goto out_dput;
-		chunkfs_start_inode(inode, client_dentry->d_inode,
-				    chunk_id);
+		}
 	} else {
 		inode = NULL;
 	}
@@ -332,6 +347,9 @@ chunkfs_link(struct dentry *old_dentry, struct inode *dir,
 
 	chunkfs_debug("enter\n");
 
+	err = chunkfs_start_write(dir);
+	if (err)
+		return err;
 	err = client_dir->i_op->link(client_old_dentry, client_dir,
 				     client_new_dentry);
 	if (err)
@@ -345,6 +363,7 @@ chunkfs_link(struct dentry *old_dentry, struct inode *dir,
 	atomic_inc(&dir->i_count);
 	d_instantiate(new_dentry, old_inode);
  out:
+	chunkfs_end_write(dir);
 	return err;
 }
 
@@ -359,12 +378,16 @@ chunkfs_unlink(struct inode *dir, struct dentry *dentry)
 
 	chunkfs_debug("enter\n");
 
+	err = chunkfs_start_write(dir);
+	if (err)
+		return err;
 	err = client_dir->i_op->unlink(client_dir, client_dentry);
 	if (err)
 		goto out;
 	chunkfs_copy_up_inode(dir, client_dir);
 	chunkfs_copy_up_inode(inode, client_inode);
  out:
+	chunkfs_end_write(dir);
 	return err;
 }
 
@@ -373,7 +396,7 @@ chunkfs_symlink(struct inode *dir, struct dentry *dentry, const char *oldname)
 {
 	struct inode *client_dir = get_client_inode(dir);
 	struct dentry *client_dentry = get_client_dentry(dentry);
-	u64 chunk_id = UINO_TO_CHUNK_ID(dir->i_ino);
+	u64 chunk_id = UINO_TO_CHUNK_ID(dir->i_sb, dir->i_ino);
 	struct inode *inode;
 	int err;
 
@@ -383,19 +406,23 @@ chunkfs_symlink(struct inode *dir, struct dentry *dentry, const char *oldname)
 	err = chunkfs_new_inode(dir->i_sb, &inode);
 	if (err)
 		goto out;
+	err = chunkfs_start_write(dir);
+	if (err)
+		goto out_inode;
 
 	err = client_dir->i_op->symlink(client_dir, client_dentry, oldname);
 	if (err)
-		goto out_inode;
+		goto out_end;
 
-	err = chunkfs_init_cont_data(client_dentry);
+	err = chunkfs_init_cont_data(dir->i_sb, client_dentry);
 	if (err)
-		goto out_inode;
+		goto out_end;
 	chunkfs_start_inode(inode, client_dentry->d_inode, chunk_id);
 	chunkfs_copy_up_inode(dir, client_dir);
 
 	/* Now put our new inode into the dentry */
 	d_instantiate(dentry, inode);
+	chunkfs_end_write(dir);
 
 	chunkfs_debug("dentry %p name %s inode %p ino %0lx\n",
 		dentry, dentry->d_iname, dentry->d_inode,
@@ -404,6 +431,8 @@ chunkfs_symlink(struct inode *dir, struct dentry *dentry, const char *oldname)
 		client_dentry, client_dentry->d_iname, client_dentry->d_inode,
 		client_dentry->d_inode->i_ino);
 	return 0;
+ out_end:
+	chunkfs_end_write(dir);
  out_inode:
 	iput(inode);
  out:
@@ -416,7 +445,7 @@ chunkfs_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode)
 	struct inode *client_dir = get_client_inode(dir);
 	struct inode *client_inode;
 	struct dentry *client_dentry = get_client_dentry(dentry);
-	u64 chunk_id = UINO_TO_CHUNK_ID(dir->i_ino);
+	u64 chunk_id = UINO_TO_CHUNK_ID(dir->i_sb, dir->i_ino);
 	struct inode *inode;
 	int err;
 
@@ -426,19 +455,25 @@ chunkfs_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode)
 	err = chunkfs_new_inode(dir->i_sb, &inode);
 	if (err)
 		goto out;
+	err = chunkfs_start_write(dir);
+	if (err)
+		goto out_inode;
 
 	err = client_dir->i_op->mkdir(client_dir, client_dentry, mode);
 	if (err)
-		goto out_inode;
+		goto out_end;
 	client_inode = client_dentry->d_inode;
 
-	err = chunkfs_init_cont_data(client_dentry);
+	err = chunkfs_init_cont_data(dir->i_sb, client_dentry);
 	if (err)
-		goto out_inode;
+		goto out_end;
 	chunkfs_start_inode(inode, client_inode, chunk_id);
 	chunkfs_copy_up_inode(dir, client_dir);
 	d_instantiate(dentry, inode);
+	chunkfs_end_write(dir);
 	return 0;
+ out_end:
+	chunkfs_end_write(dir);
  out_inode:
 	iput(inode);
  out:
@@ -455,12 +490,16 @@ chunkfs_rmdir(struct inode *dir, struct dentry *dentry)
 	int err;
 
 	chunkfs_debug("enter\n");
-	err = client_dir->i_op->rmdir(client_dir, client_dentry);
+	err = chunkfs_start_write(dir);
 	if (err)
 		return err;
-	chunkfs_copy_up_inode(dir, client_dir);
-	chunkfs_copy_up_inode(inode, client_dentry->d_inode);
-	return 0;
+	err = client_dir->i_op->rmdir(client_dir, client_dentry);
+	if (!err) {
+		chunkfs_copy_up_inode(dir, client_dir);
+		chunkfs_copy_up_inode(inode, client_dentry->d_inode);
+	}
+	chunkfs_end_write(dir);
+	return err;
 }
 
 static int
@@ -468,7 +507,7 @@ chunkfs_mknod(struct inode *dir, struct dentry *dentry, umode_t mode, dev_t dev)
 {
 	struct inode *client_dir = get_client_inode(dir);
 	struct dentry *client_dentry = get_client_dentry(dentry);
-	u64 chunk_id = UINO_TO_CHUNK_ID(dir->i_ino);
+	u64 chunk_id = UINO_TO_CHUNK_ID(dir->i_sb, dir->i_ino);
 	struct inode *inode;
 	int err;
 
@@ -478,19 +517,25 @@ chunkfs_mknod(struct inode *dir, struct dentry *dentry, umode_t mode, dev_t dev)
 	err = chunkfs_new_inode(dir->i_sb, &inode);
 	if (err)
 		goto out;
+	err = chunkfs_start_write(dir);
+	if (err)
+		goto out_inode;
 
 	err = client_dir->i_op->mknod(client_dir, client_dentry, mode, dev);
 	if (err)
-		goto out_inode;
+		goto out_end;
 
-	err = chunkfs_init_cont_data(client_dentry);
+	err = chunkfs_init_cont_data(dir->i_sb, client_dentry);
 	if (err)
-		goto out_inode;
+		goto out_end;
 	chunkfs_start_inode(inode, client_dentry->d_inode, chunk_id);
 	chunkfs_copy_up_inode(dir, client_dir);
 	d_instantiate(dentry, inode);
+	chunkfs_end_write(dir);
 
 	return 0;
+ out_end:
+	chunkfs_end_write(dir);
  out_inode:
 	iput(inode);
  out:
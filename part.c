@@ -0,0 +1,230 @@
+/*
+ * Chunkfs partition devices
+ *
+ * Each chunk's client file system lives in a byte range of the pool
+ * device.  Rather than have userland set up a loop device and a mount
+ * for every chunk, we give each chunk a tiny block device of its own
+ * that remaps bios into its range of the parent device, and mount the
+ * client file system on that from the kernel.
+ *
+ * The devices are named chunkfs<N> and show up in /dev through
+ * devtmpfs, which is how the client's mount_bdev() finds them.
+ *
+ * (C) 2007-2008 Valerie Henson <val@nmt.edu>
+ */
+
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/blkdev.h>
+#include <linux/genhd.h>
+#include <linux/bio.h>
+#include <linux/idr.h>
+#include <linux/slab.h>
+#include <linux/mount.h>
+#include <linux/sched.h>
+#include <linux/workqueue.h>
+
+#include "chunkfs.h"
+#include "chunkfs_pool.h"
+#include "chunkfs_dev.h"
+#include "chunkfs_chunk.h"
+#include "chunkfs_i.h"
+
+struct chunkfs_part {
+	struct gendisk *cp_disk;
+	struct request_queue *cp_queue;
+	struct block_device *cp_parent;
+	sector_t cp_start;		/* In the parent, 512 byte sectors */
+	sector_t cp_nr_sects;
+	int cp_index;
+};
+
+static int chunkfs_part_major;
+static DEFINE_IDA(chunkfs_part_ida);
+
+static void
+chunkfs_part_make_request(struct request_queue *q, struct bio *bio)
+{
+	struct chunkfs_part *part = q->queuedata;
+
+	if (bio_end_sector(bio) > part->cp_nr_sects) {
+		bio_io_error(bio);
+		return;
+	}
+	bio->bi_bdev = part->cp_parent;
+	bio->bi_iter.bi_sector += part->cp_start;
+	generic_make_request(bio);
+}
+
+static const struct block_device_operations chunkfs_part_fops = {
+	.owner		= THIS_MODULE,
+};
+
+/*
+ * Make a block device covering bytes begin through end (inclusive)
+ * of parent.
+ */
+
+int
+chunkfs_part_create(struct block_device *parent, ci_byte_t begin,
+		    ci_byte_t end, struct chunkfs_part **ret_part)
+{
+	struct chunkfs_part *part;
+	struct gendisk *disk;
+	int err = -ENOMEM;
+
+	if ((begin | (end + 1)) & (bdev_logical_block_size(parent) - 1))
+		return -EINVAL;
+
+	part = kzalloc(sizeof(*part), GFP_KERNEL);
+	if (!part)
+		return -ENOMEM;
+	part->cp_parent = parent;
+	part->cp_start = begin >> 9;
+	part->cp_nr_sects = (end + 1 - begin) >> 9;
+
+	part->cp_index = ida_simple_get(&chunkfs_part_ida, 0, 1 << MINORBITS,
+					GFP_KERNEL);
+	if (part->cp_index < 0) {
+		err = part->cp_index;
+		goto out_free;
+	}
+
+	part->cp_queue = blk_alloc_queue(GFP_KERNEL);
+	if (!part->cp_queue)
+		goto out_ida;
+	part->cp_queue->queuedata = part;
+	blk_queue_make_request(part->cp_queue, chunkfs_part_make_request);
+	blk_queue_stack_limits(part->cp_queue, bdev_get_queue(parent));
+
+	disk = alloc_disk(1);
+	if (!disk)
+		goto out_queue;
+	disk->major = chunkfs_part_major;
+	disk->first_minor = part->cp_index;
+	disk->fops = &chunkfs_part_fops;
+	disk->queue = part->cp_queue;
+	disk->private_data = part;
+	disk->flags |= GENHD_FL_SUPPRESS_PARTITION_INFO | GENHD_FL_NO_PART_SCAN;
+	snprintf(disk->disk_name, DISK_NAME_LEN, "chunkfs%d", part->cp_index);
+	set_capacity(disk, part->cp_nr_sects);
+	part->cp_disk = disk;
+	add_disk(disk);
+
+	*ret_part = part;
+	return 0;
+ out_queue:
+	blk_cleanup_queue(part->cp_queue);
+ out_ida:
+	ida_simple_remove(&chunkfs_part_ida, part->cp_index);
+ out_free:
+	kfree(part);
+	return err;
+}
+
+/*
+ * Caller must have unmounted the client first, so nothing has the
+ * device open.
+ */
+
+void
+chunkfs_part_destroy(struct chunkfs_part *part)
+{
+	if (!part)
+		return;
+	del_gendisk(part->cp_disk);
+	blk_cleanup_queue(part->cp_queue);
+	put_disk(part->cp_disk);
+	ida_simple_remove(&chunkfs_part_ida, part->cp_index);
+	kfree(part);
+}
+
+/*
+ * The device name is looked up in the root of whoever does the
+ * mount.  Chunks are attached by whatever process first touches them,
+ * which may be chrooted or in a container without our /dev, so leave
+ * the mount to a kernel thread, which has init's root.
+ */
+
+struct chunkfs_part_mount_ctl {
+	struct work_struct	pm_work;
+	struct file_system_type	*pm_type;
+	int			pm_flags;
+	char			*pm_dev_name;
+	char			*pm_data;
+	struct vfsmount		*pm_mnt;
+};
+
+static void
+chunkfs_part_mount_work(struct work_struct *work)
+{
+	struct chunkfs_part_mount_ctl *pm =
+		container_of(work, struct chunkfs_part_mount_ctl, pm_work);
+
+	pm->pm_mnt = vfs_kern_mount(pm->pm_type, pm->pm_flags | MS_KERNMOUNT,
+				    pm->pm_dev_name, pm->pm_data);
+}
+
+/*
+ * Mount the client file system of a chunk on its partition device.
+ * Internal mount, so it is never in anyone's namespace and goes away
+ * synchronously on the last mntput().
+ */
+
+struct vfsmount *
+chunkfs_part_mount(struct chunkfs_part *part, const char *fs_name,
+		   int flags, const char *options)
+{
+	struct chunkfs_part_mount_ctl pm;
+	struct file_system_type *type;
+	struct vfsmount *mnt;
+	char *dev_name;
+	char *data = NULL;
+
+	type = get_fs_type(fs_name);
+	if (!type)
+		return ERR_PTR(-ENODEV);
+
+	dev_name = kasprintf(GFP_KERNEL, "/dev/%s", part->cp_disk->disk_name);
+	if (options)
+		data = kstrdup(options, GFP_KERNEL);
+	if (!dev_name || (options && !data)) {
+		mnt = ERR_PTR(-ENOMEM);
+		goto out;
+	}
+	pm.pm_type = type;
+	pm.pm_flags = flags;
+	pm.pm_dev_name = dev_name;
+	pm.pm_data = data;
+	if (current->flags & PF_KTHREAD) {
+		/* Already one, e.g. the parallel attach at mount */
+		chunkfs_part_mount_work(&pm.pm_work);
+	} else {
+		INIT_WORK_ONSTACK(&pm.pm_work, chunkfs_part_mount_work);
+		queue_work(chunkfs_wq, &pm.pm_work);
+		flush_work(&pm.pm_work);
+		destroy_work_on_stack(&pm.pm_work);
+	}
+	mnt = pm.pm_mnt;
+ out:
+	kfree(data);
+	kfree(dev_name);
+	module_put(type->owner);
+	return mnt;
+}
+
+int
+chunkfs_part_init(void)
+{
+	chunkfs_part_major = register_blkdev(0, "chunkfs");
+	if (chunkfs_part_major < 0)
+		return chunkfs_part_major;
+	return 0;
+}
+
+void
+chunkfs_part_exit(void)
+{
+	unregister_blkdev(chunkfs_part_major, "chunkfs");
+	ida_destroy(&chunkfs_part_ida);
+}
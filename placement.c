@@ -0,0 +1,462 @@
+/*
+ * Chunkfs continuation placement
+ *
+ * When a file grows out of its chunk we have to pick a chunk for the
+ * new continuation.  We keep a cached copy of each client's statfs
+ * numbers in the chunk info so that picking doesn't mean asking
+ * every client file system for its free space.  The cache is
+ * refreshed from the client when it gets old, and adjusted by hand
+ * each time we place something so back-to-back placements don't all
+ * pile into the same chunk.
+ *
+ * Every change to a chunk's cached numbers is also applied to the
+ * pool-wide percpu counters, which is all statfs() reads, once the
+ * chunk has real numbers from its client.  A delayed work item walks
+ * the chunks a batch at a time to keep the caches from going stale
+ * while nobody is placing anything.
+ *
+ * (C) 2007-2008 Valerie Henson <val@nmt.edu>
+ */
+
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/mount.h>
+#include <linux/statfs.h>
+#include <linux/jiffies.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/workqueue.h>
+
+#include "chunkfs.h"
+#include "chunkfs_pool.h"
+#include "chunkfs_dev.h"
+#include "chunkfs_chunk.h"
+#include "chunkfs_i.h"
+
+static const char *placement_names[CHUNKFS_PLACE_NR] = {
+	[CHUNKFS_PLACE_LEAST_FULL]	= "leastfull",
+	[CHUNKFS_PLACE_SAME_DEV]	= "samedev",
+	[CHUNKFS_PLACE_ROUND_ROBIN]	= "roundrobin",
+};
+
+const char *
+chunkfs_placement_name(int policy)
+{
+	return placement_names[policy];
+}
+
+int
+chunkfs_placement_policy(const char *name)
+{
+	int i;
+
+	for (i = 0; i < CHUNKFS_PLACE_NR; i++) {
+		if (strcmp(name, placement_names[i]) == 0)
+			return i;
+	}
+	return -EINVAL;
+}
+
+/*
+ * Replace a chunk's cached numbers, moving the pool totals by the
+ * difference.  Guesses (ci_stats_time 0) stay out of the totals, so
+ * statfs() doesn't report space nobody has looked at.  Caller holds
+ * ci_stats_lock.
+ */
+
+static void
+set_chunk_stats(struct chunkfs_chunk_info *ci, u64 bytes_total,
+		u64 bytes_free, u64 inodes_total, u64 inodes_free)
+{
+	struct chunkfs_pool_info *pi = ci->ci_dev->di_pool;
+
+	if (ci->ci_stats_time) {
+		percpu_counter_add(&pi->pi_bytes_total,
+				   bytes_total - ci->ci_bytes_total);
+		percpu_counter_add(&pi->pi_bytes_free,
+				   bytes_free - ci->ci_bytes_free);
+		percpu_counter_add(&pi->pi_inodes_total,
+				   inodes_total - ci->ci_inodes_total);
+		percpu_counter_add(&pi->pi_inodes_free,
+				   inodes_free - ci->ci_inodes_free);
+	}
+	ci->ci_bytes_total = bytes_total;
+	ci->ci_bytes_free = bytes_free;
+	ci->ci_inodes_total = inodes_total;
+	ci->ci_inodes_free = inodes_free;
+}
+
+/*
+ * Reread the client's statfs if our copy is stale (or always, if
+ * force).  A detached chunk is only attached for a forced refresh;
+ * otherwise it keeps its old numbers.  May sleep.
+ */
+
+void
+chunkfs_refresh_chunk_stats(struct chunkfs_chunk_info *ci, int force)
+{
+	struct path root;
+	struct kstatfs st;
+	int err;
+
+	if (!force && ci->ci_stats_time &&
+	    time_before(jiffies, ci->ci_stats_time + CHUNKFS_STATS_AGE))
+		return;
+
+	if (!chunkfs_tryget_chunk(ci)) {
+		if (!force)
+			return;
+		if (!chunkfs_get_chunk(ci->ci_dev->di_pool, ci->ci_chunk_id))
+			return;
+	}
+	root.mnt = ci->ci_mnt;
+	root.dentry = ci->ci_mnt->mnt_root;
+	err = vfs_statfs(&root, &st);
+	chunkfs_put_chunk(ci);
+	if (err) {
+		chunkfs_debug("statfs failed for chunk %llu\n", ci->ci_chunk_id);
+		return;
+	}
+
+	spin_lock(&ci->ci_stats_lock);
+	if (!ci->ci_stats_time) {
+		/* First real numbers, the guess never went in the totals */
+		ci->ci_bytes_total = ci->ci_bytes_free = 0;
+		ci->ci_inodes_total = ci->ci_inodes_free = 0;
+	}
+	ci->ci_stats_time = jiffies ? jiffies : 1;
+	set_chunk_stats(ci, st.f_blocks * st.f_bsize, st.f_bavail * st.f_bsize,
+			st.f_files, st.f_ffree);
+	spin_unlock(&ci->ci_stats_lock);
+}
+
+/*
+ * Stand-in numbers for a chunk we haven't attached: all of it free,
+ * and room for at least one inode.  ci_stats_time stays 0 so the
+ * first real look replaces them, and until then they're only used
+ * for placement, and only when no chunk we know about has room.
+ */
+
+void
+chunkfs_guess_chunk_stats(struct chunkfs_chunk_info *ci)
+{
+	struct chunkfs_chunk *chunk = CHUNKFS_CHUNK(ci);
+	u64 bytes = le64_to_cpu(chunk->c_innards_end) -
+		le64_to_cpu(chunk->c_innards_begin) + 1;
+
+	spin_lock(&ci->ci_stats_lock);
+	set_chunk_stats(ci, bytes, bytes, 1, 1);
+	ci->ci_stats_time = 0;
+	spin_unlock(&ci->ci_stats_lock);
+}
+
+/*
+ * Refresh the next CHUNKFS_STATS_BATCH chunks, so with thousands of
+ * chunks a full pass takes a while but costs little per run.
+ */
+
+static void
+chunkfs_stats_work(struct work_struct *work)
+{
+	struct chunkfs_pool_info *pi = container_of(to_delayed_work(work),
+				struct chunkfs_pool_info, pi_stats_work);
+	struct chunkfs_chunk_table *table;
+	struct chunkfs_chunk_info *ci;
+	u64 id = pi->pi_stats_cursor;
+	u64 nr;
+	int i;
+
+	/* The table only changes at mount and unmount */
+	table = rcu_dereference_protected(pi->pi_chunk_table, 1);
+	nr = table->ct_nr;
+	for (i = 0; i < CHUNKFS_STATS_BATCH && i < nr; i++, id++) {
+		if (id >= nr)
+			id = 0;
+		ci = table->ct_chunks[id];
+		if (ci)
+			chunkfs_refresh_chunk_stats(ci, 0);
+	}
+	pi->pi_stats_cursor = id;
+	schedule_delayed_work(&pi->pi_stats_work, CHUNKFS_STATS_PERIOD);
+}
+
+int
+chunkfs_init_pool_stats(struct chunkfs_pool_info *pi)
+{
+	int err;
+
+	err = percpu_counter_init(&pi->pi_bytes_total, 0, GFP_KERNEL);
+	if (err)
+		goto out;
+	err = percpu_counter_init(&pi->pi_bytes_free, 0, GFP_KERNEL);
+	if (err)
+		goto out_bytes_total;
+	err = percpu_counter_init(&pi->pi_inodes_total, 0, GFP_KERNEL);
+	if (err)
+		goto out_bytes_free;
+	err = percpu_counter_init(&pi->pi_inodes_free, 0, GFP_KERNEL);
+	if (err)
+		goto out_inodes_total;
+	pi->pi_stats = alloc_percpu(struct chunkfs_stats);
+	if (!pi->pi_stats) {
+		err = -ENOMEM;
+		goto out_inodes_free;
+	}
+	INIT_DELAYED_WORK(&pi->pi_stats_work, chunkfs_stats_work);
+	return 0;
+ out_inodes_free:
+	percpu_counter_destroy(&pi->pi_inodes_free);
+ out_inodes_total:
+	percpu_counter_destroy(&pi->pi_inodes_total);
+ out_bytes_free:
+	percpu_counter_destroy(&pi->pi_bytes_free);
+ out_bytes_total:
+	percpu_counter_destroy(&pi->pi_bytes_total);
+ out:
+	return err;
+}
+
+void
+chunkfs_start_pool_stats(struct chunkfs_pool_info *pi)
+{
+	schedule_delayed_work(&pi->pi_stats_work, CHUNKFS_STATS_PERIOD);
+}
+
+void
+chunkfs_stop_pool_stats(struct chunkfs_pool_info *pi)
+{
+	cancel_delayed_work_sync(&pi->pi_stats_work);
+}
+
+void
+chunkfs_destroy_pool_stats(struct chunkfs_pool_info *pi)
+{
+	percpu_counter_destroy(&pi->pi_inodes_free);
+	percpu_counter_destroy(&pi->pi_inodes_total);
+	percpu_counter_destroy(&pi->pi_bytes_free);
+	percpu_counter_destroy(&pi->pi_bytes_total);
+	free_percpu(pi->pi_stats);
+}
+
+/*
+ * The pickers run under rcu_read_lock() and only look at the cached
+ * numbers.  Unlocked reads are fine, this is a heuristic and the
+ * winner gets checked again with fresh numbers.
+ */
+
+static int
+chunk_has_room(struct chunkfs_chunk_info *ci, u64 len)
+{
+	return ci->ci_bytes_free >= len && ci->ci_inodes_free > 0;
+}
+
+/*
+ * Guessed numbers always look emptier than real ones, and using the
+ * chunk means attaching it, so take these last.
+ */
+
+static int
+chunk_guessed(struct chunkfs_chunk_info *ci)
+{
+	return ci->ci_stats_time == 0;
+}
+
+/*
+ * Charge len bytes (and inodes) to a chunk now; the client will catch
+ * up on the next refresh.
+ */
+
+static void
+charge_chunk(struct chunkfs_chunk_info *ci, u64 len, u64 inodes)
+{
+	spin_lock(&ci->ci_stats_lock);
+	set_chunk_stats(ci, ci->ci_bytes_total,
+			ci->ci_bytes_free - min(ci->ci_bytes_free, len),
+			ci->ci_inodes_total,
+			ci->ci_inodes_free - min(ci->ci_inodes_free, inodes));
+	spin_unlock(&ci->ci_stats_lock);
+}
+
+static struct chunkfs_chunk_info *
+pick_least_full(struct chunkfs_chunk_table *table,
+		struct chunkfs_dev_info *di, u64 len)
+{
+	struct chunkfs_chunk_info *best = NULL;
+	struct chunkfs_chunk_info *guess = NULL;
+	struct chunkfs_chunk_info *ci;
+	u64 id;
+
+	for (id = 0; id < table->ct_nr; id++) {
+		ci = table->ct_chunks[id];
+		if (!ci || (di && ci->ci_dev != di))
+			continue;
+		if (!chunk_has_room(ci, len))
+			continue;
+		if (chunk_guessed(ci)) {
+			if (!guess || ci->ci_bytes_free > guess->ci_bytes_free)
+				guess = ci;
+			continue;
+		}
+		if (!best || ci->ci_bytes_free > best->ci_bytes_free)
+			best = ci;
+	}
+	return best ? best : guess;
+}
+
+static struct chunkfs_chunk_info *
+pick_round_robin(struct chunkfs_pool_info *pi,
+		 struct chunkfs_chunk_table *table, u64 len)
+{
+	struct chunkfs_chunk_info *guess = NULL;
+	struct chunkfs_chunk_info *ci;
+	u64 start;
+	u64 i;
+
+	if (table->ct_nr == 0)
+		return NULL;
+	start = atomic64_inc_return(&pi->pi_place_cursor);
+	for (i = 0; i < table->ct_nr; i++) {
+		ci = table->ct_chunks[(start + i) % table->ct_nr];
+		if (!ci || !chunk_has_room(ci, len))
+			continue;
+		if (!chunk_guessed(ci))
+			return ci;
+		if (!guess)
+			guess = ci;
+	}
+	return guess;
+}
+
+static struct chunkfs_chunk_info *
+pick_chunk(struct chunkfs_pool_info *pi, struct chunkfs_chunk_info *from,
+	   u64 len)
+{
+	struct chunkfs_chunk_table *table;
+	struct chunkfs_chunk_info *ci = NULL;
+
+	rcu_read_lock();
+	table = rcu_dereference(pi->pi_chunk_table);
+	switch (pi->pi_placement) {
+	case CHUNKFS_PLACE_SAME_DEV:
+		ci = pick_least_full(table, from->ci_dev, len);
+		if (ci)
+			break;
+		atomic64_inc(&pi->pi_place_fallback);
+		/* Fall through */
+	case CHUNKFS_PLACE_LEAST_FULL:
+		ci = pick_least_full(table, NULL, len);
+		break;
+	case CHUNKFS_PLACE_ROUND_ROBIN:
+		ci = pick_round_robin(pi, table, len);
+		break;
+	}
+	rcu_read_unlock();
+	return ci;
+}
+
+/*
+ * Pick a chunk for a new continuation of len bytes following one in
+ * chunk "from".  Returns -ENOSPC if no chunk seems to have room.
+ */
+
+int
+chunkfs_place_continuation(struct chunkfs_pool_info *pi,
+			   struct chunkfs_chunk_info *from, u64 len,
+			   u64 *to_chunk_id)
+{
+	struct chunkfs_chunk_info *ci;
+	int tries;
+
+	/* Cached numbers may be stale, recheck the winner a few times */
+	for (tries = 0; tries < 3; tries++) {
+		ci = pick_chunk(pi, from, len);
+		if (!ci)
+			break;
+		if (ci->ci_stats_time &&
+		    time_before(jiffies, ci->ci_stats_time + CHUNKFS_STATS_AGE))
+			goto found;
+		atomic64_inc(&pi->pi_place_refresh);
+		chunkfs_refresh_chunk_stats(ci, 1);
+		if (chunk_has_room(ci, len))
+			goto found;
+	}
+	atomic64_inc(&pi->pi_place_nospace);
+	chunkfs_debug("no room for %llu bytes\n", len);
+	return -ENOSPC;
+ found:
+	charge_chunk(ci, len, 1);
+
+	atomic64_inc(&pi->pi_place_count[pi->pi_placement]);
+	if (ci->ci_dev != from->ci_dev)
+		atomic64_inc(&pi->pi_place_cross_dev);
+	*to_chunk_id = ci->ci_chunk_id;
+	chunkfs_debug("from chunk %llu to chunk %llu (%s)\n", from->ci_chunk_id,
+		ci->ci_chunk_id, placement_names[pi->pi_placement]);
+	return 0;
+}
+
+/*
+ * Can a continuation in ci take another len bytes of file?  Charges
+ * the chunk if so.  Staying put is always the first choice, so unlike
+ * placement this doesn't go looking elsewhere.
+ */
+
+int
+chunkfs_grow_in_place(struct chunkfs_chunk_info *ci, u64 len)
+{
+	struct chunkfs_pool_info *pi = ci->ci_dev->di_pool;
+
+	chunkfs_refresh_chunk_stats(ci, 0);
+	if (ci->ci_bytes_free < len)
+		return 0;
+	charge_chunk(ci, len, 0);
+	atomic64_inc(&pi->pi_place_grow);
+	return 1;
+}
+
+static int
+placement_show(struct seq_file *m, void *v)
+{
+	struct chunkfs_pool_info *pi = m->private;
+	int i;
+
+	seq_printf(m, "policy %s\n", placement_names[pi->pi_placement]);
+	for (i = 0; i < CHUNKFS_PLACE_NR; i++)
+		seq_printf(m, "placed_%s %lld\n", placement_names[i],
+			   (long long) atomic64_read(&pi->pi_place_count[i]));
+	seq_printf(m, "fallback %lld\n",
+		   (long long) atomic64_read(&pi->pi_place_fallback));
+	seq_printf(m, "nospace %lld\n",
+		   (long long) atomic64_read(&pi->pi_place_nospace));
+	seq_printf(m, "cross_dev %lld\n",
+		   (long long) atomic64_read(&pi->pi_place_cross_dev));
+	seq_printf(m, "stats_refresh %lld\n",
+		   (long long) atomic64_read(&pi->pi_place_refresh));
+	seq_printf(m, "grown_in_place %lld\n",
+		   (long long) atomic64_read(&pi->pi_place_grow));
+	return 0;
+}
+
+static int
+placement_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, placement_show, inode->i_private);
+}
+
+static const struct file_operations placement_fops = {
+	.owner		= THIS_MODULE,
+	.open		= placement_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+void
+chunkfs_placement_debugfs(struct super_block *sb)
+{
+	struct chunkfs_pool_info *pi = CHUNKFS_PI(sb);
+
+	if (pi->pi_debugfs)
+		debugfs_create_file("placement", S_IRUGO, pi->pi_debugfs, pi,
+				    &placement_fops);
+}
@@ -0,0 +1,280 @@
+#!/bin/bash
+#
+# Measure how chunkfs setup and recovery times scale with the number
+# of chunks, and with how much of the file system is damaged.
+#
+# For each chunk count, makes a sparse image file just big enough,
+# runs mkfs.chunkfs and puts an ext2 file system in each chunk.  If
+# the chunkfs module is loaded, mounts it and lists the root.  Then,
+# for each damage fraction, starts from a copy of the fresh image and
+# either marks that fraction of the chunks dirty, as if a crash had
+# caught them being written, or marks them dirty and stomps the root
+# inode of their client fs, the way demo.sh stomps a head inode.
+# fsck.chunkfs then gets to put it right.
+#
+# The claim to check is that recovery time follows the damage, not
+# the size of the file system.
+#
+# Results are CSV on stdout, one row per measurement:
+#
+#   chunks,image_bytes,step,fraction,damaged,seconds,status
+#
+# step is mkfs, client_mkfs, mount, first_ls, fsck_dirty or
+# fsck_corrupt; fraction and damaged are only set for the fsck steps.
+# status is the exit code.  Steps that can't run leave seconds empty.
+# Progress goes to stderr.
+#
+# Needs root, for loop devices and mount.
+#
+
+function getSelfDirectory()
+{
+    self="${1%/*}"
+    if [ ! ${self:0:1} = "/" ]; then
+        self="$PWD/$self"
+    fi
+
+    echo "$self/"
+}
+SELF="$(getSelfDirectory $0)"
+
+# This is where the chunkfs user binaries are located.
+BINPATH="$SELF"
+
+CHUNK_COUNTS="1 16 256 1024"
+FRACTIONS="0 0.01 0.1 0.5 1"
+REPEAT=1
+WORKDIR=/tmp
+MNT=
+
+# Must match CHUNKFS_CHUNK_SIZE, less the block for the chunk summary
+CHUNK_SIZE=$((10 * 1024 * 1024))
+CLIENT_BLOCKS=2559
+# Room for the pool, dev summary, chunk table and dirty map
+HEADER_SIZE=$((1024 * 1024))
+
+function usage()
+{
+    echo "Usage: $0 [-c \"<chunk counts>\"] [-f \"<damage fractions>\"]" \
+	"[-r <repeats>] [-w <work dir>]" >&2
+    exit 1
+}
+
+while getopts "c:f:r:w:" opt; do
+    case $opt in
+	c) CHUNK_COUNTS="$OPTARG" ;;
+	f) FRACTIONS="$OPTARG" ;;
+	r) REPEAT="$OPTARG" ;;
+	w) WORKDIR="$OPTARG" ;;
+	*) usage ;;
+    esac
+done
+shift $((OPTIND - 1))
+[ $# -eq 0 ] || usage
+
+IMAGE=${WORKDIR}/scale_bench.img
+FRESH=${WORKDIR}/scale_bench.fresh
+OFFSETLIST=${WORKDIR}/scale_bench.offsets
+LOOP=
+
+function cleanup()
+{
+    if [ -n "$MNT" ]; then
+	umount ${MNT} 2> /dev/null
+	rmdir ${MNT}
+    fi
+    [ -n "$LOOP" ] && losetup -d ${LOOP}
+    rm -f ${IMAGE} ${FRESH} ${OFFSETLIST}
+}
+trap cleanup EXIT
+
+function now()
+{
+    date +%s.%N
+}
+
+function since()
+{
+    echo "$(now) $1" | awk '{ printf "%.3f", $1 - $2 }'
+}
+
+# chunks image_bytes step fraction damaged seconds status
+function row()
+{
+    local IFS=,
+    echo "$*"
+}
+
+function drop_caches()
+{
+    sync
+    echo 3 > /proc/sys/vm/drop_caches 2> /dev/null
+}
+
+# Where the root inode of a fresh client fs is, relative to its start
+function find_root_inode()
+{
+    local offset=$1
+    local loop
+    local where
+    local size
+
+    loop=`losetup -f --show -o ${offset} ${FRESH}` || return 1
+    where=`debugfs -R "imap <2>" ${loop} 2> /dev/null | \
+	awk '/located at block/ { print $4, $6 }' | tr -d ,`
+    size=`dumpe2fs -h ${loop} 2> /dev/null | awk '/^Inode size:/ { print $3 }'`
+    losetup -d ${loop}
+
+    set -- ${where}
+    [ -n "$1" -a -n "$2" -a -n "$size" ] || return 1
+    ROOT_INODE_OFFSET=$(($1 * 4096 + $2))
+    ROOT_INODE_SIZE=${size}
+}
+
+# Evenly spread chunk ids for n out of the chunks
+function pick_chunks()
+{
+    local chunks=$1
+    local n=$2
+    local ids=
+    local i
+
+    for ((i = 0; i < n; i++)); do
+	ids="${ids:+$ids,}$((1 + i * chunks / n))"
+    done
+    echo ${ids}
+}
+
+function make_fresh()
+{
+    local chunks=$1
+    local size=$((HEADER_SIZE + chunks * CHUNK_SIZE))
+    local start
+    local status
+    local offset
+
+    rm -f ${FRESH}
+    truncate -s ${size} ${FRESH} || exit 1
+
+    start=$(now)
+    ${BINPATH}/mkfs.chunkfs ${FRESH} > ${OFFSETLIST}
+    status=$?
+    row ${chunks} ${size} mkfs "" "" $(since ${start}) ${status}
+    [ ${status} -eq 0 ] || return 1
+
+    OFFSETS=(`awk '/clientfs: start/ {print $3}' ${OFFSETLIST}`)
+    if [ ${#OFFSETS[@]} -ne ${chunks} ]; then
+	echo "mkfs.chunkfs made ${#OFFSETS[@]} chunks, not ${chunks}" >&2
+	return 1
+    fi
+
+    start=$(now)
+    status=0
+    for offset in ${OFFSETS[@]}; do
+	mke2fs -q -F -b 4096 -E offset=${offset} ${FRESH} ${CLIENT_BLOCKS} || \
+	    status=$?
+    done
+    row ${chunks} ${size} client_mkfs "" "" $(since ${start}) ${status}
+    [ ${status} -eq 0 ] || return 1
+
+    find_root_inode ${OFFSETS[0]}
+}
+
+function time_mount()
+{
+    local chunks=$1
+    local size=$2
+    local start
+    local status
+
+    if ! grep -qw chunkfs /proc/filesystems; then
+	row ${chunks} ${size} mount "" "" "" ""
+	row ${chunks} ${size} first_ls "" "" "" ""
+	return
+    fi
+
+    cp --sparse=always ${FRESH} ${IMAGE}
+    LOOP=`losetup -f --show ${IMAGE}` || exit 1
+    MNT=`mktemp -d ${WORKDIR}/scale_bench.mnt.XXXXXX` || exit 1
+    drop_caches
+
+    start=$(now)
+    mount -t chunkfs -o clientopts=user_xattr ${LOOP} ${MNT}
+    status=$?
+    row ${chunks} ${size} mount "" "" $(since ${start}) ${status}
+
+    if [ ${status} -eq 0 ]; then
+	start=$(now)
+	ls ${MNT} > /dev/null
+	status=$?
+	row ${chunks} ${size} first_ls "" "" $(since ${start}) ${status}
+	umount ${MNT}
+    else
+	row ${chunks} ${size} first_ls "" "" "" ""
+    fi
+
+    rmdir ${MNT}
+    MNT=
+    losetup -d ${LOOP}
+    LOOP=
+}
+
+# chunks size kind fraction
+function time_fsck()
+{
+    local chunks=$1
+    local size=$2
+    local kind=$3
+    local fraction=$4
+    local n
+    local ids
+    local id
+    local start
+    local status
+
+    n=`awk -v c=${chunks} -v f=${fraction} 'BEGIN { printf "%d", c * f + 0.5 }'`
+    ids=$(pick_chunks ${chunks} ${n})
+
+    cp --sparse=always ${FRESH} ${IMAGE}
+    if [ -n "$ids" ]; then
+	${BINPATH}/fsck.chunkfs -M ${ids} ${IMAGE} > /dev/null || exit 1
+    fi
+    if [ ${kind} = corrupt ]; then
+	if [ -z "$ROOT_INODE_OFFSET" ]; then
+	    row ${chunks} ${size} fsck_${kind} ${fraction} ${n} "" ""
+	    return
+	fi
+	for id in ${ids//,/ }; do
+	    dd if=/dev/zero of=${IMAGE} bs=1 count=${ROOT_INODE_SIZE} \
+		seek=$((OFFSETS[id - 1] + ROOT_INODE_OFFSET)) \
+		conv=notrunc 2> /dev/null
+	done
+    fi
+    drop_caches
+
+    start=$(now)
+    ${BINPATH}/fsck.chunkfs -y ${IMAGE} >&2
+    status=$?
+    row ${chunks} ${size} fsck_${kind} ${fraction} ${n} $(since ${start}) ${status}
+}
+
+row chunks image_bytes step fraction damaged seconds status
+
+for chunks in ${CHUNK_COUNTS}; do
+    size=$((HEADER_SIZE + chunks * CHUNK_SIZE))
+    for ((rep = 0; rep < REPEAT; rep++)); do
+	echo "=== ${chunks} chunks, run $((rep + 1)) of ${REPEAT}" >&2
+	ROOT_INODE_OFFSET=
+	if ! make_fresh ${chunks}; then
+	    echo "Making a ${chunks} chunk image failed" >&2
+	    continue
+	fi
+	time_mount ${chunks} ${size}
+	for fraction in ${FRACTIONS}; do
+	    time_fsck ${chunks} ${size} dirty ${fraction}
+	    time_fsck ${chunks} ${size} corrupt ${fraction}
+	done
+    done
+done
+
+exit 0
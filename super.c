@@ -21,6 +21,13 @@
 #include <linux/namei.h>
 #include <linux/dcache.h>
 #include <linux/mutex.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/workqueue.h>
+#include <linux/completion.h>
+#include <linux/cred.h>
 
 #include <asm/uaccess.h>
 
@@ -30,8 +37,14 @@
 #include "chunkfs_chunk.h"
 #include "chunkfs_i.h"
 
+#define CREATE_TRACE_POINTS
+#include "chunkfs_trace.h"
+
 static struct kmem_cache *chunkfs_inode_cachep;
 static DEFINE_MUTEX(chunkfs_kernel_mutex);
+static struct dentry *chunkfs_debugfs_root;
+/* For slow, sleeping work that shouldn't tie up the system workqueue */
+struct workqueue_struct *chunkfs_wq;
 
 static struct inode *chunkfs_alloc_inode(struct super_block *sb)
 {
@@ -43,6 +56,7 @@ static struct inode *chunkfs_alloc_inode(struct super_block *sb)
 		return NULL;
 	/* XXX should be done in cache constructor */
 	mutex_init(&ii->ii_continuations_lock);
+	memset(&ii->ii_cont_map, 0, sizeof(ii->ii_cont_map));
 	/* Don't load head  continuation until file open */
 	inode = &ii->ii_vnode;
 	inode_init_once(inode);
@@ -67,13 +81,55 @@ static void chunkfs_clear_inode(struct inode *inode)
 
 	chunkfs_debug("ino %0lx i_count %d\n",
 		inode->i_ino, atomic_read(&inode->i_count));
+	truncate_inode_pages_final(&inode->i_data);
+	chunkfs_free_cont_map(inode);
 	iput(ii->ii_client_inode);
+	if (ii->ii_chunk)
+		chunkfs_put_chunk(ii->ii_chunk);
 
 	clear_inode(inode);
 }
 
+/*
+ * Mount the client file system on a partition device of its own.
+ */
+
+static int
+chunkfs_mount_client(struct chunkfs_chunk_info *ci, int flags,
+		     const char *options)
+{
+	struct chunkfs_chunk *chunk = CHUNKFS_CHUNK(ci);
+	char fs_name[CHUNKFS_CLIENT_NAME_LEN + 1];
+	struct vfsmount *mnt;
+	int retval;
+
+	retval = chunkfs_part_create(ci->ci_dev->di_bh->b_bdev,
+				     le64_to_cpu(chunk->c_innards_begin),
+				     le64_to_cpu(chunk->c_innards_end),
+				     &ci->ci_part);
+	if (retval)
+		return retval;
+
+	memcpy(fs_name, ci->ci_client_fs, CHUNKFS_CLIENT_NAME_LEN);
+	fs_name[CHUNKFS_CLIENT_NAME_LEN] = '\0';
+	mnt = chunkfs_part_mount(ci->ci_part, fs_name, flags, options);
+	if (IS_ERR(mnt)) {
+		chunkfs_debug("mount %s for chunk %llu failed: %ld\n",
+			fs_name, ci->ci_chunk_id, PTR_ERR(mnt));
+		chunkfs_part_destroy(ci->ci_part);
+		ci->ci_part = NULL;
+		return PTR_ERR(mnt);
+	}
+	spin_lock(&ci->ci_attach_lock);
+	ci->ci_sb = mnt->mnt_sb;
+	ci->ci_mnt = mnt;
+	spin_unlock(&ci->ci_attach_lock);
+	return 0;
+}
+
 static int
-chunkfs_read_client_sb(struct chunkfs_chunk_info *ci)
+chunkfs_read_client_sb(struct chunkfs_chunk_info *ci, int flags,
+		       const char *options)
 {
 	/* XXX XXX XXX There aren't enough XXX's in the world XXX XXX */
 	const char *path_prefix = "/chunk";
@@ -81,10 +137,13 @@ chunkfs_read_client_sb(struct chunkfs_chunk_info *ci)
 	struct nameidata nd;
 	int retval;
 
+	if (ci->ci_client_fs[0])
+		return chunkfs_mount_client(ci, flags, options);
+
 	/*
-	 * Userland has kindly mounted our client fs's in particular
-	 * locations.  Look up the path and grab the superblock for
-	 * each chunk.
+	 * Old mkfs didn't record the client fs type, so userland has
+	 * kindly mounted our client fs's in particular locations.
+	 * Look up the path and grab the superblock for each chunk.
 	 *
 	 * XXX Yuckity yuckity yuck yuck
 	 */
@@ -95,32 +154,238 @@ chunkfs_read_client_sb(struct chunkfs_chunk_info *ci)
 		return retval;
 	}
 	/* XXX locking XXX prevent unmount XXX ref count XXX XXX */
-	ci->ci_mnt = mntget(nd.path.mnt);
+	spin_lock(&ci->ci_attach_lock);
 	ci->ci_sb = nd.path.mnt->mnt_sb;
+	ci->ci_mnt = mntget(nd.path.mnt);
+	spin_unlock(&ci->ci_attach_lock);
 	path_put(&nd.path);
 
 	return 0;
 }
 
+/*
+ * Chunk infos live until unmount, so the pointer stays good after we
+ * leave the RCU read side.
+ */
+
 struct chunkfs_chunk_info *
 chunkfs_find_chunk(struct chunkfs_pool_info *pi, u64 chunk_id)
 {
+	struct chunkfs_chunk_table *table;
+	struct chunkfs_chunk_info *ci = NULL;
+
+	rcu_read_lock();
+	table = rcu_dereference(pi->pi_chunk_table);
+	if (table && chunk_id < table->ct_nr)
+		ci = table->ct_chunks[chunk_id];
+	rcu_read_unlock();
+	return ci;
+}
+
+/*
+ * Chunks are attached (their client file system mounted) when
+ * something first needs them and, with the lazy mount option,
+ * detached again once nothing has used them for pi_idle_timeout.
+ * Anything that touches ci_sb or ci_mnt must hold a use count, taken
+ * with chunkfs_get_chunk(), or chunkfs_hold_chunk() if it already
+ * knows the chunk is attached.
+ */
+
+int chunkfs_tryget_chunk(struct chunkfs_chunk_info *ci)
+{
+	int ret = 0;
+
+	spin_lock(&ci->ci_attach_lock);
+	if (ci->ci_mnt) {
+		ci->ci_users++;
+		ci->ci_last_used = jiffies;
+		ret = 1;
+	}
+	spin_unlock(&ci->ci_attach_lock);
+	return ret;
+}
+
+void chunkfs_hold_chunk(struct chunkfs_chunk_info *ci)
+{
+	spin_lock(&ci->ci_attach_lock);
+	BUG_ON(!ci->ci_mnt);
+	ci->ci_users++;
+	spin_unlock(&ci->ci_attach_lock);
+}
+
+void chunkfs_put_chunk(struct chunkfs_chunk_info *ci)
+{
+	spin_lock(&ci->ci_attach_lock);
+	BUG_ON(ci->ci_users == 0);
+	ci->ci_users--;
+	ci->ci_last_used = jiffies;
+	spin_unlock(&ci->ci_attach_lock);
+}
+
+struct chunkfs_chunk_info *
+chunkfs_get_chunk(struct chunkfs_pool_info *pi, u64 chunk_id)
+{
+	struct chunkfs_chunk_info *ci;
+	int err = 0;
+
+	ci = chunkfs_find_chunk(pi, chunk_id);
+	if (!ci)
+		return NULL;
+	if (chunkfs_tryget_chunk(ci))
+		return ci;
+
+	mutex_lock(&ci->ci_attach_mutex);
+	if (!ci->ci_mnt)
+		err = chunkfs_read_client_sb(ci, pi->pi_client_flags,
+					     pi->pi_client_opts);
+	if (!err)
+		chunkfs_hold_chunk(ci);
+	mutex_unlock(&ci->ci_attach_mutex);
+	if (err) {
+		printk(KERN_ERR "chunkfs: can't attach chunk %llu: %d\n",
+			chunk_id, err);
+		return NULL;
+	}
+	chunkfs_refresh_chunk_stats(ci, 1);
+	return ci;
+}
+
+/*
+ * Unmount the client of a chunk nobody has used for a while.  The
+ * root chunk always stays attached.
+ */
+
+static void chunkfs_detach_chunk(struct chunkfs_chunk_info *ci,
+				 unsigned long timeout)
+{
+	struct vfsmount *mnt = NULL;
+	struct chunkfs_part *part = NULL;
+	struct super_block *sb = NULL;
+
+	if (CHUNKFS_IS_ROOT(ci) || !mutex_trylock(&ci->ci_attach_mutex))
+		return;
+	spin_lock(&ci->ci_attach_lock);
+	if (ci->ci_mnt && ci->ci_users == 0 &&
+	    time_after(jiffies, ci->ci_last_used + timeout)) {
+		mnt = ci->ci_mnt;
+		sb = ci->ci_sb;
+		part = ci->ci_part;
+		ci->ci_mnt = NULL;
+		ci->ci_sb = NULL;
+		ci->ci_part = NULL;
+	}
+	spin_unlock(&ci->ci_attach_lock);
+	if (mnt) {
+		chunkfs_debug("detaching chunk %llu\n", ci->ci_chunk_id);
+		/* mnt keeps sb alive until here */
+		chunkfs_clean_detaching_chunk(ci, sb);
+		mntput(mnt);
+		chunkfs_part_destroy(part);
+	}
+	mutex_unlock(&ci->ci_attach_mutex);
+}
+
+static void chunkfs_idle_work(struct work_struct *work)
+{
+	struct chunkfs_pool_info *pi = container_of(to_delayed_work(work),
+						    struct chunkfs_pool_info,
+						    pi_idle_work);
 	struct chunkfs_dev_info *di;
 	struct chunkfs_chunk_info *ci;
 
+	list_for_each_entry(di, &pi->pi_dlist_head, di_dlist)
+		list_for_each_entry(ci, &di->di_clist_head, ci_clist)
+			chunkfs_detach_chunk(ci, pi->pi_idle_timeout);
+	queue_delayed_work(chunkfs_wq, &pi->pi_idle_work,
+			   pi->pi_idle_timeout / 2 + 1);
+}
+
+static void chunkfs_start_idle_work(struct chunkfs_pool_info *pi)
+{
+	if (!pi->pi_lazy || !pi->pi_idle_timeout)
+		return;
+	queue_delayed_work(chunkfs_wq, &pi->pi_idle_work,
+			   pi->pi_idle_timeout / 2 + 1);
+}
+
+/*
+ * Chunk ids are 1 to the number of chunks (0 is never used), so
+ * anything past that is corruption and doesn't get to size the table.
+ */
+
+static int chunkfs_build_chunk_table(struct chunkfs_pool_info *pi)
+{
+	struct chunkfs_chunk_table *table;
+	struct chunkfs_dev_info *di;
+	struct chunkfs_chunk_info *ci;
+	u64 nr_chunks = 0;
+	u64 nr = 0;
+
+	list_for_each_entry(di, &pi->pi_dlist_head, di_dlist)
+		list_for_each_entry(ci, &di->di_clist_head, ci_clist)
+			nr_chunks++;
+
+	list_for_each_entry(di, &pi->pi_dlist_head, di_dlist) {
+		list_for_each_entry(ci, &di->di_clist_head, ci_clist) {
+			if (ci->ci_chunk_id >= (1ULL << pi->pi_chunk_bits)) {
+				printk(KERN_ERR "chunkfs: chunk id %llu needs more than %u bits\n",
+					ci->ci_chunk_id, pi->pi_chunk_bits);
+				return -EIO;
+			}
+			if (ci->ci_chunk_id > nr_chunks) {
+				printk(KERN_ERR "chunkfs: chunk id %llu out of range for %llu chunks\n",
+					ci->ci_chunk_id, nr_chunks);
+				return -EIO;
+			}
+			if (ci->ci_chunk_id >= nr)
+				nr = ci->ci_chunk_id + 1;
+		}
+	}
+	if (nr > (SIZE_MAX - sizeof(*table)) / sizeof(table->ct_chunks[0]))
+		return -ENOMEM;
+
+	table = kzalloc(sizeof(*table) + nr * sizeof(table->ct_chunks[0]),
+			GFP_KERNEL | __GFP_NOWARN);
+	if (!table)
+		table = vzalloc(sizeof(*table) +
+				nr * sizeof(table->ct_chunks[0]));
+	if (!table)
+		return -ENOMEM;
+	table->ct_nr = nr;
+
 	list_for_each_entry(di, &pi->pi_dlist_head, di_dlist) {
 		list_for_each_entry(ci, &di->di_clist_head, ci_clist) {
-			if(ci->ci_chunk_id == chunk_id)
-				return ci;
+			if (table->ct_chunks[ci->ci_chunk_id]) {
+				printk(KERN_ERR "chunkfs: duplicate chunk id %llu\n",
+					ci->ci_chunk_id);
+				kvfree(table);
+				return -EIO;
+			}
+			table->ct_chunks[ci->ci_chunk_id] = ci;
 		}
 	}
-	return NULL;
+	rcu_assign_pointer(pi->pi_chunk_table, table);
+	return 0;
+}
+
+static void chunkfs_free_chunk_table(struct chunkfs_pool_info *pi)
+{
+	struct chunkfs_chunk_table *table;
+
+	table = rcu_dereference_protected(pi->pi_chunk_table, 1);
+	RCU_INIT_POINTER(pi->pi_chunk_table, NULL);
+	if (!table)
+		return;
+	synchronize_rcu();
+	kvfree(table);
 }
 
 static void chunkfs_free_chunk(struct chunkfs_chunk_info *ci)
 {
 	brelse(ci->ci_bh);
+	/* Internal mount, so the client is gone when this returns */
 	mntput(ci->ci_mnt);
+	chunkfs_part_destroy(ci->ci_part);
 	kfree(ci);
 }
 
@@ -132,6 +397,7 @@ static void chunkfs_free_dev(struct chunkfs_dev_info *di)
 		list_del(&ci->ci_clist);
 		chunkfs_free_chunk(ci);
 	}
+	chunkfs_free_dirty_map(di);
 	brelse(di->di_bh);
 	kfree(di);
 }
@@ -140,11 +406,15 @@ static void chunkfs_free_pool(struct chunkfs_pool_info *pi)
 {
 	struct chunkfs_dev_info *di, *di_next;
 
+	chunkfs_free_chunk_table(pi);
 	list_for_each_entry_safe(di, di_next, &pi->pi_dlist_head, di_dlist) {
 		list_del(&di->di_dlist);
 		chunkfs_free_dev(di);
 	}
 	brelse(pi->pi_bh);
+	put_cred(pi->pi_cred);
+	chunkfs_destroy_pool_stats(pi);
+	kfree(pi->pi_client_opts);
 	kfree(pi);
 }
 
@@ -175,7 +445,8 @@ static int chunkfs_read_chunk(struct super_block *sb,
 	ci->ci_bh = bh;
 	chunk = CHUNKFS_CHUNK(ci);
 
-	if ((err = check_chunk(chunk)) != 0) {
+	if ((err = check_chunk(chunk,
+			       dev->di_pool->pi_legacy_chksum)) != 0) {
 		printk(KERN_ERR "chunkfs: invalid chunk summary, err %d, chksum %0x\n",
 			err, le32_to_cpu(chunk->c_chksum));
 		goto out;
@@ -189,11 +460,10 @@ static int chunkfs_read_chunk(struct super_block *sb,
 
 	/* Init non-disk stuff */
 	ci->ci_dev = dev;
-
-	/* Mount the client file system */
-	retval = chunkfs_read_client_sb(ci);
-	if (retval)
-		goto out;
+	spin_lock_init(&ci->ci_stats_lock);
+	mutex_init(&ci->ci_attach_mutex);
+	spin_lock_init(&ci->ci_attach_lock);
+	spin_lock_init(&ci->ci_dirty_lock);
 
 	*chunk_info = ci;
 	return 0;
@@ -206,6 +476,265 @@ static int chunkfs_read_chunk(struct super_block *sb,
 	return retval;
 }
 
+/*
+ * Attaching a client file system means a path lookup (and later a
+ * mount), which sleeps on its own I/O.  Do all the chunks on a device
+ * at once on chunkfs_wq instead of one after the other.
+ *
+ * With the lazy mount option only the root chunk is attached here;
+ * the rest wait for chunkfs_get_chunk() and start out with stats
+ * guessed from their size.
+ */
+
+struct chunkfs_attach_ctl {
+	atomic_t		ac_pending;
+	struct completion	ac_done;
+	int			ac_err;		/* First error seen */
+};
+
+struct chunkfs_attach {
+	struct work_struct		ca_work;
+	struct chunkfs_chunk_info	*ca_chunk;
+	struct chunkfs_attach_ctl	*ca_ctl;
+	struct chunkfs_pool_info	*ca_pool;
+};
+
+static void chunkfs_attach_work(struct work_struct *work)
+{
+	struct chunkfs_attach *ca = container_of(work, struct chunkfs_attach,
+						 ca_work);
+	struct chunkfs_attach_ctl *ctl = ca->ca_ctl;
+	int err;
+
+	err = chunkfs_read_client_sb(ca->ca_chunk, ca->ca_pool->pi_client_flags,
+				     ca->ca_pool->pi_client_opts);
+	if (err) {
+		printk(KERN_ERR "chunkfs: can't attach chunk %llu: %d\n",
+			ca->ca_chunk->ci_chunk_id, err);
+		cmpxchg(&ctl->ac_err, 0, err);
+	} else {
+		chunkfs_refresh_chunk_stats(ca->ca_chunk, 1);
+	}
+	if (atomic_dec_and_test(&ctl->ac_pending))
+		complete(&ctl->ac_done);
+}
+
+static int chunkfs_attach_chunks(struct chunkfs_dev_info *di, unsigned nr)
+{
+	struct chunkfs_attach_ctl ctl;
+	struct chunkfs_attach *ca;
+	struct chunkfs_chunk_info *ci;
+	unsigned i = 0;
+
+	if (di->di_pool->pi_lazy) {
+		list_for_each_entry(ci, &di->di_clist_head, ci_clist)
+			if (!CHUNKFS_IS_ROOT(ci))
+				chunkfs_guess_chunk_stats(ci);
+		nr = 1;
+	}
+
+	ca = kmalloc(nr * sizeof(*ca), GFP_KERNEL | __GFP_NOWARN);
+	if (!ca)
+		ca = vmalloc(nr * sizeof(*ca));
+	if (!ca)
+		return -ENOMEM;
+
+	/* One extra count so the last work item can't finish early */
+	atomic_set(&ctl.ac_pending, 1);
+	init_completion(&ctl.ac_done);
+	ctl.ac_err = 0;
+	list_for_each_entry(ci, &di->di_clist_head, ci_clist) {
+		if (di->di_pool->pi_lazy && !CHUNKFS_IS_ROOT(ci))
+			continue;
+		INIT_WORK(&ca[i].ca_work, chunkfs_attach_work);
+		ca[i].ca_chunk = ci;
+		ca[i].ca_ctl = &ctl;
+		ca[i].ca_pool = di->di_pool;
+		atomic_inc(&ctl.ac_pending);
+		queue_work(chunkfs_wq, &ca[i].ca_work);
+		i++;
+	}
+	if (atomic_dec_and_test(&ctl.ac_pending))
+		complete(&ctl.ac_done);
+	wait_for_completion(&ctl.ac_done);
+
+	kvfree(ca);
+	return ctl.ac_err;
+}
+
+/*
+ * mkfs lays chunks out back to back, so once we know how big one is
+ * we can guess where the next few summaries are and start reading
+ * them before the chain gets us there.  A wrong guess costs one
+ * wasted block read.
+ */
+
+#define CHUNKFS_SUMMARY_RA	32	/* Summaries to keep in flight */
+
+static void chunkfs_summary_readahead(struct super_block *sb,
+				      struct chunkfs_chunk_info *ci,
+				      ci_byte_t dev_end, ci_byte_t *ra_next)
+{
+	struct chunkfs_chunk *chunk = CHUNKFS_CHUNK(ci);
+	ci_byte_t begin = le64_to_cpu(chunk->c_begin);
+	ci_byte_t end = le64_to_cpu(chunk->c_end);
+	ci_byte_t stride = end - begin + 1;
+	ci_byte_t limit;
+
+	if (le64_to_cpu(chunk->c_next_chunk) != end + 1 ||
+	    stride % CHUNKFS_BLK_SIZE)
+		return;
+	if (*ra_next <= end)
+		*ra_next = end + 1;
+	limit = end + 1 + CHUNKFS_SUMMARY_RA * stride;
+	while (*ra_next < limit && *ra_next < dev_end) {
+		sb_breadahead(sb, *ra_next / CHUNKFS_BLK_SIZE);
+		*ra_next += stride;
+	}
+}
+
+static void chunkfs_add_chunk(struct chunkfs_dev_info *di,
+			      struct chunkfs_chunk_info *ci)
+{
+	list_add_tail(&ci->ci_clist, &di->di_clist_head);
+	if (CHUNKFS_IS_ROOT(ci)) {
+		BUG_ON(di->di_pool->pi_root_dev);
+		di->di_pool->pi_root_dev = di;
+		BUG_ON(di->di_root_chunk);
+		di->di_root_chunk = ci;
+	}
+}
+
+/*
+ * Find the chunks by following c_next_chunk from the first one.  For
+ * file systems made before the chunk table, or if it is damaged.
+ */
+
+static int chunkfs_walk_chunk_chain(struct super_block *sb,
+				    struct chunkfs_dev_info *di,
+				    unsigned *nr_chunks)
+{
+	struct chunkfs_dev *dev = CHUNKFS_DEV(di);
+	struct chunkfs_chunk_info *ci;
+	ci_byte_t chunk_offset = le64_to_cpu(dev->d_innards_begin);
+	ci_byte_t dev_end = le64_to_cpu(dev->d_innards_end);
+	ci_byte_t next_chunk_offset;
+	ci_byte_t ra_next = 0;
+	int retval;
+
+	while (chunk_offset != 0) {
+		retval = chunkfs_read_chunk(sb, di, &ci, chunk_offset,
+					    &next_chunk_offset);
+		if (retval)
+			return retval;
+		chunkfs_summary_readahead(sb, ci, dev_end, &ra_next);
+		chunkfs_add_chunk(di, ci);
+		(*nr_chunks)++;
+		chunk_offset = next_chunk_offset;
+	}
+	return 0;
+}
+
+/*
+ * Find the chunks from the chunk table.  Returns -ENOENT if there is
+ * no table and -EINVAL if it is bad, in which case nothing has been
+ * added and the caller can fall back to the chain.
+ */
+
+static int chunkfs_read_chunk_table(struct super_block *sb,
+				    struct chunkfs_dev_info *di,
+				    unsigned *nr_chunks)
+{
+	struct chunkfs_dev *dev = CHUNKFS_DEV(di);
+	ci_byte_t offset = le64_to_cpu(dev->d_chunk_table);
+	ci_byte_t len = le64_to_cpu(dev->d_chunk_table_len);
+	sector_t block = offset / CHUNKFS_BLK_SIZE;
+	ci_byte_t dev_size = i_size_read(sb->s_bdev->bd_inode);
+	/* Every chunk takes at least a block for its summary */
+	u64 max_nr = min_t(u64, dev_size / CHUNKFS_BLK_SIZE,
+			   (1ULL << di->di_pool->pi_chunk_bits) - 1);
+	struct chunkfs_ctab_entry *entry;
+	struct chunkfs_chunk_info *ci;
+	struct chunkfs_ctab *ctab;
+	struct buffer_head *bh;
+	struct blk_plug plug;
+	ci_byte_t next_chunk_offset;
+	u64 nr_blocks;
+	u64 nr;
+	u64 i;
+	int err;
+
+	if (offset == 0)
+		return -ENOENT;
+	if (offset % CHUNKFS_BLK_SIZE || len % CHUNKFS_BLK_SIZE ||
+	    len < sizeof(*ctab) ||
+	    len > round_up(chunkfs_ctab_bytes(max_nr), CHUNKFS_BLK_SIZE) ||
+	    offset >= dev_size || len > dev_size - offset)
+		return -EINVAL;
+	nr_blocks = len / CHUNKFS_BLK_SIZE;
+
+	ctab = vmalloc(len);
+	if (!ctab)
+		return -ENOMEM;
+
+	/* Put the whole table in flight at once so it goes as one I/O */
+	blk_start_plug(&plug);
+	for (i = 0; i < nr_blocks; i++)
+		sb_breadahead(sb, block + i);
+	blk_finish_plug(&plug);
+	for (i = 0; i < nr_blocks; i++) {
+		bh = sb_bread(sb, block + i);
+		if (!bh) {
+			err = -EINVAL;
+			goto out;
+		}
+		memcpy((char *) ctab + i * CHUNKFS_BLK_SIZE, bh->b_data,
+		       CHUNKFS_BLK_SIZE);
+		brelse(bh);
+	}
+	if ((err = check_ctab(ctab, len,
+			       di->di_pool->pi_legacy_chksum)) != 0) {
+		printk(KERN_ERR "chunkfs: invalid chunk table, err %d chksum %0x\n",
+			err, le32_to_cpu(ctab->t_chksum));
+		err = -EINVAL;
+		goto out;
+	}
+	nr = le64_to_cpu(ctab->t_nr);
+
+	/*
+	 * Nothing depends on the order now, so ask for every summary
+	 * up front and let the elevator sort them out.
+	 */
+	blk_start_plug(&plug);
+	for (i = 0; i < nr; i++)
+		sb_breadahead(sb, le64_to_cpu(ctab->t_entries[i].e_begin) /
+			      CHUNKFS_BLK_SIZE);
+	blk_finish_plug(&plug);
+
+	for (i = 0; i < nr; i++) {
+		entry = &ctab->t_entries[i];
+		err = chunkfs_read_chunk(sb, di, &ci, le64_to_cpu(entry->e_begin),
+					 &next_chunk_offset);
+		if (err)
+			goto out;
+		if (ci->ci_chunk_id != le64_to_cpu(entry->e_chunk_id) ||
+		    ci->ci_flags != le64_to_cpu(entry->e_flags)) {
+			printk(KERN_ERR "chunkfs: chunk %llu at %llu does not match chunk table\n",
+				le64_to_cpu(entry->e_chunk_id),
+				le64_to_cpu(entry->e_begin));
+			chunkfs_free_chunk(ci);
+			err = -EIO;
+			goto out;
+		}
+		chunkfs_add_chunk(di, ci);
+		(*nr_chunks)++;
+	}
+	err = 0;
+ out:
+	vfree(ctab);
+	return err;
+}
+
 static int chunkfs_read_dev(struct super_block *sb,
 			    struct chunkfs_pool_info *pool_info,
 			    struct chunkfs_dev_info **dev_info)
@@ -214,7 +743,7 @@ static int chunkfs_read_dev(struct super_block *sb,
 	struct chunkfs_dev *dev;
 	struct buffer_head * bh;
 	struct chunkfs_chunk_info *ci, *ci_next;
-	ci_byte_t chunk_offset, next_chunk_offset;
+	unsigned nr_chunks = 0;
 	int retval = -EIO;
 	int err;
 
@@ -232,14 +761,13 @@ static int chunkfs_read_dev(struct super_block *sb,
 	di->di_bh = bh;
 	dev = CHUNKFS_DEV(di);
 
-	if ((err = check_dev(dev)) != 0) {
+	if ((err = check_dev(dev, pool_info->pi_legacy_chksum)) != 0) {
 		printk(KERN_ERR "chunkfs: nnvalid dev summary err %d chksum %0x\n",
 			err, le32_to_cpu(dev->d_chksum));
 		goto out_bh;
 	}
 	/* Fill in on-disk info */
 	di->di_flags = cpu_to_le64(dev->d_flags);
-	chunk_offset = cpu_to_le64(dev->d_innards_begin);
 
 	/* Init non-disk stuff */
 	INIT_LIST_HEAD(&di->di_clist_head);
@@ -247,26 +775,30 @@ static int chunkfs_read_dev(struct super_block *sb,
 
 	/* XXX would like to sanity check dev size here */
 
-	while (chunk_offset != 0) {
-		retval = chunkfs_read_chunk(sb, di, &ci, chunk_offset,
-					    &next_chunk_offset);
-		if (retval)
-			goto out_free_chunks;
-		list_add_tail(&ci->ci_clist, &di->di_clist_head);
-		if (CHUNKFS_IS_ROOT(ci)) {
-			BUG_ON(di->di_pool->pi_root_dev);
-			di->di_pool->pi_root_dev = di;
-			BUG_ON(di->di_root_chunk);
-			di->di_root_chunk = ci;
-		}
-		chunk_offset = next_chunk_offset;
-	}
+	/* Read and check all the summaries first... */
+	retval = chunkfs_read_chunk_table(sb, di, &nr_chunks);
+	if (retval == -EINVAL)
+		printk(KERN_ERR "chunkfs: falling back to chunk chain\n");
+	if (retval == -ENOENT || retval == -EINVAL)
+		retval = chunkfs_walk_chunk_chain(sb, di, &nr_chunks);
+	if (retval)
+		goto out_free_chunks;
 
 	/* Did we find root? */
 	if (!di->di_root_chunk) {
 		printk(KERN_ERR "chunkfs: did not find root\n");
+		retval = -EIO;
 		goto out_free_chunks;
 	}
+
+	retval = chunkfs_read_dirty_map(sb, di);
+	if (retval)
+		goto out_free_chunks;
+
+	/* ...then bring up the client file systems in parallel */
+	retval = chunkfs_attach_chunks(di, nr_chunks);
+	if (retval)
+		goto out_free_chunks;
 	*dev_info = di;
 	return 0;
  out_free_chunks:
@@ -274,6 +806,7 @@ static int chunkfs_read_dev(struct super_block *sb,
 		list_del(&ci->ci_clist);
 		chunkfs_free_chunk(ci);
 	}
+	chunkfs_free_dirty_map(di);
  out_bh:
 	brelse(bh);
 	di->di_bh = NULL;
@@ -283,6 +816,7 @@ static int chunkfs_read_dev(struct super_block *sb,
 }
 
 static int chunkfs_read_pool(struct super_block *sb,
+			     struct chunkfs_mount_opts *opts,
 			     struct chunkfs_pool_info **pool_info)
 {
 	struct chunkfs_pool_info *pi;
@@ -295,6 +829,17 @@ static int chunkfs_read_pool(struct super_block *sb,
 	pi = kzalloc(sizeof(*pi), GFP_KERNEL);
 	if (!pi)
 		return -ENOMEM;
+	retval = chunkfs_init_pool_stats(pi);
+	if (retval) {
+		kfree(pi);
+		return retval;
+	}
+	pi->pi_cred = prepare_kernel_cred(NULL);
+	if (!pi->pi_cred) {
+		retval = -ENOMEM;
+		goto out_stats;
+	}
+	retval = -EIO;
 
 	/* XXX assumes sb offset is multiple of underlying block size */
 
@@ -312,10 +857,33 @@ static int chunkfs_read_pool(struct super_block *sb,
 		goto out;
 	}
 	/* Fill in on-disk info */
-	pi->pi_flags = cpu_to_le64(pool->p_flags);
+	pi->pi_flags = le64_to_cpu(pool->p_flags);
+	pi->pi_legacy_chksum = chunkfs_legacy_chksum(pool);
+	pi->pi_chunk_bits = le32_to_cpu(pool->p_chunk_bits);
+	if (pi->pi_chunk_bits == 0) {
+		pi->pi_chunk_bits = CHUNKFS_LEGACY_CHUNK_BITS;
+		pi->pi_ino_bits = CHUNKFS_LEGACY_INO_BITS;
+	} else {
+		pi->pi_ino_bits = CHUNKFS_UINO_BITS - pi->pi_chunk_bits;
+	}
+	/* Same limit as mkfs, and i_ino is an unsigned long */
+	if (pi->pi_chunk_bits > CHUNKFS_MAX_CHUNK_BITS ||
+	    pi->pi_chunk_bits + pi->pi_ino_bits > BITS_PER_LONG) {
+		printk(KERN_ERR "chunkfs: unsupported layout, %u bit chunk ids and %u bit inodes\n",
+			pi->pi_chunk_bits, pi->pi_ino_bits);
+		retval = -EINVAL;
+		goto out;
+	}
 
 	/* Init non-disk stuff */
 	INIT_LIST_HEAD(&pi->pi_dlist_head);
+	pi->pi_placement = opts->mo_placement;
+	pi->pi_client_flags = sb->s_flags & MS_RDONLY;
+	pi->pi_client_opts = opts->mo_client_opts;
+	pi->pi_lazy = opts->mo_lazy;
+	pi->pi_idle_timeout = opts->mo_idle_timeout * HZ;
+	INIT_DELAYED_WORK(&pi->pi_idle_work, chunkfs_idle_work);
+	chunkfs_init_clean(pi);
 
 	/* XXX read multiple devs */
 	/* For now, we just read at a particular offset on this dev */
@@ -324,12 +892,22 @@ static int chunkfs_read_pool(struct super_block *sb,
 		goto out;
 	list_add_tail(&di->di_dlist, &pi->pi_dlist_head);
 
+	retval = chunkfs_build_chunk_table(pi);
+	if (retval) {
+		list_del(&di->di_dlist);
+		chunkfs_free_dev(di);
+		goto out;
+	}
+
 	*pool_info = pi;
 	return 0;
  out:
 	brelse(bh);
 	pi->pi_bh = NULL;
  out_nobh:
+	put_cred(pi->pi_cred);
+ out_stats:
+	chunkfs_destroy_pool_stats(pi);
 	kfree(pi);
 	return retval;
 }
@@ -353,6 +931,10 @@ static void chunkfs_put_super (struct super_block *sb)
 		/* XXX should mark super block as clean unmounted */
 		chunkfs_commit_super(sb, 1);
 	}
+	chunkfs_stop_pool_stats(pi);
+	cancel_delayed_work_sync(&pi->pi_idle_work);
+	chunkfs_stop_clean(pi);
+	debugfs_remove_recursive(pi->pi_debugfs);
 	chunkfs_free_pool(pi);
 	sb->s_fs_info = NULL;
 
@@ -371,6 +953,46 @@ chunkfs_write_super (struct super_block *sb, int wait)
 	return 0;
 }
 
+/*
+ * Pool-wide totals come from the counters in the pool info, which
+ * follow the per-chunk caches.  Asking every client here would make
+ * df cost one statfs per chunk.
+ */
+
+static int chunkfs_statfs(struct dentry *dentry, struct kstatfs *buf)
+{
+	struct super_block *sb = dentry->d_sb;
+	struct chunkfs_pool_info *pi = CHUNKFS_PI(sb);
+	u64 id = huge_encode_dev(sb->s_bdev->bd_dev);
+
+	buf->f_type = CHUNKFS_SUPER_MAGIC;
+	buf->f_bsize = sb->s_blocksize;
+	buf->f_blocks = percpu_counter_sum_positive(&pi->pi_bytes_total) >>
+		sb->s_blocksize_bits;
+	buf->f_bfree = percpu_counter_sum_positive(&pi->pi_bytes_free) >>
+		sb->s_blocksize_bits;
+	buf->f_bavail = buf->f_bfree;
+	buf->f_files = percpu_counter_sum_positive(&pi->pi_inodes_total);
+	buf->f_ffree = percpu_counter_sum_positive(&pi->pi_inodes_free);
+	buf->f_namelen = NAME_MAX;
+	buf->f_fsid.val[0] = (u32) id;
+	buf->f_fsid.val[1] = (u32) (id >> 32);
+	return 0;
+}
+
+static int chunkfs_show_options(struct seq_file *seq, struct dentry *root)
+{
+	struct chunkfs_pool_info *pi = CHUNKFS_PI(root->d_sb);
+
+	seq_printf(seq, ",placement=%s",
+		   chunkfs_placement_name(pi->pi_placement));
+	if (pi->pi_client_opts)
+		seq_printf(seq, ",clientopts=%s", pi->pi_client_opts);
+	if (pi->pi_lazy)
+		seq_printf(seq, ",lazy,idle_timeout=%lu",
+			   pi->pi_idle_timeout / HZ);
+	return 0;
+}
 
 static struct super_operations chunkfs_sops = {
 	.alloc_inode	= chunkfs_alloc_inode,
@@ -387,13 +1009,11 @@ static struct super_operations chunkfs_sops = {
 	.sync_fs	= chunkfs_sync_fs,
 	.write_super_lockfs = chunkfs_write_super_lockfs,
 	.unlockfs	= chunkfs_unlockfs,
-	.statfs		= chunkfs_statfs,
 	.remount_fs	= chunkfs_remount,
 #endif
+	.statfs		= chunkfs_statfs,
 	.evict_inode	= chunkfs_clear_inode,
-#if 0
 	.show_options	= chunkfs_show_options,
-#endif
 };
 
 /*
@@ -406,7 +1026,7 @@ static struct super_operations chunkfs_sops = {
 static int chunkfs_read_root(struct super_block *sb)
 {
 	struct chunkfs_chunk_info *ci = CHUNKFS_PI(sb)->pi_root_dev->di_root_chunk;
-	ino_t ino = MAKE_UINO(ci->ci_chunk_id, 12); /* XXX */
+	ino_t ino = MAKE_UINO(sb, ci->ci_chunk_id, 12); /* XXX */
 	struct inode *inode;
 	struct nameidata nd;
 	struct dentry *dentry;
@@ -418,13 +1038,25 @@ static int chunkfs_read_root(struct super_block *sb)
 	inode->i_atime = inode->i_mtime = inode->i_ctime = CURRENT_TIME;
 	inode_init_owner(inode, NULL, S_IFDIR);
 
-	retval = kern_path("/chunk1/root/", LOOKUP_FOLLOW, &nd.path);
+	/* A fresh root chunk doesn't have the root directory yet */
+	retval = chunkfs_client_lookup(ci, "root", LOOKUP_FOLLOW, &nd.path);
+	if (retval == -ENOENT) {
+		retval = chunkfs_start_chunk_write(ci);
+		if (!retval) {
+			retval = chunkfs_client_mkdir(ci, "root", S_IRWXU |
+						      S_IRUGO | S_IXUGO);
+			chunkfs_end_chunk_write(ci);
+		}
+		if (!retval)
+			retval = chunkfs_client_lookup(ci, "root",
+						       LOOKUP_FOLLOW, &nd.path);
+	}
 	if (retval)
 		goto out_dentry;
 	dentry = dget(nd.path.dentry);
 
 	/* Finish inode init */
-	chunkfs_init_cont_data(dentry);
+	chunkfs_init_root_cont_data(sb, ci, dentry);
 	chunkfs_start_inode(inode, dentry->d_inode, ci->ci_chunk_id);
 	/* Restore it, after chunkfs_start_inode() */
 	inode->i_ino = ino;
@@ -451,6 +1083,76 @@ static int chunkfs_read_root(struct super_block *sb)
 	return retval;
 }
 
+enum {
+	Opt_placement, Opt_clientopts, Opt_lazy, Opt_idle_timeout, Opt_err,
+};
+
+static const match_table_t tokens = {
+	{Opt_placement, "placement=%s"},
+	{Opt_clientopts, "clientopts=%s"},
+	{Opt_lazy, "lazy"},
+	{Opt_idle_timeout, "idle_timeout=%u"},
+	{Opt_err, NULL},
+};
+
+/*
+ * clientopts= is handed to every client file system mount as is.
+ * Options are split on commas, so it can only carry one client option
+ * (user_xattr for ext2, for instance).
+ */
+
+static int chunkfs_parse_options(char *options,
+				 struct chunkfs_mount_opts *opts)
+{
+	substring_t args[MAX_OPT_ARGS];
+	char *p;
+	char *name;
+	int token;
+	int policy;
+	int option;
+
+	if (!options)
+		return 0;
+
+	while ((p = strsep(&options, ",")) != NULL) {
+		if (!*p)
+			continue;
+		token = match_token(p, tokens, args);
+		switch (token) {
+		case Opt_placement:
+			name = match_strdup(&args[0]);
+			if (!name)
+				return -ENOMEM;
+			policy = chunkfs_placement_policy(name);
+			kfree(name);
+			if (policy < 0) {
+				printk(KERN_ERR "chunkfs: unknown placement policy\n");
+				return -EINVAL;
+			}
+			opts->mo_placement = policy;
+			break;
+		case Opt_clientopts:
+			kfree(opts->mo_client_opts);
+			opts->mo_client_opts = match_strdup(&args[0]);
+			if (!opts->mo_client_opts)
+				return -ENOMEM;
+			break;
+		case Opt_lazy:
+			opts->mo_lazy = 1;
+			break;
+		case Opt_idle_timeout:
+			if (match_int(&args[0], &option) || option < 0)
+				return -EINVAL;
+			opts->mo_idle_timeout = option;
+			break;
+		default:
+			printk(KERN_ERR "chunkfs: unrecognized mount option \"%s\"\n", p);
+			return -EINVAL;
+		}
+	}
+	return 0;
+}
+
 /*
  * chunkfs_setup_super does all things that are shared between mount
  * and remount.  At moment, I'm not sure what they are.
@@ -471,8 +1173,57 @@ static int chunkfs_setup_super(struct super_block *sb,
  * XXX todo, put dev summary copies in chunk summaries.
  */
 
+static int chunkfs_stats_show(struct seq_file *m, void *v)
+{
+	struct chunkfs_pool_info *pi = m->private;
+	struct chunkfs_stats sum = { 0 };
+	u64 *to = (u64 *) &sum;
+	u64 *from;
+	int cpu;
+	int i;
+
+	for_each_possible_cpu(cpu) {
+		from = (u64 *) per_cpu_ptr(pi->pi_stats, cpu);
+		for (i = 0; i < sizeof(sum) / sizeof(u64); i++)
+			to[i] += from[i];
+	}
+
+#define show(name)	seq_printf(m, #name " %llu\n",			\
+				   (unsigned long long) sum.st_##name)
+	show(lookups);
+	show(map_builds);
+	show(hops);
+	show(xattr_loads);
+	show(reads);
+	show(read_hops);
+	show(creates);
+	show(cross_creates);
+	show(client_opens);
+	show(fsyncs);
+	show(fsync_conts);
+#undef show
+	return 0;
+}
+
+static int chunkfs_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, chunkfs_stats_show, inode->i_private);
+}
+
+static const struct file_operations chunkfs_stats_fops = {
+	.owner		= THIS_MODULE,
+	.open		= chunkfs_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
 static int chunkfs_fill_super(struct super_block *sb, void *data, int silent)
 {
+	struct chunkfs_mount_opts opts = {
+		.mo_placement = CHUNKFS_PLACE_LEAST_FULL,
+		.mo_idle_timeout = CHUNKFS_DEFAULT_IDLE_TIMEOUT,
+	};
 	struct chunkfs_pool_info *pi;
 	int retval = -EINVAL;
 
@@ -485,9 +1236,18 @@ static int chunkfs_fill_super(struct super_block *sb, void *data, int silent)
 	if (sb_set_blocksize(sb, CHUNKFS_BLK_SIZE) == 0)
 		goto out;
 
-	retval = chunkfs_read_pool(sb, &pi);
-	if (retval)
+	retval = chunkfs_parse_options(data, &opts);
+	if (retval) {
+		kfree(opts.mo_client_opts);
+		goto out;
+	}
+
+	/* Takes over opts.mo_client_opts if it succeeds */
+	retval = chunkfs_read_pool(sb, &opts, &pi);
+	if (retval) {
+		kfree(opts.mo_client_opts);
 		goto out;
+	}
 	sb->s_fs_info = pi;
 	sb->s_op = &chunkfs_sops;
 
@@ -498,6 +1258,17 @@ static int chunkfs_fill_super(struct super_block *sb, void *data, int silent)
 
 	chunkfs_setup_super (sb, pi, sb->s_flags & MS_RDONLY);
 
+	if (chunkfs_debugfs_root)
+		pi->pi_debugfs = debugfs_create_dir(sb->s_id,
+						    chunkfs_debugfs_root);
+	if (pi->pi_debugfs)
+		debugfs_create_file("stats", S_IRUGO, pi->pi_debugfs, pi,
+				    &chunkfs_stats_fops);
+	chunkfs_placement_debugfs(sb);
+	chunkfs_start_pool_stats(pi);
+	chunkfs_start_idle_work(pi);
+	chunkfs_start_clean(pi);
+
 	printk(KERN_ERR "chunkfs: mounted file system\n");
 	mutex_lock(&chunkfs_kernel_mutex);
 	return 0;
@@ -536,7 +1307,19 @@ static struct file_system_type chunkfs_fs_type = {
 
 static int __init init_chunkfs_fs(void)
 {
-	int err = register_filesystem(&chunkfs_fs_type);
+	int err;
+
+	chunkfs_wq = alloc_workqueue("chunkfs", WQ_UNBOUND | WQ_MEM_RECLAIM, 0);
+	if (!chunkfs_wq)
+		return -ENOMEM;
+
+	err = chunkfs_part_init();
+	if (err) {
+		destroy_workqueue(chunkfs_wq);
+		return err;
+	}
+
+	err = register_filesystem(&chunkfs_fs_type);
 	if (!err)
 		printk(KERN_INFO "chunkfs (C) 2007 Valerie Henson <val@nmt.edu>\n");
 
@@ -546,13 +1329,21 @@ static int __init init_chunkfs_fs(void)
 	if (!chunkfs_inode_cachep)
 		err = -ENOMEM;
 
+	/* Debugfs is optional, carry on without it */
+	chunkfs_debugfs_root = debugfs_create_dir("chunkfs", NULL);
+	if (IS_ERR(chunkfs_debugfs_root))
+		chunkfs_debugfs_root = NULL;
+
 	return err;
 }
 
 static void __exit exit_chunkfs_fs(void)
 {
 	unregister_filesystem(&chunkfs_fs_type);
+	debugfs_remove_recursive(chunkfs_debugfs_root);
 	kmem_cache_destroy(chunkfs_inode_cachep);
+	chunkfs_part_exit();
+	destroy_workqueue(chunkfs_wq);
 }
 
 MODULE_AUTHOR("Val Henson");
@@ -58,47 +58,21 @@ if [ "$?" != "0" ]; then
     exit 1
 fi
 
-# XXX Wow, like, such a hack.  Set up a bunch of block devices
-# starting at different offsets in order to create ext2 file systems
-# inside chunks.  losetup doesn't include an end argument, so there's
-# no protection against one file system having a bug that scribbles
-# over the following file systems.  Also, mkfs should do this
-# directly.
-#
-# XXX More hackery.  Mount all our client fs's so that chunkfs kernel
-# side can lookup the path and grab the superblocks.
+# XXX Still a hack: borrow a loop device at each chunk's offset just
+# long enough to make an ext2 file system inside it.  Chunkfs mounts
+# the client file systems itself, and creates the root directory and
+# continuation directories as it needs them.
 
 OFFSETS="`awk '/clientfs: start/ {print $3}' /tmp/offsetlist`"
-loop_num=$((1))
 for offset in ${OFFSETS}; do
-    losetup -o $offset /dev/loop$loop_num ${FILE}
-    mke2fs -b 4096 /dev/loop$loop_num 2559 > /dev/null
-    mkdir -p /chunk${loop_num}
-    mount -t ext2 -o user_xattr /dev/loop${loop_num} /chunk${loop_num}
-    if [ "$?" != "0" ]; then
-	echo "mount client fs failed"
-	exit 1
-    fi
-    # Only the root chunk has the root directory
-    if [ "$loop_num" == "1" ]; then
-	mkdir -p /chunk${loop_num}/root
-	# Create continuation data
-	# Hackity hack.  Just create it on /root if it doesn't already
-	# exist.
-	/usr/local/usr/bin/setfattr -n user.next -v 0 /chunk${loop_num}/root
-	/usr/local/usr/bin/setfattr -n user.prev -v 0 /chunk${loop_num}/root
-	/usr/local/usr/bin/setfattr -n user.start -v 0 /chunk${loop_num}/root
-	/usr/local/usr/bin/setfattr -n user.len -v 40960 /chunk${loop_num}/root
-    fi
-    for i in 0 1 2 3 4 5 6 7 8 9 private; do
-	mkdir -p /chunk${loop_num}/$i
-    done
-    loop_num=$((loop_num + 1))
+    losetup -o $offset /dev/loop1 ${FILE}
+    mke2fs -b 4096 /dev/loop1 2559 > /dev/null
+    losetup -d /dev/loop1
 done
 
-${BINPATH}/mount_chunkfs /dev/loop0 ${MNT}
+mount -t chunkfs -o clientopts=user_xattr /dev/loop0 ${MNT}
 if [ "$?" != "0" ]; then
-    echo "mount_chunkfs failed"
+    echo "mount chunkfs failed"
     exit 1
 fi
 
@@ -119,7 +93,21 @@ ls -l /mnt/a_symlink
 cat /mnt/a_symlink
 dd if=/dev/zero of=/mnt/big bs=4096 count=11
 ls -l /mnt/big
-ls -l /chunk1/root/big
-ls -l /chunk2/1/29
+
+# A file grown by truncate has to keep its size once the inode is
+# read back in from the clients
+touch /mnt/truncated
+truncate -s 1000000 /mnt/truncated
+umount ${MNT}
+mount -t chunkfs -o clientopts=user_xattr /dev/loop0 ${MNT}
+if [ "$?" != "0" ]; then
+    echo "remount chunkfs failed"
+    exit 1
+fi
+SIZE=`stat -c %s /mnt/truncated`
+if [ "$SIZE" != "1000000" ]; then
+    echo "truncated file is $SIZE bytes after remount, not 1000000"
+    exit 1
+fi
 
 exit 0
@@ -1,9 +1,52 @@
 /*
  * Write a pattern to a file.
  *
+ * With no options, writes 32MB of '5' in 4KB writes, which is what
+ * the test scripts use to make a disk image.  The options turn it
+ * into a throughput and latency benchmark:
+ *
+ *   -m seq|rand|append|verify	What to do (default seq)
+ *   -b <bytes>		I/O size (default 4k)
+ *   -s <bytes>		File size (default 32m)
+ *   -t <threads>	Threads (default 1)
+ *   -f <files>		Files; more than one are named <file>.0, <file>.1...
+ *   -d			O_DIRECT
+ *   -F			fsync each file at the end, counted in the time
+ *   -p			Stamp each 512 bytes with its offset and file
+ *			number, so verify catches misplaced data
+ *   -B <bytes>		Continuation boundaries every <bytes>, for the
+ *			within and cross classes
+ *
+ * Sizes take k, m and g suffixes.  Threads are spread over the files
+ * round robin, so there must be at least one per file; threads
+ * sharing a file split it into slices, except in rand mode, where
+ * each picks offsets from the whole file.  In append mode, threads
+ * sharing a file take turns at its end, each claiming the next block
+ * before writing it.  verify must be given the same options as the
+ * run that wrote the files.
+ *
+ * With -B, operations that cross a continuation boundary are timed
+ * separately from those that don't.  That is only meaningful when -B
+ * matches a layout you know the files have.  chunkfs grows the last
+ * continuation in place while its chunk has room, so where the
+ * boundaries of a file really are depends on what else is in the
+ * pool, and without -B there is no split.
+ *
+ * Output is CSV on stdout; the first column says which kind of row:
+ *
+ *   summary,<mode>,<class>,<threads>,<files>,<block size>,<file size>,
+ *	<direct>,<ops>,<bytes>,<seconds>,<MB/s>,<avg us>,<p50 us>,
+ *	<p99 us>,<max us>
+ *   hist,<mode>,<class>,<low us>,<high us>,<ops>
+ *
+ * Classes are "all", and with -B also "within" and "cross".  Latencies
+ * go in power of two buckets, so percentiles are bucket upper bounds.
+ *
  * (C) 2007 Valerie Henson <val@nmt.edu>
  */
 
+#define _GNU_SOURCE	/* O_DIRECT */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <error.h>
@@ -13,49 +56,442 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <linux/byteorder/little_endian.h>
+
+#include "chunkfs.h"
 
 #define FILE_SIZE (32 * 1024 * 1024)
 
+#define	STAMP_SIZE	512
+#define	NR_BUCKETS	64
+
+enum {
+	MODE_SEQ,
+	MODE_RAND,
+	MODE_APPEND,
+	MODE_VERIFY,
+};
+
+static const char *mode_names[] = { "seq", "rand", "append", "verify" };
+
+enum {
+	CLASS_WITHIN,
+	CLASS_CROSS,
+	NR_CLASSES,
+};
+
+struct hist {
+	unsigned long long ops;
+	unsigned long long bytes;
+	unsigned long long total_ns;
+	unsigned long long max_ns;
+	unsigned long long buckets[NR_BUCKETS];	/* [i] is 2^i to 2^(i+1) ns */
+};
+
+struct worker {
+	pthread_t thread;
+	int id;
+	int file;
+	unsigned long long begin;	/* Slice of the file */
+	unsigned long long end;
+	unsigned long long rand_state;
+	unsigned long long bad;		/* Blocks that failed verify */
+	struct hist hist[NR_CLASSES];
+};
+
+/* Stamped into each 512 bytes with -p */
+struct stamp {
+	__le64 s_offset;
+	__le64 s_file;
+};
+
 static char * cmd;
+static char * file;
+static int mode = MODE_SEQ;
+static unsigned long long block_size = 4096;
+static unsigned long long file_size = FILE_SIZE;
+static int nr_threads = 1;
+static int nr_files = 1;
+static int direct;
+static int do_fsync;
+static int stamp;
+static unsigned long long *boundaries;
+static unsigned long long *append_end;	/* Next offset to append at, per file */
+static unsigned int nr_boundaries;
 
 static void usage (void)
 {
-	fprintf(stderr, "Usage: %s <file>\n", cmd);
+	fprintf(stderr, "Usage: %s [-m seq|rand|append|verify] [-b <block size>] "
+		"[-s <file size>] [-t <threads>] [-f <files>] [-d] [-F] [-p] "
+		"[-B <boundary>] <file>\n", cmd);
 	exit(1);
 }
 
-int main (int argc, char * argv[])
+static unsigned long long parse_size(const char *arg)
+{
+	unsigned long long size;
+	char *end;
+
+	size = strtoull(arg, &end, 0);
+	switch (*end) {
+	case 'g': case 'G':
+		size *= 1024;
+		/* fall through */
+	case 'm': case 'M':
+		size *= 1024;
+		/* fall through */
+	case 'k': case 'K':
+		size *= 1024;
+		end++;
+	}
+	if (*end || end == arg)
+		usage();
+	return size;
+}
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void file_name(char *name, size_t len, int n)
+{
+	if (nr_files == 1)
+		snprintf(name, len, "%s", file);
+	else
+		snprintf(name, len, "%s.%d", file, n);
+}
+
+static void add_boundary(unsigned long long offset)
+{
+	if ((nr_boundaries & (nr_boundaries - 1)) == 0) {
+		boundaries = realloc(boundaries, (nr_boundaries ?
+				     nr_boundaries * 2 : 1) * sizeof(*boundaries));
+		if (!boundaries)
+			error(1, errno, "Cannot allocate boundaries");
+	}
+	boundaries[nr_boundaries++] = offset;
+}
+
+static void make_boundaries(unsigned long long spacing)
+{
+	unsigned long long offset;
+
+	for (offset = spacing; offset < file_size; offset += spacing)
+		add_boundary(offset);
+}
+
+/* Does [offset, offset + len) span a boundary? */
+static int crosses(unsigned long long offset, unsigned long long len)
+{
+	unsigned int lo = 0;
+	unsigned int hi = nr_boundaries;
+
+	/* First boundary after offset */
+	while (lo < hi) {
+		unsigned int mid = (lo + hi) / 2;
+
+		if (boundaries[mid] <= offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo < nr_boundaries && boundaries[lo] < offset + len;
+}
+
+static void account(struct worker *w, unsigned long long offset,
+		    unsigned long long len, unsigned long long ns)
+{
+	struct hist *h = &w->hist[crosses(offset, len) ?
+				  CLASS_CROSS : CLASS_WITHIN];
+	int bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+
+	h->ops++;
+	h->bytes += len;
+	h->total_ns += ns;
+	if (ns > h->max_ns)
+		h->max_ns = ns;
+	h->buckets[bucket]++;
+}
+
+static void fill(char *buf, unsigned long long offset, int n)
+{
+	unsigned long long i;
+
+	memset(buf, '5', block_size);
+	if (!stamp)
+		return;
+	for (i = 0; i + sizeof(struct stamp) <= block_size; i += STAMP_SIZE) {
+		struct stamp *s = (struct stamp *) (buf + i);
+
+		s->s_offset = __cpu_to_le64(offset + i);
+		s->s_file = __cpu_to_le64(n);
+	}
+}
+
+/* xorshift64, good enough for picking offsets */
+static unsigned long long next_rand(struct worker *w)
+{
+	w->rand_state ^= w->rand_state << 13;
+	w->rand_state ^= w->rand_state >> 7;
+	w->rand_state ^= w->rand_state << 17;
+	return w->rand_state;
+}
+
+static void * run_worker(void *arg)
 {
+	struct worker *w = arg;
+	unsigned long long nr_blocks = (w->end - w->begin) / block_size;
+	unsigned long long offset = w->begin;
+	unsigned long long i;
+	char name[4096];
+	char *expect = NULL;
+	char *buf;
+	int flags;
 	int fd;
-	char * file;
-	char buf[4096];
-	int n = 0;
-	int written = 0;
 
-	cmd = argv[0];
+	if (posix_memalign((void **) &buf, 4096, block_size) ||
+	    (mode == MODE_VERIFY &&
+	     posix_memalign((void **) &expect, 4096, block_size)))
+		error(1, ENOMEM, "Cannot allocate buffer");
 
-	if (argc != 2)
-		usage();
+	file_name(name, sizeof(name), w->file);
+	flags = (mode == MODE_VERIFY) ? O_RDONLY : O_CREAT | O_RDWR;
+	if (direct)
+		flags |= O_DIRECT;
+	if ((fd = open(name, flags, S_IRUSR | S_IWUSR)) < 0)
+		error(1, errno, "Cannot open file %s", name);
 
-	file = argv[1];
+	for (i = 0; i < nr_blocks; i++) {
+		unsigned long long start;
+		ssize_t n;
 
-	if ((fd = open(file, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR)) < 0) {
-		error(0, errno, "Cannot open file %s", file);
-		usage();
+		if (mode == MODE_RAND)
+			offset = (next_rand(w) % (file_size / block_size)) *
+				block_size;
+		else if (mode == MODE_APPEND)
+			/*
+			 * Not O_APPEND: the offset has to be known before
+			 * the write to stamp it, and another thread can
+			 * append in between
+			 */
+			offset = __sync_fetch_and_add(&append_end[w->file],
+						      block_size);
+
+		if (mode == MODE_VERIFY) {
+			start = now_ns();
+			n = pread(fd, buf, block_size, offset);
+		} else {
+			fill(buf, offset, w->file);
+			start = now_ns();
+			n = pwrite(fd, buf, block_size, offset);
+		}
+		if (n < 0)
+			error(1, errno, "I/O error on %s at offset %llu", name,
+			      offset);
+		account(w, offset, n, now_ns() - start);
+
+		if (mode == MODE_VERIFY) {
+			fill(expect, offset, w->file);
+			if (n != (ssize_t) block_size ||
+			    memcmp(buf, expect, block_size)) {
+				if (!w->bad)
+					fprintf(stderr, "%s: bad data at offset %llu\n",
+						name, offset);
+				w->bad++;
+			}
+		}
+		offset += block_size;
 	}
 
-	memset(buf, '5', sizeof(buf));
+	if (do_fsync && fsync(fd) < 0)
+		error(1, errno, "Cannot fsync file %s", name);
+	close(fd);
+	free(buf);
+	free(expect);
+	return NULL;
+}
+
+static void merge(struct hist *to, struct hist *from)
+{
+	int i;
+
+	to->ops += from->ops;
+	to->bytes += from->bytes;
+	to->total_ns += from->total_ns;
+	if (from->max_ns > to->max_ns)
+		to->max_ns = from->max_ns;
+	for (i = 0; i < NR_BUCKETS; i++)
+		to->buckets[i] += from->buckets[i];
+}
 
-	while (written < FILE_SIZE) {
-		n = write(fd, buf, sizeof(buf));
-		if (n == -1) {
-			error(0, errno, "Cannot write file %s", file);
+static double percentile_us(struct hist *h, double p)
+{
+	unsigned long long want = h->ops * p;
+	unsigned long long seen = 0;
+	int i;
+
+	for (i = 0; i < NR_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen > want)
+			return (double) (2ULL << i) / 1000;
+	}
+	return h->max_ns / 1000.0;
+}
+
+static void report(const char *class, struct hist *h, double seconds)
+{
+	int i;
+
+	printf("summary,%s,%s,%d,%d,%llu,%llu,%d,%llu,%llu,%.6f,%.2f,%.2f,%.2f,%.2f,%.2f\n",
+	       mode_names[mode], class, nr_threads, nr_files, block_size,
+	       file_size, direct, h->ops, h->bytes, seconds,
+	       h->bytes / seconds / (1024 * 1024),
+	       h->ops ? h->total_ns / 1000.0 / h->ops : 0,
+	       percentile_us(h, 0.5), percentile_us(h, 0.99),
+	       h->max_ns / 1000.0);
+	for (i = 0; i < NR_BUCKETS; i++)
+		if (h->buckets[i])
+			printf("hist,%s,%s,%.3f,%.3f,%llu\n", mode_names[mode],
+			       class, (double) (1ULL << i) / 1000,
+			       (double) (2ULL << i) / 1000, h->buckets[i]);
+}
+
+int main (int argc, char * argv[])
+{
+	static const char *class_names[] = { "within", "cross" };
+	unsigned long long spacing = 0;
+	unsigned long long bad = 0;
+	unsigned long long start;
+	struct hist total[NR_CLASSES];
+	struct hist all;
+	struct worker *workers;
+	double seconds;
+	int opt;
+	int i;
+
+	cmd = argv[0];
+
+	while ((opt = getopt(argc, argv, "m:b:s:t:f:dFpB:")) != -1) {
+		switch (opt) {
+		case 'm':
+			for (mode = 0; mode <= MODE_VERIFY; mode++)
+				if (!strcmp(optarg, mode_names[mode]))
+					break;
+			if (mode > MODE_VERIFY)
+				usage();
+			break;
+		case 'b':
+			block_size = parse_size(optarg);
+			break;
+		case 's':
+			file_size = parse_size(optarg);
+			break;
+		case 't':
+			nr_threads = atoi(optarg);
+			break;
+		case 'f':
+			nr_files = atoi(optarg);
+			break;
+		case 'd':
+			direct = 1;
+			break;
+		case 'F':
+			do_fsync = 1;
+			break;
+		case 'p':
+			stamp = 1;
+			break;
+		case 'B':
+			spacing = parse_size(optarg);
+			break;
+		default:
 			usage();
 		}
-		written += n;
 	}
 
-	close(fd);
+	if (argc - optind != 1 || !block_size || file_size < block_size ||
+	    nr_threads < 1 || nr_files < 1)
+		usage();
+	if (nr_threads < nr_files)
+		error(1, 0, "Need at least as many threads as files");
+	if (direct && block_size % 512)
+		error(1, 0, "O_DIRECT needs a block size that is a multiple of 512");
 
+	file = argv[optind];
+	if (spacing)
+		make_boundaries(spacing);
+
+	append_end = calloc(nr_files, sizeof(*append_end));
+	if (!append_end)
+		error(1, errno, "Cannot allocate append offsets");
+	for (i = 0; mode == MODE_APPEND && i < nr_files; i++) {
+		char name[4096];
+		struct stat st;
+
+		file_name(name, sizeof(name), i);
+		if (stat(name, &st) == 0)
+			append_end[i] = st.st_size;
+	}
+
+	workers = calloc(nr_threads, sizeof(*workers));
+	if (!workers)
+		error(1, errno, "Cannot allocate threads");
+
+	/* Threads sharing a file split it into block aligned slices */
+	for (i = 0; i < nr_threads; i++) {
+		struct worker *w = &workers[i];
+		int sharing = nr_threads / nr_files +
+			(i % nr_files < nr_threads % nr_files);
+		int slice = i / nr_files;
+		unsigned long long blocks = file_size / block_size;
+
+		w->id = i;
+		w->file = i % nr_files;
+		w->begin = blocks * slice / sharing * block_size;
+		w->end = blocks * (slice + 1) / sharing * block_size;
+		w->rand_state = 0x9e3779b97f4a7c15ULL * (i + 1);
+	}
+
+	start = now_ns();
+	for (i = 0; i < nr_threads; i++)
+		if (pthread_create(&workers[i].thread, NULL, run_worker,
+				   &workers[i]))
+			error(1, 0, "Cannot start thread");
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(workers[i].thread, NULL);
+	seconds = (now_ns() - start) / 1e9;
+
+	memset(total, 0, sizeof(total));
+	memset(&all, 0, sizeof(all));
+	for (i = 0; i < nr_threads; i++) {
+		int c;
+
+		for (c = 0; c < NR_CLASSES; c++)
+			merge(&total[c], &workers[i].hist[c]);
+		bad += workers[i].bad;
+	}
+	for (i = 0; i < NR_CLASSES; i++)
+		merge(&all, &total[i]);
+
+	report("all", &all, seconds);
+	/* Without -B everything is "within", which tells nobody anything */
+	for (i = 0; spacing && i < NR_CLASSES; i++)
+		report(class_names[i], &total[i], seconds);
+
+	free(workers);
+	free(boundaries);
+	free(append_end);
+
+	if (bad) {
+		fprintf(stderr, "%llu blocks failed verify\n", bad);
+		return 1;
+	}
 	return 0;
 }